@@ -1,8 +1,8 @@
 """
 CAUTION: UNDER CONSTRUCTION!
 
-This script reads audio from mic, estimates the peak feaquency and plays
-synth sounds with matching frequency.
+This script reads audio from mic, tracks its pitch and plays synth sounds
+with the matching key.
 """
 
 import threading
@@ -13,9 +13,10 @@ import koelsynth
 from functools import lru_cache
 
 sample_rate = 16000
-frame_size = 320 * 2
+frame_size = 160
 gain = 0.2
-fft_size = 1024
+# Smallest confidence of a pitch estimate to trigger a note
+min_confidence = 0.85
 
 @lru_cache()
 def get_synth_params():
@@ -51,40 +52,27 @@ def get_synth_params():
     return synth_params, mod_env, wav_env
 
 
-def get_standard_frequencies():
-    octaves = 6
-    seq = np.arange(12 * octaves)
-    freqs = 110 * 2 ** (seq / 12)
-    return freqs
-
-
-def get_spectrum_peak(frame):
-    frame_fft = np.fft.rfft(frame, fft_size)
-    spectrum = np.abs(frame_fft)
-    min_idx = int(110 / sample_rate * fft_size)
-    max_idx = int(4000 / sample_rate * fft_size)
-    spectrum[:min_idx] = 0
-    spectrum[max_idx:] = 0
-    peak_loc = spectrum.argmax()
-    peak_freq = peak_loc / fft_size * sample_rate
-    return peak_freq, spectrum[peak_loc]
-
-
 prev_trigger = 0
+prev_key = None
 
 
-def process_audio_add_event(mic_data, standard_freqs, sequencer):
-    global prev_trigger
+def process_audio_add_event(mic_data, tracker, sequencer):
+    """Track the pitch of the mic input and start a note on a new key"""
+    global prev_trigger, prev_key
     mic_frame = np.frombuffer(mic_data, dtype=np.float32)
-    peak_freq, peak_val = get_spectrum_peak(mic_frame)
-    if peak_freq < 110:
+    # Pitch tracking runs natively, without the GIL
+    estimates = tracker.process(mic_frame)
+    voiced = [est for est in estimates
+              if est.voiced and est.confidence >= min_confidence]
+    if not voiced:
+        prev_key = None
         return
-    if peak_val < 2:
+    # Nearest key, two octaves down
+    key = round(voiced[-1].key) - 24
+    if key == prev_key:
         return
-    diff = abs(standard_freqs - peak_freq)
-    freq = standard_freqs[diff.argmin()]
-    freq /= 4
-    phase_per_sample = 2.0 * np.pi * (freq / sample_rate)
+    prev_key = key
+    phase_per_sample = koelsynth.key_to_phase_per_sample(key, sample_rate)
     prev_trigger = phase_per_sample
     synth_params, mod_env, wav_env = get_synth_params()
     sequencer.add_fmsynth(synth_params, mod_env, wav_env, phase_per_sample)
@@ -99,7 +87,7 @@ def add_extra_event(sequencer):
 
 
 def main():
-    standard_freqs = get_standard_frequencies()
+    tracker = koelsynth.PitchTracker(sample_rate, min_freq=80, max_freq=1000)
     sequencer = koelsynth.Sequencer(frame_size, gain)
     frame = np.zeros(frame_size, dtype=np.float32)
     pa = pyaudio.PyAudio()
@@ -117,8 +105,7 @@ def main():
         mic_data = stream.read(frame_size)
         if np.random.randint(0, 2) == 0:
             add_extra_event(sequencer)
-        if np.random.randint(0, 2) == 0:
-            process_audio_add_event(mic_data, standard_freqs, sequencer)
+        process_audio_add_event(mic_data, tracker, sequencer)
         sequencer.next(frame)
         stream.write(frame.tobytes())
 
@@ -93,10 +93,11 @@ def handle_sequencer_audio(
     """
     Manage audio stream coming from sequencer.
     """
-    frame = np.zeros(frame_size, dtype=np.float32)
+    # Koelsynth converts the audio to dithered int16 samples directly
+    frame = np.zeros(frame_size, dtype=np.int16)
     pa = pyaudio.PyAudio()
     stream = pa.open(
-        format=pyaudio.paFloat32,
+        format=pyaudio.paInt16,
         channels=1,
         rate=sample_rate,
         output=True,
@@ -105,7 +106,7 @@ def handle_sequencer_audio(
 
     while True:
         with lock:
-            sequencer.next(frame)
+            sequencer.next_pcm(frame, "int16")
         stream.write(frame.tobytes())
 
     # TODO: remove the infinite loop above and handle close
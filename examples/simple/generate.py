@@ -1,6 +1,5 @@
 #/usr/bin/env python
 
-from collections import deque
 import numpy as np
 
 import koelsynth
@@ -54,39 +53,23 @@ events = [
     (600,   [8, 5])
 ]
 
-# Reverse events (to make it easy to pop from the end)
-events = events[::-1]
-
 # Create sequencer
 sequencer = koelsynth.Sequencer(frame_size, gain)
 
-# Output file
-writer = open("audio.raw", "wb")
-frame = np.empty(frame_size, dtype=np.float32)
-
-event = events.pop()
-frame_count = 0
-
-# The main processing loop
-while events or sequencer.get_generator_count() > 0 or event is not None:
-    # Check if we have reached the frame to trigger the event
-    if event is not None and event[0] == frame_count:
+# Frames are rendered natively and streamed to the file from a background
+# thread, so the song is never held in memory.
+with koelsynth.WavWriter("audio.wav", sample_rate, "float32") as writer:
+    frame_count = 0
+    for event_frame, keys in events:
+        # Render audio until the frame where the event is triggered
+        writer.render(sequencer, event_frame - frame_count)
+        frame_count = event_frame
         # For each key in the event, we add an FmSynth event to the sequencer
-        for key_idx in event[1]:
+        for key_idx in keys:
             key_freq = key_frequencies[key_idx]
             phase_per_sample = 2.0 * np.pi * key_freq / sample_rate
             sequencer.add_fmsynth(
                 synth_params, mod_env, wav_env, phase_per_sample
             )
-
-        # Prepare the next event
-        if events:
-            event = events.pop()
-        else:
-            event = None
-
-    # Get audio from the sequencer
-    sequencer.next(frame)
-    # Write to the output file
-    writer.write(frame.tobytes())
-    frame_count += 1
+    # Render the remaining audio of the active events
+    writer.render_until_done(sequencer)
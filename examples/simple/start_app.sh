@@ -14,4 +14,4 @@ pip install -r requirements.txt
 # generate audio
 python generate.py
 # play audio
-play -r16k -b32 -c1 -efloating audio.raw
+play audio.wav
@@ -1,3 +1,5 @@
+import os
+
 from pybind11.setup_helpers import Pybind11Extension, build_ext
 from setuptools import setup
 
@@ -12,6 +14,11 @@ ext_modules = [
         "koelsynth",
         source_files,
         include_dirs=["src"],
+        # Set KOELSYNTH_TRACE=1 to compile in render tracing
+        define_macros=(
+            [("KOELSYNTH_TRACE", None)] if os.environ.get("KOELSYNTH_TRACE")
+            else []
+        ),
     )
 ]
 
@@ -0,0 +1,560 @@
+#ifndef KOELSYNTH_EFFECTS_H
+#define KOELSYNTH_EFFECTS_H
+
+#include <cmath>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include "frame_generator.h"
+
+// Effects applied to the mix of a Sequencer, block by block.
+//
+// A block holds num_channels channels of frame_size samples each, one
+// channel after the other (like the mix of the Sequencer). Effects keep
+// all their state in buffers allocated by prepare(), so processing a
+// block does not allocate. The loops run over whole blocks, with the
+// state in locals, so that the compiler can keep it in registers and
+// vectorize where the recurrence allows it.
+
+namespace signal {
+
+// Level below which the state of an effect counts as silence (-120 dB)
+const float silence_level = 1e-6f;
+
+// Whether all the values are below silence_level
+inline bool is_silent_state(const std::vector<float> &state) {
+    for (float x: state) {
+        if (std::abs(x) > silence_level) {
+            return false;
+        }
+    }
+    return true;
+}
+
+class Effect {
+public:
+    // Allocate the state for blocks of num_channels channels of frame_size
+    // samples. Called before the first block, and again (resetting the
+    // state) if the format changes.
+    virtual void prepare(size_t num_channels, size_t frame_size) = 0;
+    // Process a block in place
+    virtual void process(float *block, size_t num_channels,
+                         size_t frame_size) = 0;
+    // New effect with a copy of the complete state. Owned by the caller.
+    virtual Effect* clone() = 0;
+    // Short name of the kind of effect (used in traces)
+    virtual const char* get_name() {
+        return "effect";
+    }
+    // Whether silent input gives silent output from here on, i.e. no tail
+    // (like echoes) is left. True for effects without such state.
+    virtual bool is_silent() {
+        return true;
+    }
+    virtual ~Effect() {}
+};
+
+
+enum class BiquadType {
+    lowpass,
+    highpass,
+    bandpass,
+    notch,
+    peaking,
+    lowshelf,
+    highshelf,
+};
+
+inline BiquadType parse_biquad_type(const std::string &name) {
+    if (name == "lowpass") {
+        return BiquadType::lowpass;
+    } else if (name == "highpass") {
+        return BiquadType::highpass;
+    } else if (name == "bandpass") {
+        return BiquadType::bandpass;
+    } else if (name == "notch") {
+        return BiquadType::notch;
+    } else if (name == "peaking") {
+        return BiquadType::peaking;
+    } else if (name == "lowshelf") {
+        return BiquadType::lowshelf;
+    } else if (name == "highshelf") {
+        return BiquadType::highshelf;
+    }
+    throw std::invalid_argument("unknown filter type: " + name);
+}
+
+// Coefficients of a biquad section, normalized so that a0 is 1
+struct BiquadCoeffs {
+    float b0 = 1.0f;
+    float b1 = 0.0f;
+    float b2 = 0.0f;
+    float a1 = 0.0f;
+    float a2 = 0.0f;
+};
+
+// Biquad coefficients from the Audio EQ Cookbook (R. Bristow-Johnson).
+// freq    : corner or center frequency in radians per sample (like
+//           phase_per_sample), between 0 and pi
+// q       : quality factor
+// gain_db : gain for peaking and shelving filters
+inline BiquadCoeffs make_biquad(BiquadType type, float freq, float q = 0.7071f,
+                                float gain_db = 0.0f) {
+    if (!(freq > 0) || !(freq < M_PI) || !(q > 0)) {
+        throw std::invalid_argument("invalid filter frequency or q");
+    }
+    double w0 = freq;
+    double cos_w0 = cos(w0);
+    double alpha = sin(w0) / (2 * q);
+    double amp = pow(10.0, gain_db / 40.0);
+    double sqrt_amp_alpha = 2 * sqrt(amp) * alpha;
+    double b0 = 1, b1 = 0, b2 = 0, a0 = 1, a1 = 0, a2 = 0;
+
+    switch (type) {
+    case BiquadType::lowpass:
+        b0 = (1 - cos_w0) / 2;
+        b1 = 1 - cos_w0;
+        b2 = (1 - cos_w0) / 2;
+        a0 = 1 + alpha;
+        a1 = -2 * cos_w0;
+        a2 = 1 - alpha;
+        break;
+    case BiquadType::highpass:
+        b0 = (1 + cos_w0) / 2;
+        b1 = -(1 + cos_w0);
+        b2 = (1 + cos_w0) / 2;
+        a0 = 1 + alpha;
+        a1 = -2 * cos_w0;
+        a2 = 1 - alpha;
+        break;
+    case BiquadType::bandpass:
+        // Constant 0 dB peak gain
+        b0 = alpha;
+        b1 = 0;
+        b2 = -alpha;
+        a0 = 1 + alpha;
+        a1 = -2 * cos_w0;
+        a2 = 1 - alpha;
+        break;
+    case BiquadType::notch:
+        b0 = 1;
+        b1 = -2 * cos_w0;
+        b2 = 1;
+        a0 = 1 + alpha;
+        a1 = -2 * cos_w0;
+        a2 = 1 - alpha;
+        break;
+    case BiquadType::peaking:
+        b0 = 1 + alpha * amp;
+        b1 = -2 * cos_w0;
+        b2 = 1 - alpha * amp;
+        a0 = 1 + alpha / amp;
+        a1 = -2 * cos_w0;
+        a2 = 1 - alpha / amp;
+        break;
+    case BiquadType::lowshelf:
+        b0 = amp * ((amp + 1) - (amp - 1) * cos_w0 + sqrt_amp_alpha);
+        b1 = 2 * amp * ((amp - 1) - (amp + 1) * cos_w0);
+        b2 = amp * ((amp + 1) - (amp - 1) * cos_w0 - sqrt_amp_alpha);
+        a0 = (amp + 1) + (amp - 1) * cos_w0 + sqrt_amp_alpha;
+        a1 = -2 * ((amp - 1) + (amp + 1) * cos_w0);
+        a2 = (amp + 1) + (amp - 1) * cos_w0 - sqrt_amp_alpha;
+        break;
+    case BiquadType::highshelf:
+        b0 = amp * ((amp + 1) + (amp - 1) * cos_w0 + sqrt_amp_alpha);
+        b1 = -2 * amp * ((amp - 1) + (amp + 1) * cos_w0);
+        b2 = amp * ((amp + 1) + (amp - 1) * cos_w0 - sqrt_amp_alpha);
+        a0 = (amp + 1) - (amp - 1) * cos_w0 + sqrt_amp_alpha;
+        a1 = 2 * ((amp - 1) - (amp + 1) * cos_w0);
+        a2 = (amp + 1) - (amp - 1) * cos_w0 - sqrt_amp_alpha;
+        break;
+    }
+
+    BiquadCoeffs coeffs;
+    coeffs.b0 = static_cast<float>(b0 / a0);
+    coeffs.b1 = static_cast<float>(b1 / a0);
+    coeffs.b2 = static_cast<float>(b2 / a0);
+    coeffs.a1 = static_cast<float>(a1 / a0);
+    coeffs.a2 = static_cast<float>(a2 / a0);
+    return coeffs;
+}
+
+
+// Biquad sections in series (like a parametric EQ), in transposed direct
+// form II, for every channel
+class BiquadCascade: public Effect {
+    std::vector<BiquadCoeffs> sections;
+    // Two state values per section and channel
+    std::vector<float> state;
+
+    friend class Signal_Tester;
+
+public:
+    BiquadCascade(const std::vector<BiquadCoeffs> &sections_):
+        sections(sections_) {
+    }
+
+    virtual void prepare(size_t num_channels, size_t frame_size) {
+        (void) frame_size;
+        state.assign(2 * sections.size() * num_channels, 0.0f);
+    }
+
+    virtual void process(float *block, size_t num_channels,
+                         size_t frame_size) {
+        for (size_t ch = 0; ch < num_channels; ch++) {
+            float *data = block + ch * frame_size;
+            for (size_t sec = 0; sec < sections.size(); sec++) {
+                const BiquadCoeffs &c = sections[sec];
+                float *s = &state[2 * (ch * sections.size() + sec)];
+                float s1 = s[0];
+                float s2 = s[1];
+                for (size_t ii = 0; ii < frame_size; ii++) {
+                    float x = data[ii];
+                    float y = c.b0 * x + s1;
+                    s1 = c.b1 * x - c.a1 * y + s2;
+                    s2 = c.b2 * x - c.a2 * y;
+                    data[ii] = y;
+                }
+                // Flush denormals after a decay to silence
+                s[0] = std::abs(s1) < 1e-20f ? 0.0f : s1;
+                s[1] = std::abs(s2) < 1e-20f ? 0.0f : s2;
+            }
+        }
+    }
+
+    virtual Effect* clone() {
+        return new BiquadCascade(*this);
+    }
+
+    virtual const char* get_name() {
+        return "biquad";
+    }
+
+    virtual bool is_silent() {
+        return is_silent_state(state);
+    }
+
+    size_t get_section_count() {
+        return sections.size();
+    }
+
+    const std::vector<BiquadCoeffs>& get_sections() {
+        return sections;
+    }
+};
+
+
+// Saturates smoothly towards +-ceiling, like tanh(drive * x), with a
+// rational approximation of tanh that has no branches (vectorizes).
+// Small signals are scaled by drive; at drive 1 they pass nearly unchanged.
+class SoftClipper: public Effect {
+    float drive = 1.0f;
+    float ceiling = 1.0f;
+
+public:
+    SoftClipper(float drive_ = 1.0f, float ceiling_ = 1.0f):
+        drive(drive_),
+        ceiling(ceiling_) {
+        if (!(drive > 0) || !(ceiling > 0)) {
+            throw std::invalid_argument("drive and ceiling must be positive");
+        }
+    }
+
+    virtual void prepare(size_t num_channels, size_t frame_size) {
+        (void) num_channels;
+        (void) frame_size;
+    }
+
+    virtual void process(float *block, size_t num_channels,
+                         size_t frame_size) {
+        size_t count = num_channels * frame_size;
+        float scale = drive / ceiling;
+        for (size_t ii = 0; ii < count; ii++) {
+            // tanh(x) ~ x (27 + x^2) / (27 + 9 x^2), which reaches 1 at 3
+            float x = std::min(std::max(block[ii] * scale, -3.0f), 3.0f);
+            float x2 = x * x;
+            block[ii] = ceiling * x * (27 + x2) / (27 + 9 * x2);
+        }
+    }
+
+    virtual Effect* clone() {
+        return new SoftClipper(*this);
+    }
+
+    virtual const char* get_name() {
+        return "soft_clip";
+    }
+
+    float get_drive() {
+        return drive;
+    }
+
+    float get_ceiling() {
+        return ceiling;
+    }
+};
+
+
+// Keeps the peaks of all the channels at or below threshold. The gain
+// drops at once when a peak would exceed the threshold, and recovers
+// exponentially with the release time.
+class Limiter: public Effect {
+    float threshold = 1.0f;
+    // Recovery time in samples
+    float release = 4800.0f;
+    // Per sample factor of the recovery
+    float release_coeff = 0.0f;
+    // Current gain
+    float gain = 1.0f;
+    // Gain for every sample of the block
+    std::vector<float> gains;
+
+public:
+    // threshold_ : highest output level
+    // release    : time (in samples) for the gain to recover by 1/e
+    Limiter(float threshold_ = 0.9f, float release_ = 4800.0f):
+        threshold(threshold_),
+        release(release_) {
+        if (!(threshold > 0) || !(release > 0)) {
+            throw std::invalid_argument(
+                "threshold and release must be positive");
+        }
+        release_coeff = expf(-1.0f / release);
+    }
+
+    virtual void prepare(size_t num_channels, size_t frame_size) {
+        (void) num_channels;
+        gains.assign(frame_size, 1.0f);
+    }
+
+    virtual void process(float *block, size_t num_channels,
+                         size_t frame_size) {
+        // The gain follows the peak over the channels, sample by sample
+        float g = gain;
+        for (size_t ii = 0; ii < frame_size; ii++) {
+            float peak = 0;
+            for (size_t ch = 0; ch < num_channels; ch++) {
+                peak = std::max(peak, std::abs(block[ch * frame_size + ii]));
+            }
+            g = 1.0f - (1.0f - g) * release_coeff;
+            if (peak * g > threshold) {
+                g = threshold / peak;
+            }
+            gains[ii] = g;
+        }
+        gain = g;
+        for (size_t ch = 0; ch < num_channels; ch++) {
+            float *data = block + ch * frame_size;
+            for (size_t ii = 0; ii < frame_size; ii++) {
+                data[ii] *= gains[ii];
+            }
+        }
+    }
+
+    virtual Effect* clone() {
+        return new Limiter(*this);
+    }
+
+    virtual const char* get_name() {
+        return "limiter";
+    }
+
+    float get_gain() {
+        return gain;
+    }
+
+    float get_threshold() {
+        return threshold;
+    }
+
+    float get_release() {
+        return release;
+    }
+};
+
+
+// Echoes: every output sample is the input plus mix times the delayed
+// signal, where the delayed signal is the input plus feedback times the
+// delayed signal from one delay earlier.
+class FeedbackDelay: public Effect {
+    size_t delay = 1;
+    float feedback = 0.0f;
+    float mix = 0.0f;
+    // A ring of delay samples per channel
+    std::vector<float> lines;
+    // Position in the rings of the sample from delay samples ago
+    size_t pos = 0;
+
+    friend class Signal_Tester;
+
+public:
+    // delay_    : delay in samples
+    // feedback_ : gain of the signal fed back into the delay (below 1)
+    // mix_      : gain of the delayed signal in the output
+    FeedbackDelay(size_t delay_, float feedback_ = 0.3f, float mix_ = 0.3f):
+        delay(delay_),
+        feedback(feedback_),
+        mix(mix_) {
+        if (delay == 0) {
+            throw std::invalid_argument("delay must be positive");
+        }
+        if (!(std::abs(feedback) < 1)) {
+            throw std::invalid_argument("feedback must be below 1");
+        }
+    }
+
+    virtual void prepare(size_t num_channels, size_t frame_size) {
+        (void) frame_size;
+        lines.assign(num_channels * delay, 0.0f);
+        pos = 0;
+    }
+
+    virtual void process(float *block, size_t num_channels,
+                         size_t frame_size) {
+        // Within a chunk that does not wrap around the ring, no sample
+        // depends on another, so the inner loop vectorizes
+        size_t done = 0;
+        while (done < frame_size) {
+            size_t chunk = std::min(frame_size - done, delay - pos);
+            for (size_t ch = 0; ch < num_channels; ch++) {
+                float *__restrict data = block + ch * frame_size + done;
+                float *__restrict line = lines.data() + ch * delay + pos;
+                for (size_t ii = 0; ii < chunk; ii++) {
+                    float x = data[ii];
+                    float delayed = line[ii];
+                    data[ii] = x + mix * delayed;
+                    // Flush denormals while the echoes decay to silence
+                    float fed = x + feedback * delayed;
+                    line[ii] = std::abs(fed) < 1e-20f ? 0.0f : fed;
+                }
+            }
+            done += chunk;
+            pos += chunk;
+            if (pos == delay) {
+                pos = 0;
+            }
+        }
+    }
+
+    virtual Effect* clone() {
+        return new FeedbackDelay(*this);
+    }
+
+    virtual const char* get_name() {
+        return "delay";
+    }
+
+    virtual bool is_silent() {
+        return is_silent_state(lines);
+    }
+
+    size_t get_delay() {
+        return delay;
+    }
+
+    float get_feedback() {
+        return feedback;
+    }
+
+    float get_mix() {
+        return mix;
+    }
+};
+
+
+// Effects applied one after the other
+class EffectsChain {
+    // Owned
+    std::vector<Effect*> effects;
+    size_t num_channels = 1;
+    size_t frame_size = DEFAULT_FRAME_SIZE;
+
+public:
+    EffectsChain(size_t num_channels_ = 1,
+                 size_t frame_size_ = DEFAULT_FRAME_SIZE):
+        num_channels(num_channels_),
+        frame_size(frame_size_) {
+    }
+
+    // Copies the effects with their state
+    EffectsChain(const EffectsChain &other):
+        num_channels(other.num_channels),
+        frame_size(other.frame_size) {
+        try {
+            for (auto effect: other.effects) {
+                effects.push_back(nullptr);
+                effects.back() = effect->clone();
+            }
+        } catch (...) {
+            clear();
+            throw;
+        }
+    }
+
+    EffectsChain& operator=(const EffectsChain&) = delete;
+
+    // Change the block format, preparing every effect for it again
+    void prepare(size_t num_channels_, size_t frame_size_) {
+        num_channels = num_channels_;
+        frame_size = frame_size_;
+        for (auto effect: effects) {
+            effect->prepare(num_channels, frame_size);
+        }
+    }
+
+    // Append an effect (owned by the chain from here on, and deleted if
+    // it cannot be added)
+    void add(Effect *effect) {
+        std::unique_ptr<Effect> owned(effect);
+        owned->prepare(num_channels, frame_size);
+        effects.push_back(owned.get());
+        owned.release();
+    }
+
+    void clear() {
+        for (auto effect: effects) {
+            delete effect;
+        }
+        effects.clear();
+    }
+
+    bool empty() {
+        return effects.empty();
+    }
+
+    size_t size() {
+        return effects.size();
+    }
+
+    // Effect at position index of the chain (owned by the chain)
+    Effect* get(size_t index) {
+        return effects.at(index);
+    }
+
+    // No effect has a tail left (see Effect::is_silent)
+    bool is_silent() {
+        for (auto effect: effects) {
+            if (!effect->is_silent()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void process(float *block) {
+        for (auto effect: effects) {
+            effect->process(block, num_channels, frame_size);
+        }
+    }
+
+    ~EffectsChain() {
+        clear();
+    }
+};
+
+}
+
+#endif
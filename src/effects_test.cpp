@@ -0,0 +1,321 @@
+
+#include <cmath>
+#include <vector>
+
+#include "simple_tester.h"
+#include "effects.h"
+#include "sequencer.h"
+#include "signal_generators.h"
+
+namespace signal {
+
+using tester::TestError;
+
+std::vector<float> make_sine(float freq, float amplitude, size_t size) {
+    std::vector<float> sine(size);
+    for (size_t ii = 0; ii < size; ii++) {
+        sine[ii] = amplitude * sinf(freq * ii);
+    }
+    return sine;
+}
+
+// Run an effect over a mono signal, frame by frame
+void process_mono(Effect &effect, std::vector<float> &signal,
+                  size_t frame_size) {
+    effect.prepare(1, frame_size);
+    std::vector<float> block(frame_size);
+    for (size_t start = 0; start < signal.size(); start += frame_size) {
+        size_t count = std::min(frame_size, signal.size() - start);
+        std::fill(block.begin(), block.end(), 0.0f);
+        std::copy(signal.begin() + start, signal.begin() + start + count,
+                  block.begin());
+        effect.process(block.data(), 1, frame_size);
+        std::copy(block.begin(), block.begin() + count,
+                  signal.begin() + start);
+    }
+}
+
+float peak_after(const std::vector<float> &signal, size_t start) {
+    float peak = 0;
+    for (size_t ii = start; ii < signal.size(); ii++) {
+        peak = std::max(peak, std::abs(signal[ii]));
+    }
+    return peak;
+}
+
+// An effect that cannot be prepared, counting its deletions
+class FailingEffect: public Effect {
+    size_t &deleted;
+
+public:
+    FailingEffect(size_t &deleted_):
+        deleted(deleted_) {
+    }
+
+    virtual void prepare(size_t num_channels, size_t frame_size) {
+        (void) num_channels;
+        (void) frame_size;
+        throw std::invalid_argument("cannot prepare");
+    }
+
+    virtual void process(float *block, size_t num_channels,
+                         size_t frame_size) {
+        (void) block;
+        (void) num_channels;
+        (void) frame_size;
+    }
+
+    virtual Effect* clone() {
+        return new FailingEffect(deleted);
+    }
+
+    virtual ~FailingEffect() {
+        deleted++;
+    }
+};
+
+class Signal_Tester {
+public:
+    static void test_BiquadCascade_response() {
+        auto lowpass = make_biquad(BiquadType::lowpass, 0.1f);
+        std::vector<float> low = make_sine(0.01f, 1.0f, 4096);
+        std::vector<float> high = make_sine(2.5f, 1.0f, 4096);
+        BiquadCascade filter1({lowpass, lowpass});
+        BiquadCascade filter2({lowpass, lowpass});
+        process_mono(filter1, low, 64);
+        process_mono(filter2, high, 64);
+        // Past the transient
+        THROW_IF(std::abs(peak_after(low, 2048) - 1.0f) > 0.01f,
+                 "Passband attenuated");
+        THROW_IF(peak_after(high, 2048) > 1e-3f, "Stopband not attenuated");
+
+        // Peaking filter: the gain at the center frequency
+        std::vector<float> center = make_sine(0.2f, 1.0f, 4096);
+        BiquadCascade peaking({make_biquad(BiquadType::peaking, 0.2f, 1.0f,
+                                           6.0f)});
+        process_mono(peaking, center, 64);
+        THROW_IF(std::abs(peak_after(center, 2048) - powf(10, 6.0f / 20))
+                 > 0.01f, "Wrong peaking gain");
+
+        bool thrown = false;
+        try {
+            make_biquad(BiquadType::lowpass, 4.0f);
+        } catch (std::invalid_argument&) {
+            thrown = true;
+        }
+        THROW_IF(!thrown, "Frequency above pi accepted");
+        THROW_IF(parse_biquad_type("highshelf") != BiquadType::highshelf,
+                 "Wrong filter type");
+    }
+
+    static void test_BiquadCascade_reference() {
+        // Two channels in frames of 37 against a direct form I reference
+        std::vector<BiquadCoeffs> sections = {
+            make_biquad(BiquadType::highpass, 0.05f, 0.9f),
+            make_biquad(BiquadType::lowshelf, 0.3f, 0.7f, -4.0f),
+        };
+        size_t frame_size = 37;
+        size_t num_frames = 20;
+        std::vector<std::vector<float>> inputs = {
+            make_sine(0.03f, 0.8f, frame_size * num_frames),
+            make_sine(0.7f, 0.5f, frame_size * num_frames),
+        };
+
+        BiquadCascade filter(sections);
+        filter.prepare(2, frame_size);
+        std::vector<std::vector<float>> outputs(2);
+        std::vector<float> block(2 * frame_size);
+        for (size_t frame = 0; frame < num_frames; frame++) {
+            for (size_t ch = 0; ch < 2; ch++) {
+                std::copy(inputs[ch].begin() + frame * frame_size,
+                          inputs[ch].begin() + (frame + 1) * frame_size,
+                          block.begin() + ch * frame_size);
+            }
+            filter.process(block.data(), 2, frame_size);
+            for (size_t ch = 0; ch < 2; ch++) {
+                outputs[ch].insert(outputs[ch].end(),
+                                   block.begin() + ch * frame_size,
+                                   block.begin() + (ch + 1) * frame_size);
+            }
+        }
+
+        for (size_t ch = 0; ch < 2; ch++) {
+            std::vector<double> signal(inputs[ch].begin(), inputs[ch].end());
+            for (auto &c: sections) {
+                double x1 = 0, x2 = 0, y1 = 0, y2 = 0;
+                for (auto &x: signal) {
+                    double y = c.b0 * x + c.b1 * x1 + c.b2 * x2
+                        - c.a1 * y1 - c.a2 * y2;
+                    x2 = x1;
+                    x1 = x;
+                    y2 = y1;
+                    y1 = y;
+                    x = y;
+                }
+            }
+            for (size_t ii = 0; ii < signal.size(); ii++) {
+                THROW_IF(std::abs(outputs[ch][ii] - signal[ii]) > 1e-4,
+                         "Output differs from the reference");
+            }
+        }
+    }
+
+    static void test_SoftClipper() {
+        SoftClipper clipper(1.0f, 0.8f);
+        std::vector<float> signal;
+        for (int ii = -1000; ii <= 1000; ii++) {
+            signal.push_back(ii * 0.01f);
+        }
+        std::vector<float> input = signal;
+        process_mono(clipper, signal, 64);
+        for (size_t ii = 0; ii < signal.size(); ii++) {
+            THROW_IF(std::abs(signal[ii]) > 0.8f + 1e-6f, "Not bounded");
+            THROW_IF(ii > 0 && signal[ii] < signal[ii - 1], "Not monotonic");
+            float expected = 0.8f * tanhf(input[ii] / 0.8f);
+            THROW_IF(std::abs(signal[ii] - expected) > 0.02f,
+                     "Too far from tanh");
+            if (std::abs(input[ii]) <= 0.05f) {
+                THROW_IF(std::abs(signal[ii] - input[ii]) > 1e-3f,
+                         "Small signals not passed");
+            }
+        }
+    }
+
+    static void test_Limiter() {
+        Limiter limiter(0.9f, 100.0f);
+        std::vector<float> signal = make_sine(0.05f, 3.0f, 2000);
+        std::vector<float> quiet = make_sine(0.05f, 0.1f, 2000);
+        signal.insert(signal.end(), quiet.begin(), quiet.end());
+        process_mono(limiter, signal, 64);
+        THROW_IF(peak_after(signal, 0) > 0.9f + 1e-6f, "Peak above threshold");
+        THROW_IF(std::abs(peak_after(signal, 0) - 0.9f) > 0.01f,
+                 "Loud part not at threshold");
+        // Recovered to unity gain long after the loud part
+        THROW_IF(std::abs(limiter.get_gain() - 1.0f) > 1e-3f,
+                 "Gain not recovered");
+        THROW_IF(std::abs(peak_after(signal, 3500) - 0.1f) > 1e-3f,
+                 "Quiet part changed");
+    }
+
+    static void test_FeedbackDelay() {
+        // Delays shorter and longer than the frame
+        for (size_t delay: {10, 100}) {
+            FeedbackDelay effect(delay, 0.5f, 0.25f);
+            std::vector<float> signal(1000, 0.0f);
+            signal[3] = 1.0f;
+            process_mono(effect, signal, 64);
+            for (size_t ii = 0; ii < signal.size(); ii++) {
+                float expected = 0;
+                if (ii == 3) {
+                    expected = 1.0f;
+                } else if (ii > 3 && (ii - 3) % delay == 0) {
+                    expected = 0.25f * powf(0.5f, (ii - 3) / delay - 1);
+                }
+                THROW_IF(std::abs(signal[ii] - expected) > 1e-6f,
+                         "Wrong echo");
+            }
+        }
+
+        // The echoes decay to exact zeros, not to denormals
+        FeedbackDelay effect(10, 0.5f, 0.25f);
+        std::vector<float> signal(80 * 10, 0.0f);
+        signal[0] = 1.0f;
+        process_mono(effect, signal, 64);
+        for (float value: effect.lines) {
+            THROW_IF(value != 0.0f, "Decayed echo not flushed");
+        }
+
+        bool thrown = false;
+        try {
+            FeedbackDelay effect(10, 1.0f);
+        } catch (std::invalid_argument&) {
+            thrown = true;
+        }
+        THROW_IF(!thrown, "Unstable feedback accepted");
+    }
+
+    static void test_Sequencer_effects() {
+        size_t frame_size = 64;
+        std::vector<float> output(200);
+
+        // The effects run after the gain
+        Sequencer seq(frame_size, 0.5f);
+        seq.add(new ConstantGenerator(1.0f, 1000));
+        seq.add_effect(new Limiter(0.2f));
+        THROW_IF(seq.get_effect_count() != 1, "Effect not added");
+        seq.render(output.data(), output.size());
+        THROW_IF(std::abs(peak_after(output, 0) - 0.2f) > 1e-6f,
+                 "Limiter not after the gain");
+
+        // Without effects, the output is the gain times the mix again
+        seq.clear_effects();
+        seq.render(output.data(), output.size());
+        // The first samples are left from the block with the limiter
+        THROW_IF(std::abs(output.back() - 0.5f) > 1e-6f,
+                 "Output changed without effects");
+
+        // A clone continues with a copy of the effect state
+        Sequencer stereo(frame_size, 0.5f, 2);
+        stereo.add(new ConstantGenerator(1.0f, 300), -1.0f);
+        stereo.add_effect(new FeedbackDelay(150, 0.5f, 0.5f));
+        stereo.render(output.data(), output.size() / 2);
+        Sequencer copy(stereo);
+        std::vector<float> out1(2 * 500);
+        std::vector<float> out2(2 * 500);
+        stereo.render(out1.data(), 500);
+        copy.render(out2.data(), 500);
+        THROW_IF(out1 != out2, "Clone output differs");
+        THROW_IF(peak_after(out1, 0) <= 0, "Delay state lost");
+        for (size_t ii = 1; ii < out1.size(); ii += 2) {
+            THROW_IF(out1[ii] != 0.0f, "Delay leaked into the other channel");
+        }
+
+        // The sequencer is done once the echoes die out, not when the last
+        // generator ends
+        THROW_IF(stereo.get_generator_count() != 0, "Generator not ended");
+        THROW_IF(stereo.is_done(), "Done with echoes left");
+        size_t blocks = 0;
+        while (!stereo.is_done()) {
+            stereo.render(out1.data(), frame_size);
+            blocks++;
+        }
+        // At feedback 0.5, an echo of 0.5 falls below silence_level after
+        // about 19 delays
+        THROW_IF(blocks * frame_size < 15 * 150, "Echoes cut off");
+        Sequencer dry(frame_size, 0.5f);
+        dry.add_effect(new Limiter(0.2f));
+        THROW_IF(!dry.is_done(), "Limiter has no tail");
+
+        // An effect that fails to prepare is deleted, not added
+        size_t deleted = 0;
+        bool thrown = false;
+        try {
+            dry.add_effect(new FailingEffect(deleted));
+        } catch (std::invalid_argument&) {
+            thrown = true;
+        }
+        THROW_IF(!thrown, "Prepare error not passed on");
+        THROW_IF(deleted != 1, "Failed effect leaked");
+        THROW_IF(dry.get_effect_count() != 1, "Failed effect added");
+    }
+};
+
+}
+
+bool test_all() {
+    using namespace signal;
+    using namespace tester;
+
+    TestCollection tests;
+    ADD_TEST(tests, Signal_Tester::test_BiquadCascade_response);
+    ADD_TEST(tests, Signal_Tester::test_BiquadCascade_reference);
+    ADD_TEST(tests, Signal_Tester::test_SoftClipper);
+    ADD_TEST(tests, Signal_Tester::test_Limiter);
+    ADD_TEST(tests, Signal_Tester::test_FeedbackDelay);
+    ADD_TEST(tests, Signal_Tester::test_Sequencer_effects);
+    return run_tests(tests);
+}
+
+int main() {
+    return test_all() ? 1 : 0;
+}
@@ -0,0 +1,626 @@
+#ifndef KOELSYNTH_EVENT_LOG_H
+#define KOELSYNTH_EVENT_LOG_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdexcept>
+
+#include "signal_generators.h"
+#include "effects.h"
+#include "sequencer.h"
+
+// Recording of the events given to a Sequencer, and replay of them.
+//
+// Log format (little endian):
+//   header : "KSEV", u32 version, u32 frame_size, f32 gain,
+//            u32 num_channels
+//   records: u8 type, u64 block, then by type
+//     1 (fmsynth)      : u32 count, f32 harmonics[count], f32 amps[count],
+//                        mod env, env, f32 phase rate, f32 gain,
+//                        f32 pan, f32 spread
+//                        (an env is u32 attack, decay, sustain, release,
+//                        f32 slevel1, slevel2)
+//     2 (control rate) : u32 samples
+//     3 (multirate)    : u8 enable
+//     4 (effect)       : u8 kind, then by kind
+//                        1 (biquad)    : u32 count, then per section
+//                                        f32 b0, b1, b2, a1, a2
+//                        2 (soft clip) : f32 drive, f32 ceiling
+//                        3 (limiter)   : f32 threshold, f32 release
+//                        4 (delay)     : u32 delay, f32 feedback, f32 mix
+//     5 (clear effects): nothing
+//     6 (quality)      : u32 level
+//     7 (frame budget) : f64 seconds, f64 high_load, f64 low_load,
+//                        f64 smoothing, u32 hold_frames, u32 max_level
+// block counts internal blocks from the start of the recording, so replay
+// reproduces the output block by block (except for the quality changes
+// made by a frame budget, which depend on the render time). Version 1 logs
+// (without channels, pan and spread) are still read, as mono.
+
+namespace signal {
+
+const uint32_t EVENT_LOG_VERSION = 3;
+
+enum class EventType: uint8_t {
+    fmsynth = 1,
+    control_rate = 2,
+    multirate = 3,
+    effect = 4,
+    clear_effects = 5,
+    quality = 6,
+    frame_budget = 7,
+};
+
+enum class EffectKind: uint8_t {
+    biquad = 1,
+    soft_clip = 2,
+    limiter = 3,
+    delay = 4,
+};
+
+// An event read from a log
+struct LoggedEvent {
+    EventType type = EventType::fmsynth;
+    size_t block = 0;
+    // For fmsynth
+    FmSynthModParams mod_params;
+    AdsrParams mod_env;
+    AdsrParams env;
+    float phase_rate = 0;
+    float gain = 1.0f;
+    float pan = 0.0f;
+    float spread = 0.0f;
+    // For control_rate, multirate and quality
+    size_t value = 0;
+    // For effect: a new effect with the logged parameters, which replay
+    // clones
+    std::shared_ptr<Effect> effect;
+    // For frame_budget
+    double frame_budget = 0;
+    QualityGovernorParams governor_params;
+};
+
+struct EventLog {
+    size_t frame_size = DEFAULT_FRAME_SIZE;
+    float gain = 1.0f;
+    size_t num_channels = 1;
+    // In the order they were given
+    std::vector<LoggedEvent> events;
+};
+
+
+// Writes every event of the sequencers it listens to into a log file.
+// Generators other than FmSynthGenerator, and effects other than the ones
+// in effects.h, cannot be logged and are counted in get_skipped_count().
+//
+// The listener calls run on the render thread under the sequencer's lock,
+// so they only encode the record and append it to a buffer in memory. A
+// writer thread of the recorder writes the buffer to the file.
+class EventRecorder: public SequencerListener {
+    // Little endian encoding of a record
+    class Record {
+    public:
+        std::vector<uint8_t> bytes;
+
+        void put_bytes(const void *data, size_t size) {
+            auto begin = static_cast<const uint8_t*>(data);
+            bytes.insert(bytes.end(), begin, begin + size);
+        }
+
+        void put_u8(uint8_t value) {
+            bytes.push_back(value);
+        }
+
+        void put_u32(uint32_t value) {
+            for (size_t ii = 0; ii < 4; ii++) {
+                bytes.push_back(static_cast<uint8_t>(value >> (8 * ii)));
+            }
+        }
+
+        void put_u64(uint64_t value) {
+            put_u32(static_cast<uint32_t>(value));
+            put_u32(static_cast<uint32_t>(value >> 32));
+        }
+
+        void put_f32(float value) {
+            uint32_t bits = 0;
+            std::memcpy(&bits, &value, 4);
+            put_u32(bits);
+        }
+
+        void put_f64(double value) {
+            uint64_t bits = 0;
+            std::memcpy(&bits, &value, 8);
+            put_u64(bits);
+        }
+
+        void put_env(const AdsrParams &params) {
+            put_u32(static_cast<uint32_t>(params.attack));
+            put_u32(static_cast<uint32_t>(params.decay));
+            put_u32(static_cast<uint32_t>(params.sustain));
+            put_u32(static_cast<uint32_t>(params.release));
+            put_f32(params.slevel1);
+            put_f32(params.slevel2);
+        }
+    };
+
+    std::ofstream out;
+    // Protects the members below
+    std::mutex mutex;
+    // Signalled when there are bytes to write or the recorder closes
+    std::condition_variable pending_ready;
+    // Encoded records not yet written
+    std::vector<uint8_t> pending;
+    bool closing = false;
+    std::thread writer;
+    // Block count of the sequencer when the recording started
+    size_t start_block = 0;
+    Sequencer *seq = nullptr;
+    size_t event_count = 0;
+    size_t skipped_count = 0;
+
+    Record begin_record(EventType type, size_t block) {
+        Record record;
+        record.put_u8(static_cast<uint8_t>(type));
+        record.put_u64(block - start_block);
+        return record;
+    }
+
+    // Queue an encoded record for the writer
+    void push(const Record &record) {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.insert(pending.end(), record.bytes.begin(),
+                       record.bytes.end());
+        event_count++;
+        pending_ready.notify_one();
+    }
+
+    void write_loop() {
+        std::vector<uint8_t> chunk;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            pending_ready.wait(lock, [&] {
+                return closing || !pending.empty();
+            });
+            if (pending.empty()) {
+                return;
+            }
+            chunk.clear();
+            chunk.swap(pending);
+            lock.unlock();
+            out.write(reinterpret_cast<const char*>(chunk.data()),
+                      chunk.size());
+            lock.lock();
+        }
+    }
+
+public:
+    // Start recording the events of seq (from its next block) to path.
+    // The current settings (control rate, multirate, quality, frame budget
+    // and effects) are recorded first. The effects start from silence on
+    // replay.
+    EventRecorder(const std::string &path, Sequencer &seq_):
+        out(path, std::ios::binary),
+        seq(&seq_) {
+        if (!out) {
+            throw std::runtime_error("failed to open " + path);
+        }
+        Record header;
+        header.put_bytes("KSEV", 4);
+        header.put_u32(EVENT_LOG_VERSION);
+        header.put_u32(static_cast<uint32_t>(seq->get_frame_size()));
+        header.put_f32(seq->get_gain());
+        header.put_u32(static_cast<uint32_t>(seq->get_num_channels()));
+        pending = header.bytes;
+        writer = std::thread(&EventRecorder::write_loop, this);
+
+        start_block = seq->get_block_count();
+        on_control_rate(start_block, seq->get_control_rate());
+        on_multirate(start_block, seq->get_multirate());
+        on_quality(start_block, seq->get_quality());
+        if (seq->get_frame_budget() > 0) {
+            on_frame_budget(start_block, seq->get_frame_budget(),
+                            seq->get_governor_params());
+        }
+        for (size_t ii = 0; ii < seq->get_effect_count(); ii++) {
+            on_add_effect(start_block, seq->get_effect(ii));
+        }
+        seq->set_listener(this);
+    }
+
+    EventRecorder(const EventRecorder&) = delete;
+    EventRecorder& operator=(const EventRecorder&) = delete;
+
+    virtual void on_add(size_t block, FrameGenerator *gen,
+                        float pan, float spread) {
+        auto fm_gen = dynamic_cast<FmSynthGenerator*>(gen);
+        if (fm_gen == nullptr) {
+            std::lock_guard<std::mutex> lock(mutex);
+            skipped_count++;
+            return;
+        }
+        FmSynthModParams mod_params = fm_gen->get_mod_params();
+        Record record = begin_record(EventType::fmsynth, block);
+        record.put_u32(static_cast<uint32_t>(mod_params.harmonics.size()));
+        for (float value: mod_params.harmonics) {
+            record.put_f32(value);
+        }
+        for (float value: mod_params.amps) {
+            record.put_f32(value);
+        }
+        record.put_env(fm_gen->get_mod_env_params());
+        record.put_env(fm_gen->get_env_params());
+        record.put_f32(fm_gen->get_phase_rate());
+        record.put_f32(fm_gen->get_gain());
+        record.put_f32(pan);
+        record.put_f32(spread);
+        push(record);
+    }
+
+    virtual void on_control_rate(size_t block, size_t num_samples) {
+        Record record = begin_record(EventType::control_rate, block);
+        record.put_u32(static_cast<uint32_t>(num_samples));
+        push(record);
+    }
+
+    virtual void on_multirate(size_t block, bool enable) {
+        Record record = begin_record(EventType::multirate, block);
+        record.put_u8(enable ? 1 : 0);
+        push(record);
+    }
+
+    virtual void on_add_effect(size_t block, Effect *effect) {
+        Record record = begin_record(EventType::effect, block);
+        if (auto biquad = dynamic_cast<BiquadCascade*>(effect)) {
+            record.put_u8(static_cast<uint8_t>(EffectKind::biquad));
+            record.put_u32(static_cast<uint32_t>(biquad->get_section_count()));
+            for (const BiquadCoeffs &c: biquad->get_sections()) {
+                for (float value: {c.b0, c.b1, c.b2, c.a1, c.a2}) {
+                    record.put_f32(value);
+                }
+            }
+        } else if (auto clipper = dynamic_cast<SoftClipper*>(effect)) {
+            record.put_u8(static_cast<uint8_t>(EffectKind::soft_clip));
+            record.put_f32(clipper->get_drive());
+            record.put_f32(clipper->get_ceiling());
+        } else if (auto limiter = dynamic_cast<Limiter*>(effect)) {
+            record.put_u8(static_cast<uint8_t>(EffectKind::limiter));
+            record.put_f32(limiter->get_threshold());
+            record.put_f32(limiter->get_release());
+        } else if (auto delay = dynamic_cast<FeedbackDelay*>(effect)) {
+            record.put_u8(static_cast<uint8_t>(EffectKind::delay));
+            record.put_u32(static_cast<uint32_t>(delay->get_delay()));
+            record.put_f32(delay->get_feedback());
+            record.put_f32(delay->get_mix());
+        } else {
+            std::lock_guard<std::mutex> lock(mutex);
+            skipped_count++;
+            return;
+        }
+        push(record);
+    }
+
+    virtual void on_clear_effects(size_t block) {
+        push(begin_record(EventType::clear_effects, block));
+    }
+
+    virtual void on_quality(size_t block, int level) {
+        Record record = begin_record(EventType::quality, block);
+        record.put_u32(static_cast<uint32_t>(level));
+        push(record);
+    }
+
+    virtual void on_frame_budget(size_t block, double seconds,
+                                 const QualityGovernorParams &params) {
+        Record record = begin_record(EventType::frame_budget, block);
+        record.put_f64(seconds);
+        record.put_f64(params.high_load);
+        record.put_f64(params.low_load);
+        record.put_f64(params.smoothing);
+        record.put_u32(static_cast<uint32_t>(params.hold_frames));
+        record.put_u32(static_cast<uint32_t>(params.max_level));
+        push(record);
+    }
+
+    size_t get_event_count() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return event_count;
+    }
+
+    size_t get_skipped_count() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return skipped_count;
+    }
+
+    // Stop listening, write the remaining records and finish the file
+    void close() {
+        if (seq != nullptr) {
+            seq->set_listener(nullptr);
+            seq = nullptr;
+        }
+        if (writer.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                closing = true;
+            }
+            pending_ready.notify_one();
+            writer.join();
+        }
+        if (out.is_open()) {
+            out.close();
+            if (!out) {
+                throw std::runtime_error("failed to write the event log");
+            }
+        }
+    }
+
+    virtual ~EventRecorder() {
+        try {
+            close();
+        } catch (...) {
+        }
+    }
+};
+
+
+// Reads little endian values from a log file
+class EventLogReader {
+    std::ifstream input;
+
+public:
+    EventLogReader(const std::string &path): input(path, std::ios::binary) {
+        if (!input) {
+            throw std::runtime_error("failed to open " + path);
+        }
+    }
+
+    // Returns false at the end of the file
+    bool get_bytes(void *data, size_t size) {
+        input.read(static_cast<char*>(data), size);
+        return static_cast<size_t>(input.gcount()) == size;
+    }
+
+    void get_exact(void *data, size_t size) {
+        if (!get_bytes(data, size)) {
+            throw std::runtime_error("truncated event log");
+        }
+    }
+
+    uint8_t get_u8() {
+        uint8_t value = 0;
+        get_exact(&value, 1);
+        return value;
+    }
+
+    uint32_t get_u32() {
+        uint8_t bytes[4];
+        get_exact(bytes, 4);
+        uint32_t value = 0;
+        for (size_t ii = 0; ii < 4; ii++) {
+            value |= static_cast<uint32_t>(bytes[ii]) << (8 * ii);
+        }
+        return value;
+    }
+
+    uint64_t get_u64() {
+        uint64_t low = get_u32();
+        uint64_t high = get_u32();
+        return low | (high << 32);
+    }
+
+    float get_f32() {
+        uint32_t bits = get_u32();
+        float value = 0;
+        std::memcpy(&value, &bits, 4);
+        return value;
+    }
+
+    double get_f64() {
+        uint64_t bits = get_u64();
+        double value = 0;
+        std::memcpy(&value, &bits, 8);
+        return value;
+    }
+
+    AdsrParams get_env() {
+        AdsrParams params;
+        params.attack = get_u32();
+        params.decay = get_u32();
+        params.sustain = get_u32();
+        params.release = get_u32();
+        params.slevel1 = get_f32();
+        params.slevel2 = get_f32();
+        return params;
+    }
+};
+
+
+// Effect from an effect record
+inline Effect* read_logged_effect(EventLogReader &reader) {
+    switch (static_cast<EffectKind>(reader.get_u8())) {
+    case EffectKind::biquad: {
+        std::vector<BiquadCoeffs> sections(reader.get_u32());
+        for (BiquadCoeffs &c: sections) {
+            c.b0 = reader.get_f32();
+            c.b1 = reader.get_f32();
+            c.b2 = reader.get_f32();
+            c.a1 = reader.get_f32();
+            c.a2 = reader.get_f32();
+        }
+        return new BiquadCascade(sections);
+    }
+    case EffectKind::soft_clip: {
+        float drive = reader.get_f32();
+        float ceiling = reader.get_f32();
+        return new SoftClipper(drive, ceiling);
+    }
+    case EffectKind::limiter: {
+        float threshold = reader.get_f32();
+        float release = reader.get_f32();
+        return new Limiter(threshold, release);
+    }
+    case EffectKind::delay: {
+        size_t delay = reader.get_u32();
+        float feedback = reader.get_f32();
+        float mix = reader.get_f32();
+        return new FeedbackDelay(delay, feedback, mix);
+    }
+    }
+    throw std::runtime_error("unknown effect in event log");
+}
+
+
+inline EventLog read_event_log(const std::string &path) {
+    EventLogReader reader(path);
+    char magic[4];
+    reader.get_exact(magic, 4);
+    if (std::memcmp(magic, "KSEV", 4) != 0) {
+        throw std::runtime_error("not an event log: " + path);
+    }
+    uint32_t version = reader.get_u32();
+    if (version < 1 || version > EVENT_LOG_VERSION) {
+        throw std::runtime_error("unsupported event log version");
+    }
+
+    EventLog log;
+    log.frame_size = reader.get_u32();
+    log.gain = reader.get_f32();
+    if (version >= 2) {
+        log.num_channels = reader.get_u32();
+    }
+    uint8_t type = 0;
+    while (reader.get_bytes(&type, 1)) {
+        LoggedEvent event;
+        event.type = static_cast<EventType>(type);
+        event.block = reader.get_u64();
+        switch (event.type) {
+        case EventType::fmsynth: {
+            size_t count = reader.get_u32();
+            event.mod_params.harmonics.resize(count);
+            event.mod_params.amps.resize(count);
+            for (auto &value: event.mod_params.harmonics) {
+                value = reader.get_f32();
+            }
+            for (auto &value: event.mod_params.amps) {
+                value = reader.get_f32();
+            }
+            event.mod_env = reader.get_env();
+            event.env = reader.get_env();
+            event.phase_rate = reader.get_f32();
+            event.gain = reader.get_f32();
+            if (version >= 2) {
+                event.pan = reader.get_f32();
+                event.spread = reader.get_f32();
+            }
+            break;
+        }
+        case EventType::control_rate:
+            event.value = reader.get_u32();
+            break;
+        case EventType::multirate:
+            event.value = reader.get_u8();
+            break;
+        case EventType::effect:
+            event.effect.reset(read_logged_effect(reader));
+            break;
+        case EventType::clear_effects:
+            break;
+        case EventType::quality:
+            event.value = reader.get_u32();
+            break;
+        case EventType::frame_budget:
+            event.frame_budget = reader.get_f64();
+            event.governor_params.high_load = reader.get_f64();
+            event.governor_params.low_load = reader.get_f64();
+            event.governor_params.smoothing = reader.get_f64();
+            event.governor_params.hold_frames = reader.get_u32();
+            event.governor_params.max_level = reader.get_u32();
+            break;
+        default:
+            throw std::runtime_error("unknown event type in event log");
+        }
+        log.events.push_back(event);
+    }
+    return log;
+}
+
+
+struct ReplayStats {
+    // Internal blocks rendered
+    size_t blocks = 0;
+    size_t samples = 0;
+    // Time taken to render
+    double seconds = 0;
+};
+
+// Drive a fresh Sequencer from the log at full speed, until all the events
+// are added and have ended (with the tails of the effects). The output (interleaved, if the log has more
+// than one channel) is appended to output if given.
+inline ReplayStats replay_event_log(const EventLog &log,
+                                    std::vector<float> *output = nullptr) {
+    Sequencer seq(log.frame_size, log.gain, log.num_channels);
+    std::vector<float> frame(log.frame_size * log.num_channels);
+    ReplayStats stats;
+    size_t next_event = 0;
+
+    auto start_time = std::chrono::steady_clock::now();
+    while (next_event < log.events.size() || !seq.is_done()) {
+        while (next_event < log.events.size()
+               && log.events[next_event].block <= stats.blocks) {
+            const LoggedEvent &event = log.events[next_event];
+            switch (event.type) {
+            case EventType::fmsynth:
+                seq.add(new FmSynthGenerator(
+                    event.mod_params, event.mod_env, event.env,
+                    event.phase_rate, event.gain), event.pan, event.spread);
+                break;
+            case EventType::control_rate:
+                seq.set_control_rate(event.value);
+                break;
+            case EventType::multirate:
+                seq.set_multirate(event.value != 0);
+                break;
+            case EventType::effect:
+                seq.add_effect(event.effect->clone());
+                break;
+            case EventType::clear_effects:
+                seq.clear_effects();
+                break;
+            case EventType::quality:
+                seq.set_quality(static_cast<int>(event.value));
+                break;
+            case EventType::frame_budget:
+                seq.set_frame_budget(event.frame_budget,
+                                     event.governor_params);
+                break;
+            }
+            next_event++;
+        }
+        seq.render(frame.data(), log.frame_size);
+        if (output != nullptr) {
+            output->insert(output->end(), frame.begin(), frame.end());
+        }
+        stats.blocks++;
+    }
+    auto end_time = std::chrono::steady_clock::now();
+    stats.samples = stats.blocks * log.frame_size;
+    stats.seconds = std::chrono::duration<double>(end_time - start_time).count();
+    return stats;
+}
+
+inline ReplayStats replay_event_log(const std::string &path,
+                                    std::vector<float> *output = nullptr) {
+    return replay_event_log(read_event_log(path), output);
+}
+
+}
+
+#endif
@@ -0,0 +1,279 @@
+
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "simple_tester.h"
+#include "signal_generators.h"
+#include "sequencer.h"
+#include "event_log.h"
+
+using tester::TestError;
+using namespace signal;
+
+FmSynthGenerator* make_note(float key, float gain) {
+    AdsrParams mod_env = {
+        .attack = 50,
+        .decay = 200,
+        .sustain = 900,
+        .release = 150,
+        .slevel1 = 0.7,
+        .slevel2 = 0.2,
+    };
+    AdsrParams env = {
+        .attack = 100,
+        .decay = 100,
+        .sustain = 1000,
+        .release = 100,
+    };
+    FmSynthModParams mod_params({2, 3.5f}, {1, 0.5f});
+    return new FmSynthGenerator(
+        mod_params, mod_env, env, key_to_phase_per_sample(key, 16000), gain);
+}
+
+void test_record_replay() {
+    std::string path = "event_log_test.ksev";
+    size_t frame_size = 96;
+    Sequencer seq(frame_size, 0.5f);
+    std::vector<float> chunk(200);
+    // Output before the recording is not part of the log
+    seq.render(chunk.data(), chunk.size());
+    {
+        EventRecorder recorder(path, seq);
+        for (size_t step = 0; step < 30; step++) {
+            if (step % 4 == 0) {
+                seq.add(make_note(cf32(step), 0.3f + 0.01f * step));
+            }
+            if (step == 5) {
+                // Cannot be logged
+                seq.add(new ConstantGenerator(0.1f, 10));
+            }
+            if (step == 7) {
+                seq.post(make_note(20, 0.4f));
+            }
+            if (step == 11) {
+                seq.set_control_rate(16);
+            }
+            if (step == 19) {
+                seq.set_multirate(true);
+            }
+            // Sizes that do not match the block size
+            chunk.resize(70 + 13 * (step % 5));
+            seq.render(chunk.data(), chunk.size());
+        }
+        // Initial settings, 8 + 1 notes, control rate and multirate
+        THROW_IF(recorder.get_event_count() != 3 + 9 + 2,
+                 "Recorded event count mismatch");
+        THROW_IF(recorder.get_skipped_count() != 1, "Skip count mismatch");
+    }
+
+    EventLog log = read_event_log(path);
+    std::remove(path.c_str());
+    THROW_IF(log.frame_size != frame_size, "Frame size mismatch");
+    THROW_IF(log.gain != 0.5f, "Gain mismatch");
+    THROW_IF(log.events.size() != 14, "Event count mismatch");
+    THROW_IF(log.events[0].type != EventType::control_rate ||
+             log.events[1].type != EventType::multirate ||
+             log.events[2].type != EventType::quality,
+             "Initial settings must come first");
+    THROW_IF(log.events[3].block != 0, "First note must be at block 0");
+    for (size_t ii = 1; ii < log.events.size(); ii++) {
+        THROW_IF(log.events[ii].block < log.events[ii - 1].block,
+                 "Blocks must not decrease");
+    }
+    THROW_IF(log.events[3].mod_params.harmonics[1] != 3.5f,
+             "Harmonics mismatch");
+    THROW_IF(log.events[3].mod_env.slevel1 != 0.7f, "Envelope mismatch");
+
+    std::vector<float> replayed;
+    ReplayStats stats = replay_event_log(log, &replayed);
+    THROW_IF(stats.samples != replayed.size(), "Replay size mismatch");
+    THROW_IF(stats.blocks == 0, "Nothing replayed");
+
+    // Replay again: must be deterministic
+    std::vector<float> again;
+    replay_event_log(log, &again);
+    THROW_IF(again != replayed, "Replay is not deterministic");
+}
+
+void test_replay_matches_session() {
+    std::string path = "event_log_test_match.ksev";
+    size_t frame_size = 64;
+    std::vector<float> recorded;
+    {
+        Sequencer seq(frame_size, 0.8f);
+        EventRecorder recorder(path, seq);
+        std::vector<float> chunk(100);
+        for (size_t step = 0; step < 40; step++) {
+            if (step % 6 == 1) {
+                seq.add(make_note(cf32(step % 13), 0.5f));
+            }
+            if (step == 15) {
+                seq.set_control_rate(8);
+            }
+            seq.render(chunk.data(), chunk.size());
+            recorded.insert(recorded.end(), chunk.begin(), chunk.end());
+        }
+        recorder.close();
+    }
+
+    std::vector<float> replayed;
+    replay_event_log(path, &replayed);
+    std::remove(path.c_str());
+    THROW_IF(replayed.size() < recorded.size(), "Replay is too short");
+    for (size_t ii = 0; ii < recorded.size(); ii++) {
+        THROW_IF(replayed[ii] != recorded[ii],
+                 "Replay differs from the recorded session at " +
+                 std::to_string(ii));
+    }
+}
+
+void test_replay_channels() {
+    std::string path = "event_log_test_channels.ksev";
+    size_t frame_size = 64;
+    std::vector<float> recorded;
+    {
+        Sequencer seq(frame_size, 0.8f, 3);
+        EventRecorder recorder(path, seq);
+        std::vector<float> chunk(3 * 100);
+        for (size_t step = 0; step < 30; step++) {
+            if (step % 5 == 1) {
+                seq.add(make_note(cf32(step % 13), 0.5f),
+                        -1.0f + 0.15f * step, 0.1f * (step % 3));
+            }
+            seq.render(chunk.data(), 100);
+            recorded.insert(recorded.end(), chunk.begin(), chunk.end());
+        }
+        recorder.close();
+    }
+
+    EventLog log = read_event_log(path);
+    THROW_IF(log.num_channels != 3, "Channel count mismatch");
+    THROW_IF(log.events[3].pan != -1.0f + 0.15f, "Pan mismatch");
+    THROW_IF(log.events[3].spread != 0.1f, "Spread mismatch");
+    std::vector<float> replayed;
+    replay_event_log(path, &replayed);
+    std::remove(path.c_str());
+    THROW_IF(replayed.size() < recorded.size(), "Replay is too short");
+    for (size_t ii = 0; ii < recorded.size(); ii++) {
+        THROW_IF(replayed[ii] != recorded[ii],
+                 "Replay differs from the recorded session at " +
+                 std::to_string(ii));
+    }
+}
+
+void test_replay_effects() {
+    std::string path = "event_log_test_effects.ksev";
+    size_t frame_size = 64;
+    std::vector<float> recorded;
+    {
+        Sequencer seq(frame_size, 0.8f, 2);
+        // Effects from before the recording are logged too
+        seq.add_effect(new Limiter(0.3f, 1000.0f));
+        EventRecorder recorder(path, seq);
+        std::vector<float> chunk(2 * 100);
+        for (size_t step = 0; step < 60; step++) {
+            if (step % 7 == 0) {
+                seq.add(make_note(cf32(step % 11), 0.5f), 0.5f);
+            }
+            if (step == 5) {
+                seq.add_effect(new FeedbackDelay(150, 0.6f, 0.4f));
+            }
+            if (step == 12) {
+                seq.add_effect(new BiquadCascade({
+                    make_biquad(BiquadType::lowpass, 0.1f),
+                    make_biquad(BiquadType::peaking, 0.05f, 2.0f, 6.0f),
+                }));
+                seq.add_effect(new SoftClipper(2.0f, 0.5f));
+            }
+            if (step == 20) {
+                seq.set_quality(QUALITY_FAST_SINE);
+            }
+            if (step == 40) {
+                seq.clear_effects();
+                seq.add_effect(new FeedbackDelay(40, 0.2f, 0.5f));
+            }
+            seq.render(chunk.data(), 100);
+            recorded.insert(recorded.end(), chunk.begin(), chunk.end());
+        }
+        THROW_IF(recorder.get_skipped_count() != 0, "Effect not logged");
+    }
+
+    EventLog log = read_event_log(path);
+    size_t effect_count = 0;
+    for (auto &event: log.events) {
+        effect_count += event.type == EventType::effect;
+    }
+    THROW_IF(effect_count != 5, "Effect count mismatch");
+    std::vector<float> replayed;
+    replay_event_log(path, &replayed);
+    std::remove(path.c_str());
+    THROW_IF(replayed.size() < recorded.size(), "Replay is too short");
+    for (size_t ii = 0; ii < recorded.size(); ii++) {
+        THROW_IF(replayed[ii] != recorded[ii],
+                 "Replay with effects differs at " + std::to_string(ii));
+    }
+
+    // Frame budgets are logged with the governor parameters
+    {
+        Sequencer seq(frame_size);
+        EventRecorder recorder(path, seq);
+        QualityGovernorParams params;
+        params.high_load = 0.6;
+        params.hold_frames = 5;
+        params.max_level = QUALITY_PRUNED;
+        seq.set_frame_budget(0.004, params);
+        seq.set_frame_budget(0);
+    }
+    log = read_event_log(path);
+    std::remove(path.c_str());
+    const LoggedEvent &budget = log.events[log.events.size() - 2];
+    THROW_IF(budget.type != EventType::frame_budget
+             || budget.frame_budget != 0.004
+             || budget.governor_params.high_load != 0.6
+             || budget.governor_params.hold_frames != 5
+             || budget.governor_params.max_level != QUALITY_PRUNED,
+             "Frame budget mismatch");
+    THROW_IF(log.events.back().frame_budget != 0, "Budget not turned off");
+}
+
+void test_record_while_rendering() {
+    // Recorders attach and detach while another thread renders posted
+    // notes. A closed recorder must not be called any more.
+    std::string path = "event_log_test_threads.ksev";
+    Sequencer seq(64, 0.5f);
+    std::atomic<bool> done {false};
+    std::thread render([&] {
+        std::vector<float> chunk(64);
+        while (!done) {
+            seq.post(make_note(3, 0.2f));
+            seq.render(chunk.data(), chunk.size());
+        }
+    });
+    bool called_after_close = false;
+    for (size_t ii = 0; ii < 50; ii++) {
+        EventRecorder recorder(path, seq);
+        std::this_thread::yield();
+        recorder.close();
+        size_t count = recorder.get_event_count();
+        std::this_thread::yield();
+        called_after_close |= recorder.get_event_count() != count;
+    }
+    done = true;
+    render.join();
+    std::remove(path.c_str());
+    THROW_IF(called_after_close, "Closed recorder still called");
+}
+
+int main() {
+    using namespace tester;
+
+    TestCollection tests;
+    ADD_TEST(tests, test_record_replay);
+    ADD_TEST(tests, test_replay_matches_session);
+    ADD_TEST(tests, test_replay_channels);
+    ADD_TEST(tests, test_replay_effects);
+    ADD_TEST(tests, test_record_while_rendering);
+    return run_tests(tests) ? 1 : 0;
+}
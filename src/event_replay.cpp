@@ -0,0 +1,63 @@
+// Replays an event log at full speed, as a reproducible benchmark.
+//
+// Usage: event_replay log.ksev [repeat] [sample_rate [output.wav]]
+// With the sample rate, the realtime factor is reported, and the output
+// can be written to a WAV file.
+
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <string>
+#include <vector>
+
+#include "event_log.h"
+#include "wav_writer.h"
+
+using namespace signal;
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr,
+                "usage: %s log.ksev [repeat] [sample_rate [output.wav]]\n",
+                argv[0]);
+        return 2;
+    }
+    try {
+        EventLog log = read_event_log(argv[1]);
+        size_t repeat = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 1;
+        if (repeat == 0) {
+            repeat = 1;
+        }
+
+        std::vector<float> output;
+        double best = 0;
+        ReplayStats stats;
+        for (size_t ii = 0; ii < repeat; ii++) {
+            output.clear();
+            stats = replay_event_log(log, &output);
+            if (ii == 0 || stats.seconds < best) {
+                best = stats.seconds;
+            }
+        }
+        printf("events: %zu, blocks: %zu, samples: %zu\n",
+               log.events.size(), stats.blocks, stats.samples);
+        printf("best of %zu: %.6f s, %.2f Msamples/s\n",
+               repeat, best, stats.samples / best / 1e6);
+
+        if (argc > 3) {
+            size_t sample_rate = std::strtoul(argv[3], nullptr, 10);
+            printf("realtime factor at %zu Hz: %.1f\n", sample_rate,
+                   stats.samples / static_cast<double>(sample_rate) / best);
+            if (argc > 4) {
+                WavFile wav(argv[4], sample_rate, SampleFormat::float32,
+                            log.num_channels);
+                wav.write(output.data(), output.size());
+                wav.close();
+            }
+        }
+    } catch (const std::exception &err) {
+        fprintf(stderr, "error: %s\n", err.what());
+        return 1;
+    }
+    return 0;
+}
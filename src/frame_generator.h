@@ -1,10 +1,28 @@
 #ifndef KOELSYNTH_FRAME_GENERATOR_H
 #define KOELSYNTH_FRAME_GENERATOR_H
 
+#include <cmath>
 #include <vector>
 
 #define DEFAULT_FRAME_SIZE (128)
 
+#ifndef M_PI
+    #define M_PI 3.14159265358979323846
+#endif
+
+// Rendering quality levels, from the full quality down to the cheapest.
+// Every level includes the savings of the levels before it.
+enum QualityLevel {
+    QUALITY_FULL = 0,
+    // Skip modulation components above the Nyquist frequency or too weak
+    // to be heard
+    QUALITY_PRUNED = 1,
+    // Use a fast sine approximation in the oscillators
+    QUALITY_FAST_SINE = 2,
+    // Update the control signals less often (see Sequencer)
+    QUALITY_COARSE_CONTROL = 3,
+};
+
 // A top level parent class to handle the behavior of a frame generator object.
 // A frame is a vector of samples.
 class FrameGenerator {
@@ -18,6 +36,39 @@ public:
     virtual bool next_frame(std::vector<float> &frame) = 0;
     // Total number of samples that will be generated
     virtual size_t get_size() = 0;
+    // Sets the number of samples per control signal update (1 means every
+    // sample). Generators without slowly varying control signals ignore it.
+    virtual void set_control_rate(size_t num_samples) {
+        (void) num_samples;
+    }
+    // Trade accuracy for speed (see QualityLevel). Can change at any frame.
+    // Generators without cheaper modes ignore it.
+    virtual void set_quality(int level) {
+        (void) level;
+    }
+    // Highest significant frequency of the output in radians per sample.
+    // Defaults to the Nyquist frequency when it is not known.
+    virtual float get_bandwidth() {
+        return static_cast<float>(M_PI);
+    }
+    // Run at 1/divider of the sample rate: output sample k then stands for
+    // sample k * divider + divider - 1 at the full rate, and get_size()
+    // returns the reduced size. Returns false if it is not supported.
+    virtual bool set_rate_divider(size_t divider) {
+        (void) divider;
+        return false;
+    }
+    // Short name of the kind of generator (used in traces)
+    virtual const char* get_name() {
+        return "generator";
+    }
+    // Number of harmonic components, if any (used in traces)
+    virtual size_t get_num_harmonics() {
+        return 0;
+    }
+    // New generator with a copy of the complete state (like phases and
+    // envelope progress), which continues independently. Owned by the caller.
+    virtual FrameGenerator* clone() = 0;
     // Destructor
     virtual ~FrameGenerator() {}
 };
@@ -0,0 +1,215 @@
+#ifndef KOELSYNTH_INSTRUMENT_H
+#define KOELSYNTH_INSTRUMENT_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+#include "frame_generator.h"
+#include "signal_generators.h"
+#include "rcu.h"
+
+// Instruments whose parameters can be edited while their notes sound.
+//
+// An Instrument holds the current version of its parameters behind an
+// atomic pointer. update() (from any control thread) publishes a new
+// version and retires the old one in the global RcuDomain. The voices
+// check the version at the start of every frame, inside the read section
+// of the Sequencer rendering them, and take over the harmonic amplitudes
+// and envelope levels of a new one. The render thread never locks.
+
+namespace signal {
+
+struct InstrumentParams {
+    FmSynthModParams mod_params;
+    AdsrParams mod_env;
+    AdsrParams env;
+};
+
+
+class Instrument {
+public:
+    // A published set of parameters. Never changed once published.
+    struct Version {
+        InstrumentParams params;
+        // Increases with every update
+        uint64_t number = 0;
+    };
+
+private:
+    std::atomic<const Version*> current {nullptr};
+    // Serializes the updates
+    std::mutex update_mutex;
+    uint64_t version_count = 0;
+
+    static void check_params(const InstrumentParams &params) {
+        const FmSynthModParams &mod = params.mod_params;
+        if (mod.harmonics.size() != mod.amps.size()) {
+            throw std::invalid_argument("mismatch in sizes of harmonics and amps");
+        }
+        AdsrParams mod_env = params.mod_env;
+        AdsrParams env = params.env;
+        if (mod_env.get_size() != env.get_size()) {
+            throw std::invalid_argument("envelope sizes do not match");
+        }
+    }
+
+public:
+    Instrument(const InstrumentParams &params) {
+        check_params(params);
+        Version *version = new Version();
+        version->params = params;
+        version->number = ++version_count;
+        current = version;
+    }
+
+    Instrument(const Instrument&) = delete;
+    Instrument& operator=(const Instrument&) = delete;
+
+    // Replace the parameters. Sounding notes take the harmonics (if there
+    // are as many as before), their amplitudes and the envelope levels at
+    // their next frame; the envelope timing only applies to new notes.
+    // Safe from any thread while the voices are rendered.
+    void update(const InstrumentParams &params) {
+        check_params(params);
+        std::lock_guard<std::mutex> lock(update_mutex);
+        Version *version = new Version();
+        version->params = params;
+        version->number = ++version_count;
+        const Version *old = current.exchange(version);
+        RcuDomain::global().retire([old] { delete old; });
+    }
+
+    // A copy of the current version (for control threads)
+    Version get_current() {
+        std::lock_guard<std::mutex> lock(update_mutex);
+        return *current.load();
+    }
+
+    InstrumentParams get_params() {
+        return get_current().params;
+    }
+
+    uint64_t get_version() {
+        return get_current().number;
+    }
+
+    // The current version, for the render thread. Only valid until the end
+    // of the caller's read section (see RcuDomain).
+    const Version* read() {
+        return current.load();
+    }
+
+    // No voices are left (they share the ownership)
+    ~Instrument() {
+        delete current.load();
+    }
+};
+
+
+// A note of an Instrument, which follows the updates of its parameters.
+// It must be rendered inside a read section of the global RcuDomain, like
+// by a Sequencer.
+class InstrumentGenerator: public FrameGenerator {
+    std::shared_ptr<Instrument> instrument;
+    FmSynthGenerator voice;
+    // Version of the parameters in voice
+    uint64_t version = 0;
+
+    static FmSynthGenerator make_voice(const InstrumentParams &params,
+                                       float phase_per_sample, float gain) {
+        return FmSynthGenerator(params.mod_params, params.mod_env, params.env,
+                                phase_per_sample, gain);
+    }
+
+    // Take over the parameters of a new version
+    void refresh() {
+        const Instrument::Version *current = instrument->read();
+        if (current->number == version) {
+            return;
+        }
+        const InstrumentParams &params = current->params;
+        if (params.mod_params.harmonics.size() == voice.get_num_harmonics()) {
+            voice.set_mod_params(params.mod_params);
+        }
+        voice.set_env_levels(params.mod_env, params.env);
+        version = current->number;
+    }
+
+    InstrumentGenerator(std::shared_ptr<Instrument> instrument_,
+                        const Instrument::Version &current,
+                        float phase_per_sample, float gain):
+        instrument(instrument_),
+        voice(make_voice(current.params, phase_per_sample, gain)),
+        version(current.number) {
+    }
+
+public:
+    // phase_per_sample : per sample phase change of the base frequency
+    // gain             : gain of the note
+    // Can be created on any thread.
+    InstrumentGenerator(std::shared_ptr<Instrument> instrument_,
+                        float phase_per_sample, float gain):
+        InstrumentGenerator(instrument_, instrument_->get_current(),
+                            phase_per_sample, gain) {
+    }
+
+    virtual void set_frame_size(size_t num_samples) {
+        voice.set_frame_size(num_samples);
+    }
+
+    virtual void set_control_rate(size_t num_samples) {
+        voice.set_control_rate(num_samples);
+    }
+
+    virtual void set_quality(int level) {
+        voice.set_quality(level);
+    }
+
+    // Notes stay at the full rate: an update can widen the spectrum past
+    // what a reduced rate, picked from the first parameters, can hold.
+    virtual bool set_rate_divider(size_t divider) {
+        (void) divider;
+        return false;
+    }
+
+    virtual float get_bandwidth() {
+        return voice.get_bandwidth();
+    }
+
+    virtual const char* get_name() {
+        return "instrument";
+    }
+
+    virtual size_t get_num_harmonics() {
+        return voice.get_num_harmonics();
+    }
+
+    virtual bool has_ended() {
+        return voice.has_ended();
+    }
+
+    virtual size_t get_size() {
+        return voice.get_size();
+    }
+
+    virtual FrameGenerator* clone() {
+        return new InstrumentGenerator(*this);
+    }
+
+    // Version of the parameters in use
+    uint64_t get_version() {
+        return version;
+    }
+
+    virtual bool next_frame(std::vector<float> &frame) {
+        refresh();
+        return voice.next_frame(frame);
+    }
+};
+
+}
+
+#endif
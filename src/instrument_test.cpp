@@ -0,0 +1,199 @@
+
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "simple_tester.h"
+#include "instrument.h"
+#include "sequencer.h"
+
+namespace signal {
+
+using tester::TestError;
+
+InstrumentParams make_params(float amp, float level) {
+    InstrumentParams params;
+    params.mod_params = FmSynthModParams({2, 5}, {amp, amp / 2});
+    params.mod_env.attack = 200;
+    params.mod_env.decay = 200;
+    params.mod_env.sustain = 3000;
+    params.mod_env.release = 400;
+    params.mod_env.slevel1 = level;
+    params.mod_env.slevel2 = level / 2;
+    params.env = params.mod_env;
+    return params;
+}
+
+class Signal_Tester {
+public:
+    static void test_RcuDomain() {
+        RcuDomain domain;
+        RcuReader reader1;
+        RcuReader reader2;
+        domain.add_reader(&reader1);
+        domain.add_reader(&reader2);
+        int freed = 0;
+
+        // Quiescent readers do not hold back the freeing
+        domain.retire([&] { freed++; });
+        THROW_IF(freed != 1, "Not freed without readers in a section");
+
+        // A section started before the retire holds it back until it ends
+        domain.begin_read(reader1);
+        domain.retire([&] { freed++; });
+        THROW_IF(freed != 1, "Freed while a reader can see it");
+        // A section started after the retire does not
+        domain.begin_read(reader2);
+        domain.end_read(reader1);
+        domain.reclaim();
+        THROW_IF(freed != 2, "Not freed after the section ended");
+        domain.end_read(reader2);
+
+        // Removing a reader in a section frees what it held back
+        domain.begin_read(reader1);
+        domain.retire([&] { freed++; });
+        THROW_IF(domain.get_retired_count() != 1, "Wrong retired count");
+        domain.end_read(reader1);
+        domain.remove_reader(&reader1);
+        THROW_IF(freed != 3 || domain.get_retired_count() != 0,
+                 "Not freed after removing the reader");
+        domain.remove_reader(&reader2);
+    }
+
+    static void test_InstrumentGenerator_update() {
+        // An update applies at the next block, like changing a voice
+        // directly at that block
+        auto instrument = std::make_shared<Instrument>(make_params(1, 0.5f));
+        Sequencer seq(64, 1.0f);
+        seq.add(new InstrumentGenerator(instrument, 0.05f, 1.0f));
+        InstrumentParams params = make_params(1, 0.5f);
+        auto reference = new FmSynthGenerator(
+            params.mod_params, params.mod_env, params.env, 0.05f, 1.0f);
+        Sequencer ref_seq(64, 1.0f);
+        ref_seq.add(reference);
+
+        std::vector<float> out(64);
+        std::vector<float> expected(64);
+        InstrumentParams changed = make_params(0.3f, 0.8f);
+        for (size_t block = 0; block < 40; block++) {
+            if (block == 10) {
+                instrument->update(changed);
+                reference->set_mod_params(changed.mod_params);
+                reference->set_env_levels(changed.mod_env, changed.env);
+            }
+            seq.render(out.data(), out.size());
+            ref_seq.render(expected.data(), expected.size());
+            THROW_IF(out != expected, "Output differs from the reference");
+        }
+        THROW_IF(instrument->get_version() != 2, "Wrong version");
+        THROW_IF(instrument->get_params().mod_params.amps[0] != 0.3f,
+                 "Wrong parameters");
+
+        // A different number of harmonics only applies to new notes
+        InstrumentParams more = changed;
+        more.mod_params = FmSynthModParams({2, 5, 9}, {1, 1, 1});
+        instrument->update(more);
+        seq.render(out.data(), out.size());
+        ref_seq.render(expected.data(), expected.size());
+        THROW_IF(out != expected, "Harmonics changed in a sounding note");
+        InstrumentGenerator note(instrument, 0.05f, 1.0f);
+        THROW_IF(note.get_num_harmonics() != 3, "New note not updated");
+
+        // Notes stay at the full rate, since updates can widen them
+        FrameGenerator *low = make_multirate(
+            new InstrumentGenerator(instrument, 0.005f, 1.0f));
+        THROW_IF(dynamic_cast<InstrumentGenerator*>(low) == nullptr,
+                 "Instrument note at a reduced rate");
+        delete low;
+
+        bool thrown = false;
+        try {
+            InstrumentParams invalid = changed;
+            invalid.env.sustain += 1;
+            instrument->update(invalid);
+        } catch (std::invalid_argument&) {
+            thrown = true;
+        }
+        THROW_IF(!thrown, "Envelope size mismatch accepted");
+    }
+
+    static void test_Instrument_concurrent_updates() {
+        // Updates from a control thread while the notes are rendered
+        auto instrument = std::make_shared<Instrument>(make_params(1, 0.5f));
+        Sequencer seq(64, 0.2f);
+        std::vector<InstrumentGenerator*> notes;
+        for (size_t ii = 0; ii < 8; ii++) {
+            notes.push_back(new InstrumentGenerator(
+                instrument, 0.02f * (ii + 1), 1.0f));
+            seq.add(notes.back());
+        }
+        {
+            std::atomic<bool> done {false};
+            std::atomic<size_t> update_count {0};
+            std::thread control([&] {
+                while (!done) {
+                    float amp = 0.5f + 0.5f * (update_count % 7) / 7;
+                    instrument->update(make_params(amp, amp));
+                    update_count++;
+                }
+            });
+            // Stops the control thread however the test ends
+            struct Joiner {
+                std::atomic<bool> &done;
+                std::thread &thread;
+                ~Joiner() {
+                    done = true;
+                    thread.join();
+                }
+            } joiner {done, control};
+
+            std::vector<float> out(64);
+            auto render_block = [&] {
+                seq.render(out.data(), out.size());
+                for (float x: out) {
+                    THROW_IF(!std::isfinite(x), "Bad output");
+                }
+            };
+            for (size_t ii = 0; ii < 4; ii++) {
+                render_block();
+            }
+            // Once an update is published, the next block of every sounding
+            // note uses a newer version (the notes last far longer than this)
+            while (update_count == 0) {
+                std::this_thread::yield();
+            }
+            render_block();
+            for (auto note: notes) {
+                THROW_IF(note->get_version() < 2, "Note missed the updates");
+            }
+            while (seq.get_generator_count() > 0) {
+                render_block();
+            }
+            THROW_IF(instrument->get_version() < 2, "No updates");
+        }
+        // With no read section open and no more updates, everything
+        // retired can be freed
+        RcuDomain::global().reclaim();
+        THROW_IF(RcuDomain::global().get_retired_count() != 0,
+                 "Old versions not freed");
+    }
+};
+
+}
+
+bool test_all() {
+    using namespace signal;
+    using namespace tester;
+
+    TestCollection tests;
+    ADD_TEST(tests, Signal_Tester::test_RcuDomain);
+    ADD_TEST(tests, Signal_Tester::test_InstrumentGenerator_update);
+    ADD_TEST(tests, Signal_Tester::test_Instrument_concurrent_updates);
+    return run_tests(tests);
+}
+
+int main() {
+    return test_all() ? 1 : 0;
+}
@@ -5,6 +5,13 @@
 
 #include "signal_generators.h"
 #include "sequencer.h"
+#include "wav_writer.h"
+#include "pitch_tracker.h"
+#include "render_engine.h"
+#include "event_log.h"
+#include "operator_graph.h"
+#include "effects.h"
+#include "instrument.h"
 
 namespace py = pybind11;
 using namespace pybind11::literals;
@@ -22,27 +29,231 @@ void add_fmsynth(
     AdsrParams mod_env_params,
     AdsrParams env_params,
     float base_freq,
-    float gain
+    float gain,
+    float pan,
+    float spread
 ) {
-    auto gen = new FmSynthGenerator(
+    // Owned here until add returns
+    std::unique_ptr<FmSynthGenerator> gen(new FmSynthGenerator(
         mod_params, mod_env_params, env_params, base_freq, gain
-    );
-    seq.add(gen);
+    ));
+    seq.add(gen.get(), pan, spread);
+    gen.release();
+}
+
+// Same as add_fmsynth, but safe while the sequencer is rendered by a
+// RenderEngine
+void post_fmsynth(
+    Sequencer &seq,
+    FmSynthModParams &mod_params,
+    AdsrParams mod_env_params,
+    AdsrParams env_params,
+    float base_freq,
+    float gain,
+    float pan,
+    float spread
+) {
+    seq.post(new FmSynthGenerator(
+        mod_params, mod_env_params, env_params, base_freq, gain
+    ), pan, spread);
+}
+
+void add_operator_graph(
+    Sequencer &seq,
+    OperatorGraph &graph,
+    float base_freq,
+    float gain,
+    float pan,
+    float spread
+) {
+    seq.add(new OperatorGraphGenerator(graph.get_program(), base_freq, gain),
+            pan, spread);
+}
+
+InstrumentParams make_instrument_params(
+    const FmSynthModParams &mod_params,
+    const AdsrParams &mod_env_params,
+    const AdsrParams &env_params
+) {
+    InstrumentParams params;
+    params.mod_params = mod_params;
+    params.mod_env = mod_env_params;
+    params.env = env_params;
+    return params;
+}
+
+void add_instrument(
+    Sequencer &seq,
+    std::shared_ptr<Instrument> instrument,
+    float base_freq,
+    float gain,
+    float pan,
+    float spread
+) {
+    seq.add(new InstrumentGenerator(instrument, base_freq, gain), pan, spread);
+}
+
+// Same as add_instrument, but safe while the sequencer is rendered by a
+// RenderEngine
+void post_instrument(
+    Sequencer &seq,
+    std::shared_ptr<Instrument> instrument,
+    float base_freq,
+    float gain,
+    float pan,
+    float spread
+) {
+    seq.post(new InstrumentGenerator(instrument, base_freq, gain), pan, spread);
+}
+
+// (type, frequency, q, gain_db) tuple of a filter section
+typedef std::tuple<std::string, float, float, float> FilterSection;
+
+void add_filters(Sequencer &seq, const std::vector<FilterSection> &sections) {
+    std::vector<BiquadCoeffs> coeffs;
+    for (auto &section: sections) {
+        coeffs.push_back(make_biquad(
+            parse_biquad_type(std::get<0>(section)), std::get<1>(section),
+            std::get<2>(section), std::get<3>(section)));
+    }
+    seq.add_effect(new BiquadCascade(coeffs));
+}
+
+void add_filter(Sequencer &seq, const std::string &type, float freq, float q,
+                float gain_db) {
+    add_filters(seq, {FilterSection(type, freq, q, gain_db)});
 }
 
 void get_next_frame(Sequencer &seq, py::array_t<float> &output) {
+    size_t channels = seq.get_num_channels();
+    if (output.ndim() == 2) {
+        // Planar, one row per channel
+        if ((size_t) output.shape(0) != channels) {
+            throw std::invalid_argument("need one row per channel");
+        }
+        if (output.shape(1) > 1
+            && output.strides(1) != (ssize_t) sizeof(float)) {
+            throw std::invalid_argument("rows must be contiguous");
+        }
+        std::vector<float*> rows(channels);
+        for (size_t ch = 0; ch < channels; ch++) {
+            rows[ch] = output.mutable_data(ch);
+        }
+        seq.render_planar(rows.data(), output.shape(1));
+        return;
+    }
     if (output.ndim() != 1) {
+        throw std::invalid_argument(
+            "need a 1-D (interleaved) or 2-D (planar) array");
+    }
+    if (output.shape(0) % channels != 0) {
+        throw std::invalid_argument(
+            "array size must be a multiple of the channel count");
+    }
+
+    auto data = output.mutable_unchecked<1>();
+    if (output.strides(0) == (ssize_t) sizeof(float)) {
+        seq.render(data.mutable_data(0), data.shape(0) / channels);
+        return;
+    }
+    // Strided views are rendered into a contiguous buffer and copied
+    std::vector<float> scratch(data.shape(0));
+    seq.render(scratch.data(), scratch.size() / channels);
+    for (ssize_t ii = 0; ii < data.shape(0); ii++) {
+        data(ii) = scratch[ii];
+    }
+}
+
+void write_wav_samples(StreamingWavWriter &writer, py::array_t<float> &samples) {
+    if (samples.ndim() != 1) {
         throw std::invalid_argument("need a single dimensional array");
     }
+    auto data = samples.unchecked<1>();
+    writer.write(data.data(0), data.shape(0));
+}
+
+// Size in bytes of a C-contiguous buffer
+size_t contiguous_buffer_bytes(const py::buffer_info &info) {
+    ssize_t expected_stride = info.itemsize;
+    for (ssize_t dim = info.ndim - 1; dim >= 0; dim--) {
+        if (info.shape[dim] > 1 && info.strides[dim] != expected_stride) {
+            throw std::invalid_argument("buffer must be C-contiguous");
+        }
+        expected_stride *= info.shape[dim];
+    }
+    return info.size * info.itemsize;
+}
+
+void get_next_frame_pcm(
+    Sequencer &seq, py::buffer output, const std::string &format,
+    size_t channels, bool dither
+) {
+    if (channels == 0) {
+        channels = seq.get_num_channels();
+    }
+    SampleFormat sample_format = parse_sample_format(format);
+    size_t stride = channels * bytes_per_sample(sample_format);
+
+    py::buffer_info info = output.request(true);
+    size_t num_bytes = contiguous_buffer_bytes(info);
+    if (num_bytes % stride != 0) {
+        throw std::invalid_argument(
+            "buffer size must be a multiple of channels * sample size");
+    }
+    seq.render_pcm(static_cast<uint8_t*>(info.ptr), num_bytes / stride,
+                   sample_format, channels, dither);
+}
+
+// Process an array of samples and return the estimates made. The samples
+// are copied so that tracking runs without the GIL.
+typedef py::array_t<float, py::array::c_style | py::array::forcecast>
+    ContiguousFloatArray;
+
+std::vector<PitchEstimate> track_pitch(
+    PitchTracker &tracker, ContiguousFloatArray &samples
+) {
+    if (samples.ndim() != 1) {
+        throw std::invalid_argument("need a single dimensional array");
+    }
+    std::vector<float> input(samples.data(), samples.data() + samples.size());
+    std::vector<PitchEstimate> output;
+    {
+        py::gil_scoped_release release;
+        tracker.process(input.data(), input.size(), output);
+    }
+    return output;
+}
 
-    if (output.shape(0) != (ssize_t) seq.get_frame_size()) {
-        throw std::invalid_argument("input must be of frame size");
+bool read_engine_frame(
+    RenderEngine &engine, size_t stream, py::array_t<float> &output, bool wait
+) {
+    if (output.ndim() != 1 || output.strides(0) != (ssize_t) sizeof(float)) {
+        throw std::invalid_argument("need a contiguous 1-D float32 array");
+    }
+    if ((size_t) output.shape(0) != engine.get_frame_size(stream)
+        * engine.get_num_channels(stream)) {
+        throw std::invalid_argument("array size must match the frame size");
     }
+    float *out = output.mutable_data();
+    py::gil_scoped_release release;
+    return engine.read_frame(stream, out, wait);
+}
 
-    std::vector<float> frame = seq.next_frame();
-    for (size_t ii = 0; ii < frame.size(); ii++) {
-        output.mutable_at(ii) = frame[ii];
+// Replay an event log at full speed, without the GIL. Returns the stats,
+// and the output as an array when return_output is true.
+py::object replay_log(const std::string &path, bool return_output) {
+    std::vector<float> output;
+    ReplayStats stats;
+    {
+        py::gil_scoped_release release;
+        stats = replay_event_log(path, return_output ? &output : nullptr);
     }
+    if (!return_output) {
+        return py::cast(stats);
+    }
+    py::array_t<float> samples(output.size());
+    std::copy(output.begin(), output.end(), samples.mutable_data());
+    return py::make_tuple(stats, samples);
 }
 
 PYBIND11_MODULE(koelsynth, m) {
@@ -51,6 +262,20 @@ PYBIND11_MODULE(koelsynth, m) {
     m.def("key_to_phase_per_sample", &key_to_phase_per_sample,
           "key"_a, "sample_rate"_a);
 
+    m.attr("QUALITY_FULL") = static_cast<int>(QUALITY_FULL);
+    m.attr("QUALITY_PRUNED") = static_cast<int>(QUALITY_PRUNED);
+    m.attr("QUALITY_FAST_SINE") = static_cast<int>(QUALITY_FAST_SINE);
+    m.attr("QUALITY_COARSE_CONTROL") =
+        static_cast<int>(QUALITY_COARSE_CONTROL);
+    m.def("trace_is_compiled_in", &trace::is_compiled_in,
+          "Return whether render tracing is compiled in (KOELSYNTH_TRACE)");
+    m.def("trace_start", &trace::start,
+          "Drop the recorded trace events and start recording");
+    m.def("trace_stop", &trace::stop, "Stop recording trace events");
+    m.def("trace_dump", &trace::dump,
+          "Write the recorded events as Chrome trace JSON to a file",
+          "path"_a);
+
     // AdsrParams - Envelope parameters
     py::class_<AdsrParams>(m, "AdsrParams")
         .def(py::init<size_t, size_t, size_t, size_t, float, float>(),
@@ -90,19 +315,316 @@ PYBIND11_MODULE(koelsynth, m) {
                 return result;
             });
 
+    py::class_<Instrument, std::shared_ptr<Instrument>>(m, "Instrument")
+        .def(py::init([](const FmSynthModParams &mod_params,
+                         const AdsrParams &mod_env_params,
+                         const AdsrParams &env_params) {
+                return std::make_shared<Instrument>(make_instrument_params(
+                    mod_params, mod_env_params, env_params));
+            }),
+            "FM synth parameters that can be changed while notes sound",
+            "mod_params"_a, "mod_env_params"_a, "env_params"_a)
+        .def("update", [](Instrument &instrument,
+                          const FmSynthModParams &mod_params,
+                          const AdsrParams &mod_env_params,
+                          const AdsrParams &env_params) {
+                instrument.update(make_instrument_params(
+                    mod_params, mod_env_params, env_params));
+            },
+            "Replace the parameters from any thread. Sounding notes take the "
+            "harmonics (if there are as many), their amplitudes and the "
+            "envelope levels at their next block; envelope timing only "
+            "applies to new notes",
+            "mod_params"_a, "mod_env_params"_a, "env_params"_a)
+        .def("get_mod_params", [](Instrument &instrument) {
+                return instrument.get_params().mod_params;
+            })
+        .def("get_mod_env_params", [](Instrument &instrument) {
+                return instrument.get_params().mod_env;
+            })
+        .def("get_env_params", [](Instrument &instrument) {
+                return instrument.get_params().env;
+            })
+        .def("get_version", &Instrument::get_version,
+             "Return the number of parameter sets so far");
+
+    py::class_<OperatorGraph>(m, "OperatorGraph")
+        .def(py::init<>(), "Create an empty operator graph")
+        .def("add_operator", [](OperatorGraph &graph, float ratio,
+                                float level, AdsrParams env, float feedback) {
+                OperatorParams params;
+                params.ratio = ratio;
+                params.level = level;
+                params.env = env;
+                params.feedback = feedback;
+                return graph.add_operator(params);
+            },
+            "Add a sine operator and return its index. ratio is its "
+            "frequency relative to the base frequency, and level its "
+            "amplitude (or phase deviation in radians, when modulating)",
+            "ratio"_a, "level"_a, "env"_a, "feedback"_a = 0.0f)
+        .def("connect", &OperatorGraph::connect,
+             "Let an operator modulate the phase of another",
+             "modulator"_a, "target"_a)
+        .def("add_output", &OperatorGraph::add_output,
+             "Add the output of an operator to the sound", "index"_a)
+        .def("get_operator_count", &OperatorGraph::get_operator_count,
+             "Return the number of operators")
+        .def("compile", [](OperatorGraph &graph) {
+                graph.get_program();
+            },
+            "Check the graph and compile it (done on first use otherwise)");
+
     py::class_<Sequencer>(m, "Sequencer")
-        .def(py::init<size_t, float>(), "Create a Sequencer",
+        .def(py::init<size_t, float, size_t>(), "Create a Sequencer",
              "frame_size"_a = DEFAULT_FRAME_SIZE,
-             "gain"_a = 1.0f)
-        .def("add_fmsynth", &add_fmsynth, "Add FM synth event",
+             "gain"_a = 1.0f, "num_channels"_a = 1)
+        .def("add_fmsynth", &add_fmsynth, "Add FM synth event, placed at "
+            "pan (-1 for the first channel to 1 for the last) and spread "
+            "over the nearby channels by spread (0 to 1)",
             "mod_params"_a, "mod_env_params"_a,
             "env_params"_a, "phase_per_sample"_a,
-            "gain"_a = 1.0f)
+            "gain"_a = 1.0f, "pan"_a = 0.0f, "spread"_a = 0.0f)
+        .def("post_fmsynth", &post_fmsynth,
+            "Add FM synth event from any thread, at the start of the next "
+            "block. Use this while the sequencer is in a RenderEngine",
+            "mod_params"_a, "mod_env_params"_a,
+            "env_params"_a, "phase_per_sample"_a,
+            "gain"_a = 1.0f, "pan"_a = 0.0f, "spread"_a = 0.0f)
+        .def("add_instrument", &add_instrument,
+            "Add a note played by an instrument, which follows its updates",
+            "instrument"_a, "phase_per_sample"_a, "gain"_a = 1.0f,
+            "pan"_a = 0.0f, "spread"_a = 0.0f)
+        .def("post_instrument", &post_instrument,
+            "Same as add_instrument, from any thread at the start of the "
+            "next block",
+            "instrument"_a, "phase_per_sample"_a, "gain"_a = 1.0f,
+            "pan"_a = 0.0f, "spread"_a = 0.0f)
+        .def("add_operator_graph", &add_operator_graph,
+            "Add an event played by an operator graph",
+            "graph"_a, "phase_per_sample"_a, "gain"_a = 1.0f,
+            "pan"_a = 0.0f, "spread"_a = 0.0f)
+        .def("add_filter", &add_filter,
+            "Append a biquad filter to the effects: lowpass, highpass, "
+            "bandpass, notch, peaking, lowshelf or highshelf. frequency is "
+            "in radians per sample, like phase_per_sample; gain_db is for "
+            "the peaking and shelving filters",
+            "type"_a, "frequency"_a, "q"_a = 0.7071f, "gain_db"_a = 0.0f)
+        .def("add_filters", &add_filters,
+            "Append a cascade of biquad filters (like an EQ) as one effect, "
+            "from (type, frequency, q, gain_db) tuples",
+            "sections"_a)
+        .def("add_soft_clip", [](Sequencer &seq, float drive, float ceiling) {
+                seq.add_effect(new SoftClipper(drive, ceiling));
+            },
+            "Append a soft clipper that saturates towards +-ceiling",
+            "drive"_a = 1.0f, "ceiling"_a = 1.0f)
+        .def("add_limiter", [](Sequencer &seq, float threshold,
+                               float release) {
+                seq.add_effect(new Limiter(threshold, release));
+            },
+            "Append a limiter that keeps the peaks at or below threshold and "
+            "recovers in release samples",
+            "threshold"_a = 0.9f, "release"_a = 4800.0f)
+        .def("add_delay", [](Sequencer &seq, size_t delay, float feedback,
+                             float mix) {
+                seq.add_effect(new FeedbackDelay(delay, feedback, mix));
+            },
+            "Append a feedback delay of delay samples",
+            "delay"_a, "feedback"_a = 0.3f, "mix"_a = 0.3f)
+        .def("clear_effects", &Sequencer::clear_effects,
+             "Remove all the effects")
+        .def("get_effect_count", &Sequencer::get_effect_count,
+             "Return the number of effects")
+        .def("clone", &Sequencer::clone,
+             py::return_value_policy::take_ownership,
+             "Return an independent copy with the complete state (active "
+             "events, envelope progress, buffered samples), which renders "
+             "the same output from here on")
+        .def("set_frame_budget", [](Sequencer &seq, double seconds) {
+                seq.set_frame_budget(seconds);
+            },
+            "Adapt the quality to the time available for a block "
+            "(frame_size / sample_rate for real time): under load, events "
+            "lose some accuracy instead of missing the deadline. 0 turns it "
+            "off and restores the full quality",
+            "seconds"_a)
+        .def("set_quality", &Sequencer::set_quality,
+             "Set the quality level, from QUALITY_FULL to "
+             "QUALITY_COARSE_CONTROL (overridden by a frame budget)",
+             "level"_a)
+        .def("get_quality", &Sequencer::get_quality,
+             "Return the current quality level")
+        .def("get_load", &Sequencer::get_load,
+             "Return the smoothed render time per block over the frame "
+             "budget")
         .def("get_frame_size", &Sequencer::get_frame_size,
-             "Return the frame size expected by the sequencer")
+             "Return the block size used for processing")
+        .def("get_num_channels", &Sequencer::get_num_channels,
+             "Return the number of output channels")
         .def("get_generator_count", &Sequencer::get_generator_count,
              "Return the current number of generators")
-        .def("next", &get_next_frame, "Fill the next frame of samples",
-             "array"_a);
+        .def("is_done", &Sequencer::is_done,
+             "Return whether no generators are left and the effects have "
+             "no tail left, so the rest of the output is silent")
+        .def("set_control_rate", &Sequencer::set_control_rate,
+             "Evaluate envelopes once every num_samples samples and "
+             "interpolate in between (1 means every sample)",
+             "num_samples"_a)
+        .def("get_control_rate", &Sequencer::get_control_rate,
+             "Return the number of samples per envelope evaluation")
+        .def("set_multirate", &Sequencer::set_multirate,
+             "Render low pitched events added later at a reduced sample rate",
+             "enable"_a)
+        .def("get_multirate", &Sequencer::get_multirate,
+             "Return whether multirate rendering is enabled")
+        .def("next", &get_next_frame,
+             "Fill the array with the next samples: a 1-D array gets the "
+             "channels interleaved, a 2-D array one channel per row. The "
+             "array can be of any length; partial blocks are carried over "
+             "to the next call",
+             "array"_a)
+        .def("next_pcm", &get_next_frame_pcm,
+             "Fill a writable buffer (like bytearray or a numpy array) of any "
+             "length with the next samples, interleaved, in the given format. "
+             "Supported formats are float32, int16 and int24. channels "
+             "defaults to the channels of the sequencer; a single channel "
+             "sequencer can repeat its samples in more channels",
+             "buffer"_a, "format"_a = "int16", "channels"_a = 0,
+             "dither"_a = true);
+
+    py::class_<StreamingWavWriter>(m, "WavWriter")
+        .def(py::init([](const std::string &path, size_t sample_rate,
+                         const std::string &format, size_t buffer_size,
+                         size_t channels, bool dither) {
+                return new StreamingWavWriter(
+                    path, sample_rate, parse_sample_format(format), channels,
+                    buffer_size, dither);
+             }),
+             "Open a WAV file that is written from a background thread. "
+             "Supported formats are float32, int16 and int24. Integer "
+             "samples are dithered unless dither is False",
+             "path"_a, "sample_rate"_a, "format"_a = "float32",
+             "buffer_size"_a = 16384, "channels"_a = 1, "dither"_a = true)
+        .def("render", [](StreamingWavWriter &writer, Sequencer &seq,
+                          size_t num_frames) {
+                render_frames(seq, writer, num_frames);
+            }, "Render the given number of frames from the sequencer",
+            "sequencer"_a, "num_frames"_a)
+        .def("render_until_done", [](StreamingWavWriter &writer,
+                                     Sequencer &seq) {
+                return render_until_done(seq, writer);
+            }, "Render frames until the sequencer has no active events and "
+            "the tails of its effects have died out. Returns the number of "
+            "frames rendered",
+            "sequencer"_a)
+        .def("write", &write_wav_samples, "Write a frame of samples",
+             "array"_a)
+        .def("close", &StreamingWavWriter::close,
+             "Write the pending samples and finalize the file")
+        .def("__enter__", [](StreamingWavWriter &writer) -> StreamingWavWriter& {
+                return writer;
+            }, py::return_value_policy::reference)
+        .def("__exit__", [](StreamingWavWriter &writer, py::args) {
+                writer.close();
+            });
+
+    py::class_<PitchEstimate>(m, "PitchEstimate")
+        .def_readonly("position", &PitchEstimate::position,
+                "number of input samples processed for this estimate")
+        .def_readonly("frequency", &PitchEstimate::frequency,
+                "fundamental frequency in Hz (0 when not voiced)")
+        .def_readonly("key", &PitchEstimate::key,
+                "key number of the frequency (0 is 110 Hz)")
+        .def_readonly("confidence", &PitchEstimate::confidence,
+                "confidence of the estimate (0 to 1)")
+        .def_readonly("voiced", &PitchEstimate::voiced,
+                "whether the input has a pitch");
+
+    py::class_<PitchTracker>(m, "PitchTracker")
+        .def(py::init<float, float, float, size_t, size_t, float, float>(),
+             "Create a streaming pitch tracker (YIN)",
+             "sample_rate"_a, "min_freq"_a = 60.0f, "max_freq"_a = 1000.0f,
+             "window_size"_a = 0, "hop_size"_a = 128, "threshold"_a = 0.15f,
+             "silence_db"_a = -50.0f)
+        .def("process", &track_pitch,
+             "Process the next samples (any length) and return a list of "
+             "estimates, one for every hop_size samples",
+             "samples"_a)
+        .def("get_latency", &PitchTracker::get_latency,
+             "Return the number of samples before the first pitch")
+        .def("get_hop_size", &PitchTracker::get_hop_size,
+             "Return the number of samples between estimates")
+        .def("reset", &PitchTracker::reset, "Forget all the input so far");
+
+    py::class_<EventRecorder>(m, "EventRecorder")
+        .def(py::init<const std::string&, Sequencer&>(),
+             "Record every event given to the sequencer from its next block "
+             "to an event log file",
+             "path"_a, "sequencer"_a, py::keep_alive<1, 3>())
+        .def("get_event_count", &EventRecorder::get_event_count,
+             "Return the number of events recorded")
+        .def("get_skipped_count", &EventRecorder::get_skipped_count,
+             "Return the number of events that could not be recorded")
+        .def("close", &EventRecorder::close,
+             "Stop recording and finish the file")
+        .def("__enter__", [](EventRecorder &recorder) -> EventRecorder& {
+                return recorder;
+            }, py::return_value_policy::reference)
+        .def("__exit__", [](EventRecorder &recorder, py::args) {
+                recorder.close();
+            });
+
+    py::class_<ReplayStats>(m, "ReplayStats")
+        .def_readonly("blocks", &ReplayStats::blocks,
+                "internal blocks rendered")
+        .def_readonly("samples", &ReplayStats::samples,
+                "samples rendered")
+        .def_readonly("seconds", &ReplayStats::seconds,
+                "time taken to render");
+
+    m.def("replay_event_log", &replay_log,
+          "Render an event log on a fresh sequencer at full speed. Returns "
+          "the stats, or (stats, samples) when return_output is True",
+          "path"_a, "return_output"_a = false);
+
+    py::class_<StreamStats>(m, "StreamStats")
+        .def_readonly("frames", &StreamStats::frames,
+                "frames rendered")
+        .def_readonly("cpu_seconds", &StreamStats::cpu_seconds,
+                "CPU time spent rendering")
+        .def_readonly("max_frame_seconds", &StreamStats::max_frame_seconds,
+                "longest time to render a frame")
+        .def_readonly("deadline_misses", &StreamStats::deadline_misses,
+                "frames finished after they were due to play")
+        .def_readonly("underruns", &StreamStats::underruns,
+                "reads that found no rendered frame")
+        .def_readonly("failed", &StreamStats::failed,
+                "rendering raised an error and the stream stopped")
+        .def_readonly("error", &StreamStats::error,
+                "message of the error when failed");
+
+    py::class_<RenderEngine>(m, "RenderEngine")
+        .def(py::init<size_t>(),
+             "Create an engine that renders many sequencers on a pool of "
+             "worker threads (0 for one per core)",
+             "num_workers"_a = 0)
+        .def("add_stream", &RenderEngine::add_stream,
+             "Register a sequencer and return its stream id. Add events to "
+             "it with post_fmsynth while it is registered",
+             "sequencer"_a, "sample_rate"_a, "queue_frames"_a = 4,
+             py::keep_alive<1, 2>())
+        .def("remove_stream", &RenderEngine::remove_stream,
+             "Unregister a stream", "stream"_a,
+             py::call_guard<py::gil_scoped_release>())
+        .def("read", &read_engine_frame,
+             "Copy the next frame of a stream to the array. Returns False if "
+             "it is not ready and wait is False. Raises the error of a "
+             "failed stream once its rendered frames are read",
+             "stream"_a, "array"_a, "wait"_a = true)
+        .def("get_stats", &RenderEngine::get_stats,
+             "Return the rendering statistics of a stream", "stream"_a)
+        .def("get_stream_count", &RenderEngine::get_stream_count)
+        .def("get_worker_count", &RenderEngine::get_worker_count);
 
 }
@@ -0,0 +1,300 @@
+
+#include <new>
+#include <memory>
+#include <string>
+#include <stdexcept>
+
+#include "koelsynth_c.h"
+#include "signal_generators.h"
+#include "sequencer.h"
+#include "trace.h"
+#include "event_log.h"
+
+using namespace signal;
+
+struct ks_sequencer {
+    Sequencer seq;
+    // Recording in progress (declared last so it is closed first)
+    std::unique_ptr<EventRecorder> recorder;
+
+    ks_sequencer(size_t frame_size, float gain, size_t num_channels):
+        seq(frame_size, gain, num_channels) {
+    }
+
+    // Copies the sequencer state, not the recording
+    ks_sequencer(ks_sequencer &other): seq(other.seq) {
+    }
+};
+
+namespace {
+
+thread_local std::string last_error;
+
+ks_status fail(ks_status status, const char *message) {
+    last_error = message;
+    return status;
+}
+
+// Run func, turning exceptions into status codes
+template<typename Func>
+ks_status guarded(Func func) {
+    try {
+        func();
+    } catch (const std::invalid_argument &err) {
+        return fail(KS_ERROR_INVALID_ARGUMENT, err.what());
+    } catch (const std::bad_alloc &) {
+        return fail(KS_ERROR_OUT_OF_MEMORY, "out of memory");
+    } catch (const std::exception &err) {
+        return fail(KS_ERROR_INTERNAL, err.what());
+    } catch (...) {
+        return fail(KS_ERROR_INTERNAL, "unknown error");
+    }
+    last_error.clear();
+    return KS_OK;
+}
+
+AdsrParams to_adsr_params(const ks_adsr_params &params) {
+    AdsrParams result;
+    result.attack = params.attack;
+    result.decay = params.decay;
+    result.sustain = params.sustain;
+    result.release = params.release;
+    result.slevel1 = params.slevel1;
+    result.slevel2 = params.slevel2;
+    return result;
+}
+
+SampleFormat to_sample_format(ks_sample_format format) {
+    switch (format) {
+    case KS_FORMAT_FLOAT32:
+        return SampleFormat::float32;
+    case KS_FORMAT_INT16:
+        return SampleFormat::int16;
+    case KS_FORMAT_INT24:
+        return SampleFormat::int24;
+    }
+    throw std::invalid_argument("unknown sample format");
+}
+
+}
+
+const char *ks_last_error(void) {
+    return last_error.c_str();
+}
+
+float ks_key_to_phase_per_sample(float key, float sample_rate) {
+    return key_to_phase_per_sample(key, sample_rate);
+}
+
+ks_status ks_sequencer_create(
+    size_t frame_size, float gain, ks_sequencer **out
+) {
+    if (out == nullptr) {
+        return fail(KS_ERROR_INVALID_ARGUMENT, "out must not be NULL");
+    }
+    *out = nullptr;
+    return guarded([&] {
+        *out = new ks_sequencer(frame_size, gain, 1);
+    });
+}
+
+ks_status ks_sequencer_create_multichannel(
+    size_t frame_size, float gain, size_t num_channels, ks_sequencer **out
+) {
+    if (out == nullptr) {
+        return fail(KS_ERROR_INVALID_ARGUMENT, "out must not be NULL");
+    }
+    *out = nullptr;
+    return guarded([&] {
+        *out = new ks_sequencer(frame_size, gain, num_channels);
+    });
+}
+
+ks_status ks_sequencer_clone(ks_sequencer *seq, ks_sequencer **out) {
+    if (seq == nullptr || out == nullptr) {
+        return fail(KS_ERROR_INVALID_ARGUMENT, "NULL argument");
+    }
+    *out = nullptr;
+    return guarded([&] {
+        *out = new ks_sequencer(*seq);
+    });
+}
+
+void ks_sequencer_destroy(ks_sequencer *seq) {
+    delete seq;
+}
+
+ks_status ks_sequencer_add_fmsynth(
+    ks_sequencer *seq,
+    const float *harmonics, const float *amps, size_t num_harmonics,
+    const ks_adsr_params *mod_env, const ks_adsr_params *env,
+    float phase_per_sample, float gain
+) {
+    return ks_sequencer_add_fmsynth_panned(
+        seq, harmonics, amps, num_harmonics, mod_env, env,
+        phase_per_sample, gain, 0.0f, 0.0f);
+}
+
+ks_status ks_sequencer_add_fmsynth_panned(
+    ks_sequencer *seq,
+    const float *harmonics, const float *amps, size_t num_harmonics,
+    const ks_adsr_params *mod_env, const ks_adsr_params *env,
+    float phase_per_sample, float gain, float pan, float spread
+) {
+    if (seq == nullptr || mod_env == nullptr || env == nullptr) {
+        return fail(KS_ERROR_INVALID_ARGUMENT, "NULL argument");
+    }
+    if (num_harmonics > 0 && (harmonics == nullptr || amps == nullptr)) {
+        return fail(KS_ERROR_INVALID_ARGUMENT, "NULL harmonics or amps");
+    }
+    return guarded([&] {
+        FmSynthModParams mod_params(
+            std::vector<float>(harmonics, harmonics + num_harmonics),
+            std::vector<float>(amps, amps + num_harmonics));
+        // Owned here until add returns
+        std::unique_ptr<FmSynthGenerator> gen(new FmSynthGenerator(
+            mod_params, to_adsr_params(*mod_env), to_adsr_params(*env),
+            phase_per_sample, gain));
+        seq->seq.add(gen.get(), pan, spread);
+        gen.release();
+    });
+}
+
+ks_status ks_sequencer_render(
+    ks_sequencer *seq, float *out, size_t num_samples
+) {
+    if (seq == nullptr || (out == nullptr && num_samples > 0)) {
+        return fail(KS_ERROR_INVALID_ARGUMENT, "NULL argument");
+    }
+    return guarded([&] {
+        seq->seq.render(out, num_samples);
+    });
+}
+
+ks_status ks_sequencer_render_planar(
+    ks_sequencer *seq, float *const *channels, size_t num_samples
+) {
+    if (seq == nullptr || (channels == nullptr && num_samples > 0)) {
+        return fail(KS_ERROR_INVALID_ARGUMENT, "NULL argument");
+    }
+    for (size_t ch = 0; ch < seq->seq.get_num_channels() && num_samples > 0;
+         ch++) {
+        if (channels[ch] == nullptr) {
+            return fail(KS_ERROR_INVALID_ARGUMENT, "NULL channel buffer");
+        }
+    }
+    return guarded([&] {
+        seq->seq.render_planar(channels, num_samples);
+    });
+}
+
+ks_status ks_sequencer_render_pcm(
+    ks_sequencer *seq, void *out, size_t num_samples,
+    ks_sample_format format, size_t num_channels, int dither
+) {
+    if (seq == nullptr || (out == nullptr && num_samples > 0)) {
+        return fail(KS_ERROR_INVALID_ARGUMENT, "NULL argument");
+    }
+    if (num_channels == 0) {
+        return fail(KS_ERROR_INVALID_ARGUMENT, "num_channels must be positive");
+    }
+    return guarded([&] {
+        seq->seq.render_pcm(static_cast<uint8_t*>(out), num_samples,
+                            to_sample_format(format), num_channels,
+                            dither != 0);
+    });
+}
+
+size_t ks_sequencer_get_num_channels(ks_sequencer *seq) {
+    if (seq == nullptr) {
+        return 0;
+    }
+    return seq->seq.get_num_channels();
+}
+
+size_t ks_sequencer_get_generator_count(ks_sequencer *seq) {
+    if (seq == nullptr) {
+        return 0;
+    }
+    return seq->seq.get_generator_count();
+}
+
+ks_status ks_sequencer_set_control_rate(
+    ks_sequencer *seq, size_t num_samples
+) {
+    if (seq == nullptr) {
+        return fail(KS_ERROR_INVALID_ARGUMENT, "NULL argument");
+    }
+    return guarded([&] {
+        seq->seq.set_control_rate(num_samples);
+    });
+}
+
+ks_status ks_sequencer_set_multirate(ks_sequencer *seq, int enable) {
+    if (seq == nullptr) {
+        return fail(KS_ERROR_INVALID_ARGUMENT, "NULL argument");
+    }
+    return guarded([&] {
+        seq->seq.set_multirate(enable != 0);
+    });
+}
+
+ks_status ks_sequencer_set_frame_budget(ks_sequencer *seq, double seconds) {
+    if (seq == nullptr) {
+        return fail(KS_ERROR_INVALID_ARGUMENT, "NULL argument");
+    }
+    return guarded([&] {
+        seq->seq.set_frame_budget(seconds);
+    });
+}
+
+int ks_sequencer_get_quality(ks_sequencer *seq) {
+    if (seq == nullptr) {
+        return 0;
+    }
+    return seq->seq.get_quality();
+}
+
+ks_status ks_sequencer_start_recording(ks_sequencer *seq, const char *path) {
+    if (seq == nullptr || path == nullptr) {
+        return fail(KS_ERROR_INVALID_ARGUMENT, "NULL argument");
+    }
+    return guarded([&] {
+        if (seq->recorder) {
+            seq->recorder->close();
+            seq->recorder.reset();
+        }
+        seq->recorder.reset(new EventRecorder(path, seq->seq));
+    });
+}
+
+ks_status ks_sequencer_stop_recording(ks_sequencer *seq) {
+    if (seq == nullptr) {
+        return fail(KS_ERROR_INVALID_ARGUMENT, "NULL argument");
+    }
+    return guarded([&] {
+        if (seq->recorder) {
+            seq->recorder->close();
+            seq->recorder.reset();
+        }
+    });
+}
+
+void ks_trace_start(void) {
+    trace::start();
+}
+
+void ks_trace_stop(void) {
+    trace::stop();
+}
+
+ks_status ks_trace_dump(const char *path) {
+    if (path == nullptr) {
+        return fail(KS_ERROR_INVALID_ARGUMENT, "NULL argument");
+    }
+    if (!trace::dump(path)) {
+        return fail(KS_ERROR_INTERNAL, "failed to write the trace");
+    }
+    last_error.clear();
+    return KS_OK;
+}
@@ -0,0 +1,180 @@
+#ifndef KOELSYNTH_C_H
+#define KOELSYNTH_C_H
+
+/*
+ * C interface to the koelsynth engine.
+ *
+ * Lets audio hosts and plugins run the sequencer in-process without Python.
+ * All buffers are owned by the caller. Functions that can fail return a
+ * ks_status; ks_last_error() describes the last failure on the calling
+ * thread. A sequencer must not be used from two threads at the same time.
+ */
+
+#include <stddef.h>
+
+#if defined(_WIN32) && defined(KOELSYNTH_SHARED)
+    #if defined(KOELSYNTH_BUILDING)
+        #define KOELSYNTH_API __declspec(dllexport)
+    #else
+        #define KOELSYNTH_API __declspec(dllimport)
+    #endif
+#elif defined(__GNUC__)
+    #define KOELSYNTH_API __attribute__((visibility("default")))
+#else
+    #define KOELSYNTH_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ks_sequencer ks_sequencer;
+
+typedef enum ks_status {
+    KS_OK = 0,
+    KS_ERROR_INVALID_ARGUMENT = 1,
+    KS_ERROR_OUT_OF_MEMORY = 2,
+    KS_ERROR_INTERNAL = 3
+} ks_status;
+
+typedef enum ks_sample_format {
+    KS_FORMAT_FLOAT32 = 0,
+    KS_FORMAT_INT16 = 1,
+    KS_FORMAT_INT24 = 2
+} ks_sample_format;
+
+/* ADSR envelope parameters. Durations are in samples. */
+typedef struct ks_adsr_params {
+    size_t attack;
+    size_t decay;
+    size_t sustain;
+    size_t release;
+    /* Starting level for sustain */
+    float slevel1;
+    /* Ending level for sustain */
+    float slevel2;
+} ks_adsr_params;
+
+/* Description of the last error on the calling thread ("" if none) */
+KOELSYNTH_API const char *ks_last_error(void);
+
+/* Per sample phase change for a key (0 is 110 Hz, 12 keys per octave) */
+KOELSYNTH_API float ks_key_to_phase_per_sample(float key, float sample_rate);
+
+/* Create a sequencer. frame_size is the internal block size. */
+KOELSYNTH_API ks_status ks_sequencer_create(
+    size_t frame_size, float gain, ks_sequencer **out);
+
+/*
+ * Create a sequencer with num_channels output channels. Events are placed
+ * in them with their pan and spread.
+ */
+KOELSYNTH_API ks_status ks_sequencer_create_multichannel(
+    size_t frame_size, float gain, size_t num_channels, ks_sequencer **out);
+
+/*
+ * Create an independent copy of a sequencer with its complete state
+ * (active events, envelope progress and buffered samples). The copy
+ * renders the same output as seq from here on. A recording in progress is
+ * not copied.
+ */
+KOELSYNTH_API ks_status ks_sequencer_clone(
+    ks_sequencer *seq, ks_sequencer **out);
+
+/* Destroy a sequencer (NULL is allowed) */
+KOELSYNTH_API void ks_sequencer_destroy(ks_sequencer *seq);
+
+/*
+ * Add an FM synth event.
+ * harmonics and amps hold num_harmonics values each. Both envelopes must
+ * have the same total size.
+ */
+KOELSYNTH_API ks_status ks_sequencer_add_fmsynth(
+    ks_sequencer *seq,
+    const float *harmonics, const float *amps, size_t num_harmonics,
+    const ks_adsr_params *mod_env, const ks_adsr_params *env,
+    float phase_per_sample, float gain);
+
+/*
+ * Same as ks_sequencer_add_fmsynth, placed at pan (-1 for the first channel
+ * to 1 for the last) and spread over the nearby channels by spread (0 to 1).
+ * The channel gains have unit power.
+ */
+KOELSYNTH_API ks_status ks_sequencer_add_fmsynth_panned(
+    ks_sequencer *seq,
+    const float *harmonics, const float *amps, size_t num_harmonics,
+    const ks_adsr_params *mod_env, const ks_adsr_params *env,
+    float phase_per_sample, float gain, float pan, float spread);
+
+/*
+ * Render the next num_samples samples (any count) of every channel to out,
+ * interleaved. out must hold num_samples * num_channels values.
+ */
+KOELSYNTH_API ks_status ks_sequencer_render(
+    ks_sequencer *seq, float *out, size_t num_samples);
+
+/* Same as ks_sequencer_render, with channels[ch] receiving channel ch */
+KOELSYNTH_API ks_status ks_sequencer_render_planar(
+    ks_sequencer *seq, float *const *channels, size_t num_samples);
+
+/*
+ * Render the next num_samples samples to out in the given format, in
+ * num_channels interleaved channels. A single channel sequencer repeats
+ * its samples in all of them; otherwise num_channels must match the
+ * sequencer. out must hold num_samples * num_channels samples. dither is
+ * used for integer formats when non-zero.
+ */
+KOELSYNTH_API ks_status ks_sequencer_render_pcm(
+    ks_sequencer *seq, void *out, size_t num_samples,
+    ks_sample_format format, size_t num_channels, int dither);
+
+/* Number of output channels */
+KOELSYNTH_API size_t ks_sequencer_get_num_channels(ks_sequencer *seq);
+
+/* Number of active events */
+KOELSYNTH_API size_t ks_sequencer_get_generator_count(ks_sequencer *seq);
+
+/* Samples per envelope evaluation (1 means every sample) */
+KOELSYNTH_API ks_status ks_sequencer_set_control_rate(
+    ks_sequencer *seq, size_t num_samples);
+
+/* Render low pitched events added later at a reduced sample rate */
+KOELSYNTH_API ks_status ks_sequencer_set_multirate(
+    ks_sequencer *seq, int enable);
+
+/*
+ * Adapt the rendering quality to the time available for a block
+ * (frame_size / sample_rate in seconds for real time): under load the
+ * events lose some accuracy instead of missing the deadline. 0 turns it
+ * off and restores the full quality.
+ */
+KOELSYNTH_API ks_status ks_sequencer_set_frame_budget(
+    ks_sequencer *seq, double seconds);
+
+/* Current quality level: 0 (full) to 3 (cheapest) */
+KOELSYNTH_API int ks_sequencer_get_quality(ks_sequencer *seq);
+
+/*
+ * Record every event given to the sequencer from now on to an event log
+ * at path, replacing a recording in progress. The log can be replayed
+ * with the event_replay tool.
+ */
+KOELSYNTH_API ks_status ks_sequencer_start_recording(
+    ks_sequencer *seq, const char *path);
+
+/* Finish the event log being recorded (if any) */
+KOELSYNTH_API ks_status ks_sequencer_stop_recording(ks_sequencer *seq);
+
+/*
+ * Render tracing. Only records events when the library is built with
+ * KOELSYNTH_TRACE; ks_trace_dump writes Chrome trace JSON.
+ */
+KOELSYNTH_API void ks_trace_start(void);
+KOELSYNTH_API void ks_trace_stop(void);
+KOELSYNTH_API ks_status ks_trace_dump(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,133 @@
+/* Checks that the C interface builds and runs from plain C */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "koelsynth_c.h"
+
+#define CHECK(cond, message) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "FAILED: %s (line %d)\n", message, __LINE__); \
+            return 1; \
+        } \
+    } while (0)
+
+static int test_render(void) {
+    ks_sequencer *seq = NULL;
+    ks_sequencer *copy = NULL;
+    ks_adsr_params env = {100, 100, 1000, 100, 0.5f, 0.1f};
+    float harmonics[] = {2.0f, 5.0f};
+    float amps[] = {1.0f, 1.0f};
+    float out[1500];
+    float copy_out[500];
+    short pcm[2 * 100];
+    float phase = ks_key_to_phase_per_sample(24.0f, 16000.0f);
+    size_t ii;
+    float peak = 0;
+
+    CHECK(ks_sequencer_create(64, 1.0f, &seq) == KS_OK, "create failed");
+    CHECK(ks_sequencer_add_fmsynth(seq, harmonics, amps, 2, &env, &env,
+                                   phase, 1.0f) == KS_OK, "add failed");
+    CHECK(ks_sequencer_get_generator_count(seq) == 1, "generator count");
+
+    /* Sizes that are not a multiple of the frame size */
+    CHECK(ks_sequencer_render(seq, out, 1000) == KS_OK, "render failed");
+    /* A clone continues with the same samples */
+    CHECK(ks_sequencer_clone(seq, &copy) == KS_OK, "clone failed");
+    CHECK(ks_sequencer_render(seq, out + 1000, 500) == KS_OK, "render failed");
+    CHECK(ks_sequencer_render(copy, copy_out, 500) == KS_OK, "render failed");
+    CHECK(memcmp(out + 1000, copy_out, sizeof(copy_out)) == 0,
+          "clone output differs");
+    ks_sequencer_destroy(copy);
+    for (ii = 0; ii < 1500; ii++) {
+        if (fabsf(out[ii]) > peak) {
+            peak = fabsf(out[ii]);
+        }
+    }
+    CHECK(peak > 0.1f && peak <= 1.0f, "unexpected output level");
+
+    CHECK(ks_sequencer_render_pcm(seq, pcm, 100, KS_FORMAT_INT16, 2, 0)
+          == KS_OK, "render_pcm failed");
+    for (ii = 0; ii < 100; ii++) {
+        CHECK(pcm[2 * ii] == pcm[2 * ii + 1], "channels differ");
+    }
+
+    ks_sequencer_destroy(seq);
+    return 0;
+}
+
+static int test_channels(void) {
+    ks_sequencer *seq = NULL;
+    ks_adsr_params env = {100, 100, 1000, 100, 0.5f, 0.1f};
+    float harmonics[] = {2.0f};
+    float amps[] = {1.0f};
+    float phase = ks_key_to_phase_per_sample(12.0f, 16000.0f);
+    float out[2 * 300];
+    float left[300];
+    float right[300];
+    float *channels[2];
+    size_t ii;
+
+    CHECK(ks_sequencer_create_multichannel(64, 1.0f, 2, &seq) == KS_OK,
+          "create failed");
+    CHECK(ks_sequencer_get_num_channels(seq) == 2, "channel count");
+    /* Only in the left channel */
+    CHECK(ks_sequencer_add_fmsynth_panned(seq, harmonics, amps, 1, &env, &env,
+                                          phase, 1.0f, -1.0f, 0.0f) == KS_OK,
+          "add failed");
+    CHECK(ks_sequencer_render(seq, out, 300) == KS_OK, "render failed");
+    channels[0] = left;
+    channels[1] = right;
+    CHECK(ks_sequencer_render_planar(seq, channels, 300) == KS_OK,
+          "render_planar failed");
+    for (ii = 0; ii < 300; ii++) {
+        CHECK(out[2 * ii + 1] == 0.0f && right[ii] == 0.0f,
+              "right channel not silent");
+    }
+    CHECK(fabsf(out[2 * 200]) > 0.0f && fabsf(left[100]) > 0.0f,
+          "left channel silent");
+    ks_sequencer_destroy(seq);
+    return 0;
+}
+
+static int test_errors(void) {
+    ks_sequencer *seq = NULL;
+    ks_adsr_params env = {100, 100, 1000, 100, 0.5f, 0.1f};
+    ks_adsr_params short_env = {10, 10, 10, 10, 0.5f, 0.1f};
+    float harmonics[] = {2.0f};
+    float amps[] = {1.0f};
+
+    CHECK(ks_sequencer_create(0, 1.0f, &seq) == KS_ERROR_INVALID_ARGUMENT,
+          "zero frame size accepted");
+    CHECK(seq == NULL, "sequencer set on failure");
+    CHECK(strlen(ks_last_error()) > 0, "missing error message");
+
+    CHECK(ks_sequencer_create(64, 1.0f, &seq) == KS_OK, "create failed");
+    CHECK(strlen(ks_last_error()) == 0, "error message not cleared");
+    CHECK(ks_sequencer_add_fmsynth(seq, harmonics, amps, 1, &env, &short_env,
+                                   0.1f, 1.0f) == KS_ERROR_INVALID_ARGUMENT,
+          "envelope size mismatch accepted");
+    CHECK(ks_sequencer_set_control_rate(seq, 0) == KS_ERROR_INVALID_ARGUMENT,
+          "zero control rate accepted");
+    CHECK(ks_sequencer_render(NULL, NULL, 0) == KS_ERROR_INVALID_ARGUMENT,
+          "NULL sequencer accepted");
+    CHECK(ks_sequencer_set_frame_budget(seq, 0.008) == KS_OK,
+          "frame budget failed");
+    CHECK(ks_sequencer_get_quality(seq) == 0, "quality lowered without load");
+    ks_sequencer_destroy(seq);
+    ks_sequencer_destroy(NULL);
+    return 0;
+}
+
+int main(void) {
+    int failed = 0;
+    failed |= test_render();
+    failed |= test_channels();
+    failed |= test_errors();
+    if (!failed) {
+        printf("All tests passed\n");
+    }
+    return failed;
+}
@@ -0,0 +1,387 @@
+#ifndef KOELSYNTH_OPERATOR_GRAPH_H
+#define KOELSYNTH_OPERATOR_GRAPH_H
+
+#include <cmath>
+#include <memory>
+#include <vector>
+#include <stdexcept>
+
+#include "frame_generator.h"
+#include "signal_generators.h"
+
+// Operator graph FM voices (like the algorithms of the DX7).
+//
+// An operator is a sine oscillator with its own frequency ratio, level and
+// envelope. Operators modulate the phase of other operators, and can feed
+// back into themselves. The outputs of the carrier operators are summed.
+//
+// A graph is compiled once into a flat program: a list of instructions in
+// topological order. A voice runs the program once per frame, and every
+// instruction is a tight loop over the frame, so there is no walking of
+// the graph and no virtual call per sample.
+
+namespace signal {
+
+struct OperatorParams {
+    // Frequency as a multiple of the base frequency
+    float ratio = 1.0f;
+    // Output level. For modulators this is the peak phase deviation (in
+    // radians) caused in the target; for carriers, the amplitude.
+    float level = 1.0f;
+    // Envelope of the output level
+    AdsrParams env;
+    // Phase modulation by the operator's own output (average of the last
+    // two samples), in radians at full level
+    float feedback = 0.0f;
+};
+
+
+// Steps of a compiled operator graph
+enum class OperatorOpcode {
+    // Clear the modulation input of operator a
+    clear_input,
+    // Add the output of operator b to the modulation input of operator a
+    add_input,
+    // Run operator a over the frame
+    oscillate,
+    // Add the output of operator a to the voice output
+    add_output,
+};
+
+struct OperatorInstruction {
+    OperatorOpcode code = OperatorOpcode::oscillate;
+    size_t a = 0;
+    size_t b = 0;
+};
+
+// Compiled form of an OperatorGraph. Shared by all the voices using it.
+struct OperatorProgram {
+    std::vector<OperatorParams> operators;
+    std::vector<OperatorInstruction> instructions;
+    // Whether an operator has modulation inputs
+    std::vector<bool> has_input;
+    // Size of the voice: the longest envelope of the carriers
+    size_t size = 0;
+};
+
+
+// Description of the operators and their connections
+class OperatorGraph {
+    std::vector<OperatorParams> operators;
+    // (modulator, target) pairs
+    std::vector<std::pair<size_t, size_t>> connections;
+    std::vector<size_t> outputs;
+    // Compiled program, reset when the graph changes
+    std::shared_ptr<const OperatorProgram> program;
+
+    void check_index(size_t index) {
+        if (index >= operators.size()) {
+            throw std::invalid_argument("operator index out of range");
+        }
+    }
+
+public:
+    // Add an operator and return its index
+    size_t add_operator(const OperatorParams &params) {
+        operators.push_back(params);
+        program.reset();
+        return operators.size() - 1;
+    }
+
+    // Let operator modulator modulate the phase of operator target.
+    // Use OperatorParams::feedback for an operator modulating itself.
+    void connect(size_t modulator, size_t target) {
+        check_index(modulator);
+        check_index(target);
+        if (modulator == target) {
+            throw std::invalid_argument("use feedback for self modulation");
+        }
+        connections.push_back({modulator, target});
+        program.reset();
+    }
+
+    // Add the output of an operator to the voice output
+    void add_output(size_t index) {
+        check_index(index);
+        outputs.push_back(index);
+        program.reset();
+    }
+
+    size_t get_operator_count() {
+        return operators.size();
+    }
+
+    // The compiled program (compiled on first use after a change)
+    std::shared_ptr<const OperatorProgram> get_program() {
+        if (!program) {
+            program = compile();
+        }
+        return program;
+    }
+
+    // Sort the operators so that every one comes after its modulators
+    // (Kahn's algorithm), and emit the instructions in that order.
+    std::shared_ptr<const OperatorProgram> compile() {
+        size_t count = operators.size();
+        if (outputs.empty()) {
+            throw std::invalid_argument("operator graph has no output");
+        }
+
+        std::vector<size_t> pending_inputs(count, 0);
+        for (auto &conn: connections) {
+            pending_inputs[conn.second]++;
+        }
+        std::vector<size_t> ready;
+        for (size_t op = 0; op < count; op++) {
+            if (pending_inputs[op] == 0) {
+                ready.push_back(op);
+            }
+        }
+        std::vector<size_t> order;
+        while (!ready.empty()) {
+            size_t op = ready.back();
+            ready.pop_back();
+            order.push_back(op);
+            for (auto &conn: connections) {
+                if (conn.first == op && --pending_inputs[conn.second] == 0) {
+                    ready.push_back(conn.second);
+                }
+            }
+        }
+        if (order.size() != count) {
+            throw std::invalid_argument("operator graph has a cycle");
+        }
+
+        auto result = std::make_shared<OperatorProgram>();
+        result->operators = operators;
+        result->has_input.assign(count, false);
+        for (size_t op: order) {
+            bool first = true;
+            for (auto &conn: connections) {
+                if (conn.second != op) {
+                    continue;
+                }
+                if (first) {
+                    result->instructions.push_back(
+                        {OperatorOpcode::clear_input, op, 0});
+                    first = false;
+                }
+                result->instructions.push_back(
+                    {OperatorOpcode::add_input, op, conn.first});
+            }
+            result->has_input[op] = !first;
+            result->instructions.push_back({OperatorOpcode::oscillate, op, 0});
+        }
+        for (size_t op: outputs) {
+            result->instructions.push_back({OperatorOpcode::add_output, op, 0});
+            result->size = std::max(result->size, operators[op].env.get_size());
+        }
+        return result;
+    }
+};
+
+
+// A voice that runs a compiled operator graph
+class OperatorGraphGenerator: public FrameGenerator {
+    std::shared_ptr<const OperatorProgram> program;
+    size_t size = 0;
+    size_t progress = 0;
+    size_t frame_size = DEFAULT_FRAME_SIZE;
+    size_t control_rate = 1;
+    float gain = 1.0f;
+    // Whether the operators use fast_sinf (see set_quality)
+    bool fast_sine = false;
+
+    // Per operator state
+    std::vector<AdsrEnvelope> envs;
+    std::vector<float> phases;
+    std::vector<float> phase_rates;
+    // Last two outputs, for feedback
+    std::vector<float> last1;
+    std::vector<float> last2;
+    // Per operator frame buffers: output, modulation input and envelope
+    std::vector<float> outputs;
+    std::vector<float> inputs;
+    std::vector<float> env_values;
+
+    friend class Signal_Tester;
+
+    void fill_envelope(size_t op, float *values, size_t count) {
+        AdsrEnvelope &env = envs[op];
+        if (control_rate <= 1) {
+            for (size_t ii = 0; ii < count; ii++) {
+                values[ii] = env.get_next_sample();
+            }
+            return;
+        }
+        // Segments end at the corners of the envelope as well
+        size_t chunk = 0;
+        for (size_t start = 0; start < count; start += chunk) {
+            chunk = std::min(control_rate, count - start);
+            chunk = std::min(chunk, env.samples_to_corner());
+            LinearRamp ramp = env.next_segment(chunk);
+            for (size_t ii = start; ii < start + chunk; ii++) {
+                values[ii] = ramp.next();
+            }
+        }
+    }
+
+    float sine(float phase) {
+        return fast_sine ? fast_sinf(phase) : sinf(phase);
+    }
+
+    void oscillate(size_t op, size_t count) {
+        const OperatorParams &params = program->operators[op];
+        float *out = &outputs[op * frame_size];
+        float *env = &env_values[op * frame_size];
+        fill_envelope(op, env, count);
+
+        const float two_pi = static_cast<float>(2 * M_PI);
+        float phase = phases[op];
+        float rate = phase_rates[op];
+        float level = params.level;
+        if (params.feedback != 0.0f) {
+            // Depends on the previous outputs, sample by sample
+            const float *in = program->has_input[op]
+                ? &inputs[op * frame_size] : nullptr;
+            float fb = 0.5f * params.feedback;
+            float y1 = last1[op];
+            float y2 = last2[op];
+            for (size_t ii = 0; ii < count; ii++) {
+                float mod = fb * (y1 + y2);
+                if (in != nullptr) {
+                    mod += in[ii];
+                }
+                float y = sine(phase + mod) * env[ii] * level;
+                y2 = y1;
+                y1 = y;
+                out[ii] = y;
+                phase += rate;
+                if (phase >= two_pi) {
+                    phase -= two_pi;
+                }
+            }
+            last1[op] = y1;
+            last2[op] = y2;
+        } else if (program->has_input[op]) {
+            const float *in = &inputs[op * frame_size];
+            for (size_t ii = 0; ii < count; ii++) {
+                out[ii] = sine(phase + in[ii]) * env[ii] * level;
+                phase += rate;
+                if (phase >= two_pi) {
+                    phase -= two_pi;
+                }
+            }
+        } else {
+            for (size_t ii = 0; ii < count; ii++) {
+                out[ii] = sine(phase) * env[ii] * level;
+                phase += rate;
+                if (phase >= two_pi) {
+                    phase -= two_pi;
+                }
+            }
+        }
+        phases[op] = phase;
+    }
+
+public:
+    // program_          : compiled graph (see OperatorGraph::get_program)
+    // phase_per_sample  : per sample phase change of the base frequency
+    // gain_             : gain of the voice
+    OperatorGraphGenerator(std::shared_ptr<const OperatorProgram> program_,
+                           float phase_per_sample, float gain_):
+        program(program_),
+        gain(gain_) {
+        if (!program) {
+            throw std::invalid_argument("missing operator program");
+        }
+        size = program->size;
+        size_t count = program->operators.size();
+        for (auto &params: program->operators) {
+            envs.push_back(AdsrEnvelope(params.env));
+            phase_rates.push_back(params.ratio * phase_per_sample);
+        }
+        phases.assign(count, 0.0f);
+        last1.assign(count, 0.0f);
+        last2.assign(count, 0.0f);
+        set_frame_size(frame_size);
+    }
+
+    virtual void set_frame_size(size_t num_samples) {
+        frame_size = num_samples;
+        size_t count = program->operators.size();
+        outputs.assign(count * frame_size, 0.0f);
+        inputs.assign(count * frame_size, 0.0f);
+        env_values.assign(count * frame_size, 0.0f);
+    }
+
+    virtual void set_control_rate(size_t num_samples) {
+        control_rate = num_samples > 0 ? num_samples : 1;
+    }
+
+    // From QUALITY_FAST_SINE, the operators use fast_sinf
+    virtual void set_quality(int level) {
+        fast_sine = level >= QUALITY_FAST_SINE;
+    }
+
+    virtual const char* get_name() {
+        return "operator_graph";
+    }
+
+    virtual size_t get_num_harmonics() {
+        return program->operators.size();
+    }
+
+    virtual bool has_ended() {
+        return progress >= size;
+    }
+
+    virtual size_t get_size() {
+        return size;
+    }
+
+    virtual FrameGenerator* clone() {
+        return new OperatorGraphGenerator(*this);
+    }
+
+    virtual bool next_frame(std::vector<float> &frame) {
+        size_t count = std::min(frame_size, size - progress);
+        frame.assign(count, 0.0f);
+        float *voice_out = frame.data();
+
+        for (auto &inst: program->instructions) {
+            switch (inst.code) {
+            case OperatorOpcode::clear_input: {
+                float *in = &inputs[inst.a * frame_size];
+                std::fill(in, in + count, 0.0f);
+                break;
+            }
+            case OperatorOpcode::add_input: {
+                float *in = &inputs[inst.a * frame_size];
+                const float *src = &outputs[inst.b * frame_size];
+                for (size_t ii = 0; ii < count; ii++) {
+                    in[ii] += src[ii];
+                }
+                break;
+            }
+            case OperatorOpcode::oscillate:
+                oscillate(inst.a, count);
+                break;
+            case OperatorOpcode::add_output: {
+                const float *src = &outputs[inst.a * frame_size];
+                for (size_t ii = 0; ii < count; ii++) {
+                    voice_out[ii] += src[ii] * gain;
+                }
+                break;
+            }
+            }
+        }
+
+        progress += count;
+        return progress >= size;
+    }
+};
+
+}
+
+#endif
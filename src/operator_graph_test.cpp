@@ -0,0 +1,243 @@
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include "simple_tester.h"
+#include "operator_graph.h"
+#include "sequencer.h"
+
+namespace signal {
+
+using tester::TestError;
+
+AdsrParams make_env(size_t sustain) {
+    AdsrParams env;
+    env.attack = 50;
+    env.decay = 100;
+    env.sustain = sustain;
+    env.release = 200;
+    env.slevel1 = 0.8f;
+    env.slevel2 = 0.3f;
+    return env;
+}
+
+OperatorParams make_operator(float ratio, float level, size_t sustain,
+                             float feedback = 0.0f) {
+    OperatorParams params;
+    params.ratio = ratio;
+    params.level = level;
+    params.env = make_env(sustain);
+    params.feedback = feedback;
+    return params;
+}
+
+// Four operators: two stacks of two, like DX7 algorithm 5 reduced
+OperatorGraph make_two_stacks() {
+    OperatorGraph graph;
+    size_t car1 = graph.add_operator(make_operator(1.0f, 0.5f, 3000));
+    size_t mod1 = graph.add_operator(make_operator(2.0f, 1.5f, 3000, 0.7f));
+    size_t car2 = graph.add_operator(make_operator(3.0f, 0.3f, 2000));
+    size_t mod2 = graph.add_operator(make_operator(7.0f, 0.8f, 2000));
+    graph.connect(mod1, car1);
+    graph.connect(mod2, car2);
+    graph.add_output(car1);
+    graph.add_output(car2);
+    return graph;
+}
+
+std::vector<float> render_voice(FrameGenerator &gen) {
+    std::vector<float> output;
+    std::vector<float> frame;
+    while (!gen.has_ended()) {
+        gen.next_frame(frame);
+        output.insert(output.end(), frame.begin(), frame.end());
+    }
+    return output;
+}
+
+class Signal_Tester {
+public:
+    static void test_OperatorGraph_compile() {
+        // Modulators are added after their targets
+        OperatorGraph graph;
+        size_t car = graph.add_operator(make_operator(1, 1, 100));
+        size_t mid = graph.add_operator(make_operator(2, 1, 100));
+        size_t top = graph.add_operator(make_operator(3, 1, 100));
+        graph.connect(top, mid);
+        graph.connect(mid, car);
+        graph.add_output(car);
+
+        auto program = graph.get_program();
+        THROW_IF(program != graph.get_program(), "Program not reused");
+        std::vector<size_t> order;
+        for (auto &inst: program->instructions) {
+            if (inst.code == OperatorOpcode::oscillate) {
+                order.push_back(inst.a);
+            }
+        }
+        THROW_IF(order != std::vector<size_t>({top, mid, car}),
+                 "Operators not in topological order");
+        THROW_IF(program->has_input[top] || !program->has_input[car],
+                 "Wrong modulation inputs");
+        THROW_IF(program->size != make_env(100).get_size(),
+                 "Wrong voice size");
+
+        // A change invalidates the program
+        graph.connect(top, car);
+        THROW_IF(program == graph.get_program(), "Stale program");
+
+        bool thrown = false;
+        try {
+            graph.connect(car, top);
+            graph.get_program();
+        } catch (std::invalid_argument&) {
+            thrown = true;
+        }
+        THROW_IF(!thrown, "Cycle not detected");
+
+        thrown = false;
+        try {
+            OperatorGraph empty;
+            empty.add_operator(make_operator(1, 1, 100));
+            empty.get_program();
+        } catch (std::invalid_argument&) {
+            thrown = true;
+        }
+        THROW_IF(!thrown, "Graph without output accepted");
+
+        thrown = false;
+        try {
+            graph.connect(car, car);
+        } catch (std::invalid_argument&) {
+            thrown = true;
+        }
+        THROW_IF(!thrown, "Self connection accepted");
+    }
+
+    static void test_OperatorGraphGenerator_reference() {
+        // A modulator with feedback into a carrier, computed directly
+        OperatorGraph graph;
+        OperatorParams car = make_operator(1.0f, 0.7f, 1000);
+        OperatorParams mod = make_operator(2.0f, 1.2f, 1000, 0.5f);
+        graph.add_output(graph.add_operator(car));
+        graph.connect(graph.add_operator(mod), 0);
+
+        float rate = 0.05f;
+        float gain = 0.9f;
+        OperatorGraphGenerator gen(graph.get_program(), rate, gain);
+        std::vector<float> output = render_voice(gen);
+        THROW_IF(output.size() != car.env.get_size(), "Wrong voice length");
+
+        AdsrEnvelope car_env(car.env);
+        AdsrEnvelope mod_env(mod.env);
+        double y1 = 0;
+        double y2 = 0;
+        for (size_t ii = 0; ii < output.size(); ii++) {
+            double mod_phase = ii * rate * mod.ratio
+                + 0.5 * mod.feedback * (y1 + y2);
+            double mod_value = sin(mod_phase) * mod_env.get_next_sample()
+                * mod.level;
+            y2 = y1;
+            y1 = mod_value;
+            double expected = sin(ii * rate * car.ratio + mod_value)
+                * car_env.get_next_sample() * car.level * gain;
+            THROW_IF(std::abs(output[ii] - expected) > 2e-3,
+                     "Output differs from the reference");
+        }
+    }
+
+    static void test_OperatorGraphGenerator_frames() {
+        // The output does not depend on the frame size
+        OperatorGraph graph = make_two_stacks();
+        OperatorGraphGenerator gen1(graph.get_program(), 0.03f, 1.0f);
+        OperatorGraphGenerator gen2(graph.get_program(), 0.03f, 1.0f);
+        gen2.set_frame_size(37);
+        std::vector<float> out1 = render_voice(gen1);
+        std::vector<float> out2 = render_voice(gen2);
+        THROW_IF(out1 != out2, "Output depends on the frame size");
+        THROW_IF(gen1.get_num_harmonics() != 4, "Wrong operator count");
+
+        // Control rate envelopes stay close to per sample envelopes
+        OperatorGraphGenerator gen3(graph.get_program(), 0.03f, 1.0f);
+        gen3.set_control_rate(16);
+        std::vector<float> out3 = render_voice(gen3);
+        THROW_IF(out3.size() != out1.size(), "Wrong size at control rate");
+        float max_error = 0;
+        for (size_t ii = 0; ii < out1.size(); ii++) {
+            max_error = std::max(max_error, std::abs(out1[ii] - out3[ii]));
+        }
+        THROW_IF(max_error > 0.05f, "Control rate error too large");
+    }
+
+    static void test_OperatorGraphGenerator_sequencer() {
+        OperatorGraph graph = make_two_stacks();
+        Sequencer seq(128, 0.5f);
+        seq.add(new OperatorGraphGenerator(graph.get_program(), 0.03f, 1.0f));
+        seq.add(new OperatorGraphGenerator(graph.get_program(), 0.05f, 1.0f));
+        std::vector<float> frame(128);
+        float energy = 0;
+        while (seq.get_generator_count() > 0) {
+            seq.render(frame.data(), frame.size());
+            for (float x: frame) {
+                energy += x * x;
+            }
+        }
+        THROW_IF(energy <= 0, "Silent output");
+    }
+
+    // Informational: per voice cost of a 4 operator graph against an FM
+    // synth voice with 3 modulating harmonics (4 sines per sample each),
+    // with the envelopes at a control rate of 16
+    static void test_OperatorGraphGenerator_cost() {
+        OperatorGraph graph = make_two_stacks();
+        FmSynthModParams mod_params({2.0f, 3.0f, 7.0f}, {1.0f, 0.5f, 0.2f});
+        AdsrParams env = make_env(3000);
+        size_t voices = 200;
+        size_t control_rate = 16;
+
+        auto start = std::chrono::steady_clock::now();
+        size_t graph_samples = 0;
+        for (size_t ii = 0; ii < voices; ii++) {
+            OperatorGraphGenerator gen(graph.get_program(), 0.03f, 1.0f);
+            gen.set_control_rate(control_rate);
+            graph_samples += render_voice(gen).size();
+        }
+        auto middle = std::chrono::steady_clock::now();
+        size_t fm_samples = 0;
+        for (size_t ii = 0; ii < voices; ii++) {
+            FmSynthGenerator gen(mod_params, env, env, 0.03f, 1.0f);
+            gen.set_control_rate(control_rate);
+            fm_samples += render_voice(gen).size();
+        }
+        auto end = std::chrono::steady_clock::now();
+
+        double graph_ns = std::chrono::duration<double, std::nano>(
+            middle - start).count() / graph_samples;
+        double fm_ns = std::chrono::duration<double, std::nano>(
+            end - middle).count() / fm_samples;
+        printf("ns per sample: operator graph %.1f, fmsynth %.1f\n",
+               graph_ns, fm_ns);
+        THROW_IF(graph_samples == 0 || fm_samples == 0, "Nothing rendered");
+    }
+};
+
+}
+
+bool test_all() {
+    using namespace signal;
+    using namespace tester;
+
+    TestCollection tests;
+    ADD_TEST(tests, Signal_Tester::test_OperatorGraph_compile);
+    ADD_TEST(tests, Signal_Tester::test_OperatorGraphGenerator_reference);
+    ADD_TEST(tests, Signal_Tester::test_OperatorGraphGenerator_frames);
+    ADD_TEST(tests, Signal_Tester::test_OperatorGraphGenerator_sequencer);
+    ADD_TEST(tests, Signal_Tester::test_OperatorGraphGenerator_cost);
+    return run_tests(tests);
+}
+
+int main() {
+    return test_all() ? 1 : 0;
+}
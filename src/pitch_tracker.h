@@ -0,0 +1,259 @@
+#ifndef KOELSYNTH_PITCH_TRACKER_H
+#define KOELSYNTH_PITCH_TRACKER_H
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+namespace signal {
+
+// A pitch estimate from the tracker
+struct PitchEstimate {
+    // Number of input samples processed when the estimate was made
+    size_t position = 0;
+    // Fundamental frequency in Hz (0 when not voiced)
+    float frequency = 0;
+    // Key number for the frequency (0 is 110 Hz, 12 keys per octave)
+    float key = 0;
+    // 1 minus the normalized difference at the detected period (0 to 1)
+    float confidence = 0;
+    // Whether the input is loud and periodic enough for a pitch
+    bool voiced = false;
+};
+
+
+// Streaming fundamental frequency estimation (YIN).
+//
+// The difference function d(lag) = sum (x[j] - x[j - lag])^2 over the last
+// window_size samples is updated incrementally: every new sample adds the
+// newest term and removes the oldest one for every lag. This costs one pass
+// over the lags per sample, with no FFT and no recomputation per estimate.
+// Every hop_size samples the cumulative mean normalized difference is
+// searched for the first dip below the threshold, refined with a parabola.
+class PitchTracker {
+    float sample_rate = 0;
+    // Integration window of the difference function
+    size_t window_size = 0;
+    // Samples between estimates
+    size_t hop_size = 0;
+    // Lag range from the frequency range
+    size_t min_lag = 0;
+    size_t max_lag = 0;
+    // Largest acceptable normalized difference for a voiced estimate
+    float threshold = 0;
+    // Smallest mean square level for a voiced estimate
+    double silence_power = 0;
+
+    // Last window_size + max_lag + 1 samples, stored twice so that they
+    // are always contiguous (see history())
+    std::vector<float> ring;
+    size_t capacity = 0;
+    size_t pos = 0;
+    // Difference function for lags 0 to max_lag (index 0 unused)
+    std::vector<double> diff;
+    // Sum of squares over the window
+    double power = 0;
+    // Samples processed so far
+    size_t count = 0;
+    // Samples since the difference function was last recomputed in full
+    size_t since_resync = 0;
+    // Samples until the next estimate
+    size_t until_estimate = 0;
+    // Cumulative mean normalized difference (reused)
+    std::vector<float> cmnd;
+
+    friend class Signal_Tester;
+
+    // Oldest of the last capacity samples. The newest is at capacity - 1.
+    const float* history() {
+        return ring.data() + pos;
+    }
+
+    // Recompute the difference function from the stored samples, to drop
+    // the rounding errors of the incremental updates
+    void resync() {
+        const float *x = history();
+        size_t first = capacity - window_size;
+        power = 0;
+        for (size_t jj = first; jj < capacity; jj++) {
+            power += static_cast<double>(x[jj]) * x[jj];
+        }
+        for (size_t lag = 1; lag <= max_lag; lag++) {
+            double sum = 0;
+            for (size_t jj = first; jj < capacity; jj++) {
+                double d = x[jj] - x[jj - lag];
+                sum += d * d;
+            }
+            diff[lag] = sum;
+        }
+        since_resync = 0;
+    }
+
+    void push(float sample) {
+        ring[pos] = sample;
+        ring[pos + capacity] = sample;
+        pos++;
+        if (pos == capacity) {
+            pos = 0;
+        }
+        count++;
+        if (count < capacity) {
+            return;
+        }
+        if (count == capacity || since_resync >= 64 * window_size) {
+            resync();
+            return;
+        }
+
+        // The term that enters the window and the one that leaves it
+        const float *x = history();
+        const float *x_new = x + capacity - 1;
+        const float *x_old = x + max_lag;
+        power += static_cast<double>(x_new[0]) * x_new[0]
+            - static_cast<double>(x_old[0]) * x_old[0];
+        double *d = diff.data();
+        for (size_t lag = 1; lag <= max_lag; lag++) {
+            float a = x_new[0] - *(x_new - lag);
+            float b = x_old[0] - *(x_old - lag);
+            d[lag] += a * a - b * b;
+        }
+        since_resync++;
+    }
+
+    PitchEstimate estimate() {
+        PitchEstimate result;
+        result.position = count;
+        if (count < capacity) {
+            return result;
+        }
+
+        // Cumulative mean normalized difference
+        double running = 0;
+        cmnd[0] = 1;
+        for (size_t lag = 1; lag <= max_lag; lag++) {
+            running += diff[lag];
+            cmnd[lag] = running > 0
+                ? static_cast<float>(diff[lag] * lag / running) : 1.0f;
+        }
+
+        // First dip below the threshold (to its minimum), otherwise the
+        // global minimum
+        size_t best = min_lag;
+        bool found = false;
+        for (size_t lag = min_lag; lag <= max_lag; lag++) {
+            if (cmnd[lag] < threshold) {
+                while (lag + 1 <= max_lag && cmnd[lag + 1] < cmnd[lag]) {
+                    lag++;
+                }
+                best = lag;
+                found = true;
+                break;
+            }
+            if (cmnd[lag] < cmnd[best]) {
+                best = lag;
+            }
+        }
+
+        // Parabolic interpolation around the minimum
+        float period = best;
+        if (best > 1 && best < max_lag) {
+            float left = cmnd[best - 1];
+            float center = cmnd[best];
+            float right = cmnd[best + 1];
+            float denom = left - 2 * center + right;
+            if (denom > 0) {
+                period += 0.5f * (left - right) / denom;
+            }
+        }
+
+        result.confidence = std::max(0.0f, 1.0f - cmnd[best]);
+        result.voiced = found && power / window_size >= silence_power;
+        if (result.voiced) {
+            result.frequency = sample_rate / period;
+            result.key = 12 * log2f(result.frequency / 110.0f);
+        }
+        return result;
+    }
+
+public:
+    // sample_rate_ : sample rate of the input
+    // min_freq     : lowest detectable frequency in Hz
+    // max_freq     : highest detectable frequency in Hz
+    // window_size_ : integration window in samples (0 for the longest
+    //                period of the frequency range)
+    // hop_size_    : samples between estimates
+    // threshold_   : largest normalized difference for a voiced estimate
+    // silence_db   : level (dB of mean square) below which input is silence
+    PitchTracker(float sample_rate_, float min_freq = 60.0f,
+                 float max_freq = 1000.0f, size_t window_size_ = 0,
+                 size_t hop_size_ = 128, float threshold_ = 0.15f,
+                 float silence_db = -50.0f):
+        sample_rate(sample_rate_),
+        window_size(window_size_),
+        hop_size(hop_size_),
+        threshold(threshold_) {
+        if (sample_rate <= 0 || min_freq <= 0 || max_freq <= min_freq) {
+            throw std::invalid_argument("invalid frequency range");
+        }
+        if (hop_size == 0) {
+            throw std::invalid_argument("hop size must be positive");
+        }
+        min_lag = static_cast<size_t>(sample_rate / max_freq);
+        max_lag = static_cast<size_t>(ceilf(sample_rate / min_freq));
+        if (min_lag < 2) {
+            min_lag = 2;
+        }
+        if (max_lag <= min_lag) {
+            throw std::invalid_argument("frequency range is too narrow");
+        }
+        if (window_size == 0) {
+            window_size = max_lag;
+        }
+        silence_power = pow(10.0, silence_db / 10.0);
+
+        capacity = window_size + max_lag + 1;
+        ring.assign(2 * capacity, 0.0f);
+        diff.assign(max_lag + 1, 0.0);
+        cmnd.assign(max_lag + 1, 1.0f);
+        until_estimate = hop_size;
+    }
+
+    // Samples of input before the first estimate with a pitch
+    size_t get_latency() {
+        return capacity;
+    }
+
+    size_t get_hop_size() {
+        return hop_size;
+    }
+
+    // Process input samples and append an estimate for every hop_size
+    // samples to output
+    void process(const float *samples, size_t num_samples,
+                 std::vector<PitchEstimate> &output) {
+        for (size_t ii = 0; ii < num_samples; ii++) {
+            push(samples[ii]);
+            until_estimate--;
+            if (until_estimate == 0) {
+                output.push_back(estimate());
+                until_estimate = hop_size;
+            }
+        }
+    }
+
+    // Forget all the input so far
+    void reset() {
+        std::fill(ring.begin(), ring.end(), 0.0f);
+        std::fill(diff.begin(), diff.end(), 0.0);
+        pos = 0;
+        power = 0;
+        count = 0;
+        since_resync = 0;
+        until_estimate = hop_size;
+    }
+};
+
+}
+
+#endif
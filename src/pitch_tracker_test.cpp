@@ -0,0 +1,118 @@
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "simple_tester.h"
+#include "pitch_tracker.h"
+
+namespace signal {
+
+using tester::TestError;
+
+// Sum of the first harmonics of f0, with amplitude 1/h
+std::vector<float> make_tone(float f0, float sample_rate, size_t size,
+                             size_t num_harmonics) {
+    std::vector<float> samples(size);
+    for (size_t ii = 0; ii < size; ii++) {
+        float value = 0;
+        for (size_t h = 1; h <= num_harmonics; h++) {
+            value += sinf(2 * M_PI * f0 * h * ii / sample_rate) / h;
+        }
+        samples[ii] = 0.3f * value;
+    }
+    return samples;
+}
+
+class Signal_Tester {
+public:
+    static void test_PitchTracker_incremental() {
+        PitchTracker tracker(16000, 80, 800, 300, 64);
+        std::vector<float> samples = make_tone(155.0f, 16000, 3000, 4);
+        std::vector<PitchEstimate> output;
+        tracker.process(samples.data(), samples.size(), output);
+
+        // The incrementally updated difference function must match the
+        // one computed from scratch
+        std::vector<double> incremental = tracker.diff;
+        tracker.resync();
+        for (size_t lag = 1; lag <= tracker.max_lag; lag++) {
+            double expected = tracker.diff[lag];
+            THROW_IF(std::abs(incremental[lag] - expected)
+                     > 1e-3 * (1 + expected),
+                     "Incremental difference function mismatch");
+        }
+    }
+
+    static void test_PitchTracker() {
+        float sample_rate = 16000;
+        float freqs[] = {82.4f, 196.0f, 440.0f, 659.3f};
+        for (float f0: freqs) {
+            PitchTracker tracker(sample_rate);
+            std::vector<float> samples = make_tone(f0, sample_rate, 8000, 5);
+            std::vector<PitchEstimate> output;
+            // Uneven chunks, like audio callbacks
+            size_t sizes[] = {100, 37, 256, 1, 183};
+            size_t start = 0;
+            for (size_t chunk = 0; start < samples.size(); chunk++) {
+                size_t count = std::min(sizes[chunk % 5],
+                                        samples.size() - start);
+                tracker.process(samples.data() + start, count, output);
+                start += count;
+            }
+            THROW_IF(output.size() != samples.size() / tracker.get_hop_size(),
+                     "Unexpected number of estimates");
+            float expected_key = 12 * log2f(f0 / 110.0f);
+            for (auto &est: output) {
+                if (est.position < tracker.get_latency()) {
+                    THROW_IF(est.voiced, "Voiced before the buffer is full");
+                    continue;
+                }
+                THROW_IF(!est.voiced, "Tone is not detected as voiced");
+                THROW_IF(std::abs(est.key - expected_key) > 0.1f,
+                         "Key mismatch " + std::to_string(est.key) +
+                         " for " + std::to_string(f0) + " Hz");
+                THROW_IF(est.confidence < 0.9f, "Low confidence for a tone");
+            }
+        }
+    }
+
+    static void test_PitchTracker_unvoiced() {
+        PitchTracker tracker(16000);
+        std::vector<PitchEstimate> output;
+
+        std::vector<float> silence(4000, 0.0f);
+        tracker.process(silence.data(), silence.size(), output);
+
+        // White noise has no clear period
+        std::vector<float> noise(4000);
+        uint32_t state = 12345;
+        for (auto &x: noise) {
+            state = state * 1664525 + 1013904223;
+            x = 0.3f * (static_cast<float>(state >> 8) / 16777216.0f - 0.5f);
+        }
+        tracker.process(noise.data(), noise.size(), output);
+
+        for (auto &est: output) {
+            THROW_IF(est.voiced, "Silence or noise detected as voiced");
+        }
+    }
+};
+
+}
+
+bool test_all() {
+    using namespace signal;
+    using namespace tester;
+
+    TestCollection tests;
+    ADD_TEST(tests, Signal_Tester::test_PitchTracker_incremental);
+    ADD_TEST(tests, Signal_Tester::test_PitchTracker);
+    ADD_TEST(tests, Signal_Tester::test_PitchTracker_unvoiced);
+    return run_tests(tests);
+}
+
+int main() {
+    return test_all() ? 1 : 0;
+}
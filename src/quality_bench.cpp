@@ -0,0 +1,438 @@
+// Accuracy versus speed harness for the rendering modes.
+//
+// Renders a fixed corpus of scores with every mode and compares the result
+// against renders of the reference path (control rate 1, multirate off).
+// Reports SNR, max abs error, spectral deviation and throughput, and fails
+// if a mode falls below its quality thresholds on any score.
+//
+// Usage: quality_bench <golden_file> [--update]
+// The golden file (src/quality_golden.txt in the source tree) holds the
+// RMS and spectrum of every block of the reference renders, used to check
+// that the reference path has not changed. A missing file or score fails
+// the run; --update writes a new file instead.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <complex>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "signal_generators.h"
+#include "sequencer.h"
+#include "quality_metrics.h"
+
+using namespace signal;
+
+struct Note {
+    // Start of the note in samples
+    size_t start = 0;
+    // Key number (0 is 110 Hz)
+    float key = 0;
+    FmSynthModParams mod_params;
+    AdsrParams mod_env;
+    AdsrParams env;
+};
+
+struct Score {
+    std::string name;
+    float sample_rate = 16000;
+    size_t frame_size = 256;
+    // Notes in the order of their start
+    std::vector<Note> notes;
+    // Total size of the rendering in samples
+    size_t size = 0;
+};
+
+struct Mode {
+    std::string name;
+    size_t control_rate = 1;
+    bool multirate = false;
+    // Quality level of the sequencer (see QualityLevel), as picked by the
+    // quality governor under load
+    int quality = QUALITY_FULL;
+    // Thresholds for passing
+    double min_snr_db = 0;
+    double max_spectral_deviation_db = 0;
+};
+
+AdsrParams make_env(size_t attack, size_t decay, size_t sustain,
+                    size_t release, float slevel1, float slevel2) {
+    AdsrParams params;
+    params.attack = attack;
+    params.decay = decay;
+    params.sustain = sustain;
+    params.release = release;
+    params.slevel1 = slevel1;
+    params.slevel2 = slevel2;
+    return params;
+}
+
+// Fixed corpus, covering low sustained notes, fast notes with sharp
+// attacks and bright timbres with strong modulation.
+std::vector<Score> make_corpus() {
+    std::vector<Score> corpus;
+
+    Score low_chords;
+    low_chords.name = "low_chords";
+    low_chords.sample_rate = 16000;
+    low_chords.frame_size = 160;
+    {
+        AdsrParams env = make_env(200, 400, 12000, 800, 0.6f, 0.2f);
+        FmSynthModParams mod_params({2, 5, 9}, {1, 2, 1});
+        float keys[] = {0, 4, 7, -5, 2, 9};
+        for (size_t ii = 0; ii < 6; ii++) {
+            Note note {ii * 4000, keys[ii], mod_params, env, env};
+            low_chords.notes.push_back(note);
+        }
+    }
+    low_chords.size = 5 * 4000 + 13400;
+    corpus.push_back(low_chords);
+
+    Score arpeggio;
+    arpeggio.name = "fast_arpeggio";
+    arpeggio.sample_rate = 48000;
+    arpeggio.frame_size = 256;
+    {
+        AdsrParams mod_env = make_env(20, 600, 2000, 400, 0.4f, 0.1f);
+        AdsrParams env = make_env(20, 300, 2300, 400, 0.7f, 0.3f);
+        FmSynthModParams mod_params({1, 3}, {2, 1});
+        for (size_t ii = 0; ii < 48; ii++) {
+            float key = 12 + (ii * 7) % 24;
+            Note note {ii * 1200, key, mod_params, mod_env, env};
+            arpeggio.notes.push_back(note);
+        }
+    }
+    arpeggio.size = 47 * 1200 + 3020;
+    corpus.push_back(arpeggio);
+
+    Score pad;
+    pad.name = "bright_pad";
+    pad.sample_rate = 48000;
+    pad.frame_size = 512;
+    {
+        AdsrParams mod_env = make_env(4000, 8000, 30000, 6000, 0.8f, 0.3f);
+        AdsrParams env = make_env(6000, 6000, 30000, 6000, 0.7f, 0.5f);
+        // The weak top harmonic is pruned at QUALITY_PRUNED
+        FmSynthModParams mod_params({2, 3, 7, 11, 13}, {3, 2, 1, 0.5f, 0.1f});
+        float keys[] = {12, 16, 19, 24, 28};
+        for (size_t ii = 0; ii < 5; ii++) {
+            Note note {ii * 2400, keys[ii], mod_params, mod_env, env};
+            pad.notes.push_back(note);
+        }
+    }
+    pad.size = 4 * 2400 + 48000;
+    corpus.push_back(pad);
+
+    return corpus;
+}
+
+// Every mode must be indistinguishable from the reference on every score:
+// at least 30 dB of SNR and at most 0.5 dB of spectral deviation.
+std::vector<Mode> make_modes() {
+    const double min_snr_db = 30;
+    const double max_deviation_db = 0.5;
+    // name, control rate, multirate, quality, min SNR, max spectral
+    // deviation
+    return {
+        {"control_rate_16", 16, false, QUALITY_FULL,
+         min_snr_db, max_deviation_db},
+        {"control_rate_32", 32, false, QUALITY_FULL,
+         min_snr_db, max_deviation_db},
+        {"control_rate_64", 64, false, QUALITY_FULL,
+         min_snr_db, max_deviation_db},
+        {"multirate", 1, true, QUALITY_FULL,
+         min_snr_db, max_deviation_db},
+        {"multirate_cr32", 32, true, QUALITY_FULL,
+         min_snr_db, max_deviation_db},
+        {"quality_pruned", 1, false, QUALITY_PRUNED,
+         min_snr_db, max_deviation_db},
+        {"quality_fast_sine", 1, false, QUALITY_FAST_SINE,
+         min_snr_db, max_deviation_db},
+        {"quality_coarse_control", 1, false, QUALITY_COARSE_CONTROL,
+         min_snr_db, max_deviation_db},
+    };
+}
+
+// Render a score with the given mode. Returns the time taken in seconds.
+double render_score(const Score &score, const Mode &mode,
+                    std::vector<float> &output) {
+    output.assign(score.size, 0.0f);
+    auto start_time = std::chrono::steady_clock::now();
+
+    Sequencer seq(score.frame_size, 1.0f);
+    seq.set_control_rate(mode.control_rate);
+    seq.set_multirate(mode.multirate);
+    seq.set_quality(mode.quality);
+    size_t pos = 0;
+    for (auto &note: score.notes) {
+        seq.render(output.data() + pos, note.start - pos);
+        pos = note.start;
+        seq.add(new FmSynthGenerator(
+            note.mod_params, note.mod_env, note.env,
+            key_to_phase_per_sample(note.key, score.sample_rate), 0.2f));
+    }
+    seq.render(output.data() + pos, score.size - pos);
+
+    auto end_time = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(end_time - start_time).count();
+}
+
+// Summary statistics of a reference render, per block of samples: the RMS
+// and a coarse magnitude spectrum, which also changes with the pitch and
+// timbre of the waveform. Stats are compared with a tolerance, so that a
+// golden file written on one platform holds on the others.
+struct GoldenStats {
+    size_t size = 0;
+    // RMS of every block
+    std::vector<double> rms;
+    // Magnitude of every band of the spectrum (Hann window) of every block
+    std::vector<std::vector<double>> spectra;
+};
+
+const size_t golden_block_size = 2048;
+// Bands of golden_block_size / 2 / golden_band_count FFT bins
+const size_t golden_band_count = 64;
+
+GoldenStats compute_golden_stats(const std::vector<float> &samples) {
+    GoldenStats stats;
+    stats.size = samples.size();
+    size_t band_size = golden_block_size / 2 / golden_band_count;
+    std::vector<std::complex<double>> buffer(golden_block_size);
+    for (size_t start = 0; start < samples.size();
+            start += golden_block_size) {
+        size_t end = std::min(start + golden_block_size, samples.size());
+        double power = 0;
+        for (size_t ii = 0; ii < golden_block_size; ii++) {
+            double x = start + ii < end ? samples[start + ii] : 0.0;
+            power += x * x;
+            double window = 0.5 - 0.5 * cos(2 * M_PI * ii / golden_block_size);
+            buffer[ii] = x * window;
+        }
+        stats.rms.push_back(sqrt(power / (end - start)));
+        fft(buffer);
+        std::vector<double> bands(golden_band_count);
+        for (size_t band = 0; band < golden_band_count; band++) {
+            double band_power = 0;
+            for (size_t bin = band * band_size; bin < (band + 1) * band_size;
+                    bin++) {
+                band_power += std::norm(buffer[bin]);
+            }
+            bands[band] = sqrt(band_power) / golden_block_size;
+        }
+        stats.spectra.push_back(bands);
+    }
+    return stats;
+}
+
+// Largest value of a set of vectors
+double get_peak(const std::vector<std::vector<double>> &values) {
+    double peak = 0;
+    for (auto &row: values) {
+        for (double value: row) {
+            peak = std::max(peak, value);
+        }
+    }
+    return peak;
+}
+
+// Largest difference between two sets of stats, relative to the loudest
+// block (for the RMS) and the loudest band (for the spectra). Infinite when
+// the sizes differ.
+double compare_golden_stats(const GoldenStats &golden,
+                            const GoldenStats &stats) {
+    if (golden.size != stats.size || golden.rms.size() != stats.rms.size()
+            || golden.spectra.size() != stats.spectra.size()) {
+        return INFINITY;
+    }
+    double max_rms = get_peak({golden.rms});
+    double max_band = get_peak(golden.spectra);
+    double error = 0;
+    for (size_t ii = 0; ii < golden.rms.size(); ii++) {
+        double rms_error = std::abs(golden.rms[ii] - stats.rms[ii]);
+        error = std::max(error, max_rms > 0 ? rms_error / max_rms : rms_error);
+        if (golden.spectra[ii].size() != stats.spectra[ii].size()) {
+            return INFINITY;
+        }
+        for (size_t band = 0; band < golden.spectra[ii].size(); band++) {
+            double band_error = std::abs(golden.spectra[ii][band]
+                                         - stats.spectra[ii][band]);
+            error = std::max(error, max_band > 0
+                             ? band_error / max_band : band_error);
+        }
+    }
+    return error;
+}
+
+// Format: for every score a line "score <name> <size>", followed by a line
+// "<rms> <band 0> <band 1> ..." for every block
+std::map<std::string, GoldenStats> load_golden(const std::string &path) {
+    std::ifstream input(path);
+    if (!input) {
+        throw std::runtime_error("failed to read " + path);
+    }
+    std::map<std::string, GoldenStats> golden;
+    GoldenStats *current = nullptr;
+    std::string line;
+    while (std::getline(input, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream fields(line);
+        if (line.compare(0, 6, "score ") == 0) {
+            std::string keyword;
+            std::string name;
+            fields >> keyword >> name;
+            current = &golden[name];
+            fields >> current->size;
+        } else {
+            if (current == nullptr) {
+                throw std::runtime_error("block before a score in " + path);
+            }
+            double rms = 0;
+            std::vector<double> bands(golden_band_count);
+            fields >> rms;
+            for (auto &band: bands) {
+                fields >> band;
+            }
+            current->rms.push_back(rms);
+            current->spectra.push_back(bands);
+        }
+        if (!fields) {
+            throw std::runtime_error("invalid line in " + path + ": " + line);
+        }
+    }
+    return golden;
+}
+
+void save_golden(const std::string &path,
+                 const std::vector<Score> &corpus,
+                 const std::vector<GoldenStats> &stats) {
+    std::ofstream output(path);
+    output << "# Summary statistics of the reference renders of quality_bench\n"
+           << "# (RMS and magnitudes of " << golden_band_count
+           << " spectrum bands per block of " << golden_block_size
+           << " samples).\n"
+           << "# Regenerate with: quality_bench <this file> --update\n";
+    char buffer[64];
+    for (size_t ii = 0; ii < corpus.size(); ii++) {
+        output << "score " << corpus[ii].name << " " << stats[ii].size << "\n";
+        for (size_t jj = 0; jj < stats[ii].rms.size(); jj++) {
+            snprintf(buffer, sizeof(buffer), "%.9g", stats[ii].rms[jj]);
+            output << buffer;
+            for (double band: stats[ii].spectra[jj]) {
+                snprintf(buffer, sizeof(buffer), " %.6g", band);
+                output << buffer;
+            }
+            output << "\n";
+        }
+    }
+    if (!output) {
+        throw std::runtime_error("failed to write " + path);
+    }
+}
+
+int main(int argc, char **argv) {
+    std::string golden_path;
+    bool update = false;
+    for (int ii = 1; ii < argc; ii++) {
+        if (std::strcmp(argv[ii], "--update") == 0) {
+            update = true;
+        } else {
+            golden_path = argv[ii];
+        }
+    }
+    if (golden_path.empty()) {
+        fprintf(stderr, "usage: quality_bench <golden_file> [--update]\n");
+        return 1;
+    }
+
+    std::vector<Score> corpus = make_corpus();
+    std::vector<Mode> modes = make_modes();
+    Mode reference_mode {"reference", 1, false, QUALITY_FULL, 0, 0};
+    bool failed = false;
+
+    std::map<std::string, GoldenStats> golden_stats;
+    if (!update) {
+        try {
+            golden_stats = load_golden(golden_path);
+        } catch (std::runtime_error &error) {
+            printf("%s\n", error.what());
+            return 1;
+        }
+    }
+
+    // The modes are compared against fresh reference renders
+    std::vector<std::vector<float>> reference(corpus.size());
+    std::vector<GoldenStats> reference_stats;
+    double reference_time = 0;
+    size_t total_samples = 0;
+    for (size_t ii = 0; ii < corpus.size(); ii++) {
+        reference_time += render_score(corpus[ii], reference_mode,
+                                       reference[ii]);
+        total_samples += reference[ii].size();
+        reference_stats.push_back(compute_golden_stats(reference[ii]));
+        if (update) {
+            continue;
+        }
+        // The reference path itself must not drift from the golden stats
+        auto golden = golden_stats.find(corpus[ii].name);
+        if (golden == golden_stats.end()) {
+            printf("%s: missing from %s\n", corpus[ii].name.c_str(),
+                   golden_path.c_str());
+            failed = true;
+            continue;
+        }
+        double error = compare_golden_stats(golden->second,
+                                            reference_stats[ii]);
+        if (!(error <= 1e-4)) {
+            printf("%s: reference differs from the golden stats "
+                   "(error %g)\n", corpus[ii].name.c_str(), error);
+            failed = true;
+        }
+    }
+    if (update) {
+        save_golden(golden_path, corpus, reference_stats);
+        printf("golden stats saved to %s\n", golden_path.c_str());
+    }
+
+    printf("%-22s %-14s %9s %12s %10s %10s %8s  %s\n",
+           "mode", "score", "SNR(dB)", "max_abs_err", "spec(dB)",
+           "Msmp/s", "speedup", "result");
+    printf("%-22s %-14s %9s %12s %10s %10.2f %8.2f\n",
+           "reference", "(all)", "-", "-", "-",
+           total_samples / reference_time / 1e6, 1.0);
+
+    for (auto &mode: modes) {
+        double mode_time = 0;
+        bool mode_failed = false;
+        for (size_t ii = 0; ii < corpus.size(); ii++) {
+            std::vector<float> rendered;
+            mode_time += render_score(corpus[ii], mode, rendered);
+            double snr = compute_snr_db(reference[ii], rendered);
+            double max_error = compute_max_abs_error(reference[ii], rendered);
+            double deviation = compute_spectral_deviation_db(
+                reference[ii], rendered);
+            bool passed = snr >= mode.min_snr_db
+                && deviation <= mode.max_spectral_deviation_db;
+            const char *result = passed ? "pass" : "FAIL";
+            mode_failed |= !passed;
+            printf("%-22s %-14s %9.2f %12.3g %10.3f %10s %8s  %s\n",
+                   mode.name.c_str(), corpus[ii].name.c_str(), snr,
+                   max_error, deviation, "", "", result);
+        }
+        printf("%-22s %-14s %9s %12s %10s %10.2f %8.2f  %s\n",
+               mode.name.c_str(), "(all)", "", "", "",
+               total_samples / mode_time / 1e6, reference_time / mode_time,
+               mode_failed ? "FAIL" : "pass");
+        failed |= mode_failed;
+    }
+
+    return failed ? 1 : 0;
+}
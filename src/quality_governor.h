@@ -0,0 +1,104 @@
+#ifndef KOELSYNTH_QUALITY_GOVERNOR_H
+#define KOELSYNTH_QUALITY_GOVERNOR_H
+
+#include <cstddef>
+#include <stdexcept>
+
+#include "frame_generator.h"
+
+// Settings of a QualityGovernor
+struct QualityGovernorParams {
+    // Load (render time over the frame budget) above which the quality
+    // drops by a level
+    double high_load = 0.75;
+    // Load below which the quality rises by a level. Below high_load, so
+    // that the quality does not flip back and forth.
+    double low_load = 0.4;
+    // Weight of the newest frame in the smoothed load (between 0 and 1)
+    double smoothing = 0.1;
+    // Frames to wait after a change before the next one, for the load to
+    // show its effect
+    size_t hold_frames = 16;
+    // Lowest quality to drop to
+    int max_level = QUALITY_COARSE_CONTROL;
+};
+
+
+// Chooses the quality level of a real time render from the time taken by
+// every frame against the time available for it (the frame budget, like
+// frame_size / sample_rate).
+//
+// The load is smoothed with an exponential moving average. The quality
+// drops by a level when the load goes above high_load, and rises by a level
+// when it goes below low_load, at most once every hold_frames frames. A
+// frame that takes longer than the budget drops the quality at once, since
+// it is already a dropout.
+class QualityGovernor {
+    double budget = 0;
+    QualityGovernorParams params;
+    // Smoothed load
+    double load = 0;
+    int level = QUALITY_FULL;
+    // Frames since the last change of level
+    size_t frames_since_change = 0;
+
+public:
+    QualityGovernor(double frame_budget,
+                    QualityGovernorParams params_ = QualityGovernorParams()):
+        budget(frame_budget),
+        params(params_) {
+        if (!(budget > 0)) {
+            throw std::invalid_argument("frame budget must be positive");
+        }
+        if (!(params.low_load < params.high_load)) {
+            throw std::invalid_argument("low_load must be below high_load");
+        }
+        if (!(params.smoothing > 0) || params.smoothing > 1) {
+            throw std::invalid_argument("smoothing must be in (0, 1]");
+        }
+        if (params.max_level < QUALITY_FULL
+                || params.max_level > QUALITY_COARSE_CONTROL) {
+            throw std::invalid_argument("invalid max_level");
+        }
+    }
+
+    // Account for a frame that took render_seconds, and return the level
+    // for the next frame
+    int update(double render_seconds) {
+        double frame_load = render_seconds / budget;
+        load += params.smoothing * (frame_load - load);
+        frames_since_change++;
+        bool overrun = frame_load > 1;
+        bool can_change = frames_since_change >= params.hold_frames;
+        if ((load > params.high_load && can_change) || overrun) {
+            if (level < params.max_level) {
+                level++;
+                frames_since_change = 0;
+            }
+        } else if (load < params.low_load && can_change) {
+            if (level > QUALITY_FULL) {
+                level--;
+                frames_since_change = 0;
+            }
+        }
+        return level;
+    }
+
+    int get_level() {
+        return level;
+    }
+
+    double get_load() {
+        return load;
+    }
+
+    double get_frame_budget() {
+        return budget;
+    }
+
+    QualityGovernorParams get_params() {
+        return params;
+    }
+};
+
+#endif
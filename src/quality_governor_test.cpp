@@ -0,0 +1,168 @@
+
+#include <cmath>
+#include <vector>
+
+#include "simple_tester.h"
+#include "quality_governor.h"
+#include "sequencer.h"
+#include "signal_generators.h"
+
+namespace signal {
+
+using tester::TestError;
+
+void add_voices(Sequencer &seq, size_t count) {
+    AdsrParams env = {
+        .attack = 400,
+        .decay = 400,
+        .sustain = 4000,
+        .release = 400,
+        .slevel1 = 0.5,
+        .slevel2 = 0.2,
+    };
+    FmSynthModParams mod_params({2, 6, 11}, {1, 0.5f, 0.2f});
+    for (size_t ii = 0; ii < count; ii++) {
+        float rate = compute_phase_per_sample(220.0f + 110 * ii, 16000.0f);
+        seq.add(new FmSynthGenerator(mod_params, env, env, rate, 0.2f));
+    }
+}
+
+std::vector<float> render_all(Sequencer &seq) {
+    std::vector<float> output;
+    std::vector<float> frame(seq.get_frame_size());
+    while (seq.get_generator_count() > 0) {
+        seq.render(frame.data(), frame.size());
+        output.insert(output.end(), frame.begin(), frame.end());
+    }
+    return output;
+}
+
+class Signal_Tester {
+public:
+    static void test_QualityGovernor() {
+        QualityGovernorParams params;
+        params.smoothing = 0.5;
+        params.hold_frames = 4;
+        double budget = 0.01;
+
+        // Sustained high load lowers the quality a level at a time
+        QualityGovernor governor(budget, params);
+        std::vector<int> levels;
+        for (size_t ii = 0; ii < 40; ii++) {
+            levels.push_back(governor.update(0.9 * budget));
+        }
+        THROW_IF(levels[0] != QUALITY_FULL, "Changed before the hold");
+        for (size_t ii = 1; ii < levels.size(); ii++) {
+            THROW_IF(levels[ii] < levels[ii - 1]
+                     || levels[ii] > levels[ii - 1] + 1,
+                     "Quality not lowered one level at a time");
+        }
+        THROW_IF(levels.back() != QUALITY_COARSE_CONTROL,
+                 "Quality not at the lowest level");
+        THROW_IF(std::abs(governor.get_load() - 0.9) > 1e-6, "Wrong load");
+
+        // Between the thresholds nothing changes
+        for (size_t ii = 0; ii < 40; ii++) {
+            governor.update(0.6 * budget);
+        }
+        THROW_IF(governor.get_level() != QUALITY_COARSE_CONTROL,
+                 "Quality changed between the thresholds");
+
+        // Low load restores the full quality
+        for (size_t ii = 0; ii < 40; ii++) {
+            governor.update(0.1 * budget);
+        }
+        THROW_IF(governor.get_level() != QUALITY_FULL,
+                 "Quality not restored");
+
+        // An overrun lowers the quality at once
+        QualityGovernor overrun(budget, params);
+        THROW_IF(overrun.update(2 * budget) != QUALITY_PRUNED,
+                 "Overrun ignored");
+
+        // max_level limits the drop
+        params.max_level = QUALITY_PRUNED;
+        QualityGovernor limited(budget, params);
+        for (size_t ii = 0; ii < 40; ii++) {
+            limited.update(2 * budget);
+        }
+        THROW_IF(limited.get_level() != QUALITY_PRUNED, "max_level ignored");
+
+        bool thrown = false;
+        try {
+            params.low_load = params.high_load;
+            QualityGovernor invalid(budget, params);
+        } catch (std::invalid_argument&) {
+            thrown = true;
+        }
+        THROW_IF(!thrown, "Overlapping thresholds accepted");
+    }
+
+    static void test_Sequencer_quality() {
+        // Going back to full quality before any voice gives the reference
+        Sequencer reference(128, 1.0f);
+        add_voices(reference, 4);
+        Sequencer restored(128, 1.0f);
+        restored.set_quality(QUALITY_COARSE_CONTROL);
+        restored.set_quality(QUALITY_FULL);
+        add_voices(restored, 4);
+        std::vector<float> expected = render_all(reference);
+        THROW_IF(render_all(restored) != expected, "Full quality changed");
+
+        // The lowest quality stays close to the reference
+        Sequencer degraded(128, 1.0f);
+        add_voices(degraded, 4);
+        degraded.set_quality(QUALITY_COARSE_CONTROL);
+        THROW_IF(degraded.get_quality() != QUALITY_COARSE_CONTROL,
+                 "Quality not set");
+        std::vector<float> samples = render_all(degraded);
+        THROW_IF(samples.size() != expected.size(), "Total size mismatch");
+        double error = 0;
+        double power = 0;
+        for (size_t ii = 0; ii < samples.size(); ii++) {
+            error += (samples[ii] - expected[ii]) * (samples[ii] - expected[ii]);
+            power += expected[ii] * expected[ii];
+        }
+        THROW_IF(10 * log10(power / error) < 20, "Degraded SNR too low");
+
+        // A budget that no block can meet lowers the quality to the lowest,
+        // and no budget restores it
+        Sequencer governed(128, 1.0f);
+        add_voices(governed, 4);
+        governed.set_frame_budget(1e-9);
+        std::vector<float> frame(128);
+        for (size_t ii = 0; ii < 8; ii++) {
+            governed.render(frame.data(), frame.size());
+        }
+        THROW_IF(governed.get_quality() != QUALITY_COARSE_CONTROL,
+                 "Quality not lowered under load");
+        THROW_IF(governed.get_load() <= 1, "Wrong load");
+        governed.set_frame_budget(0);
+        THROW_IF(governed.get_quality() != QUALITY_FULL,
+                 "Quality not restored without a budget");
+
+        bool thrown = false;
+        try {
+            governed.set_quality(QUALITY_COARSE_CONTROL + 1);
+        } catch (std::invalid_argument&) {
+            thrown = true;
+        }
+        THROW_IF(!thrown, "Invalid quality accepted");
+    }
+};
+
+}
+
+bool test_all() {
+    using namespace signal;
+    using namespace tester;
+
+    TestCollection tests;
+    ADD_TEST(tests, Signal_Tester::test_QualityGovernor);
+    ADD_TEST(tests, Signal_Tester::test_Sequencer_quality);
+    return run_tests(tests);
+}
+
+int main() {
+    return test_all() ? 1 : 0;
+}
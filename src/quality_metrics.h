@@ -0,0 +1,159 @@
+#ifndef KOELSYNTH_QUALITY_METRICS_H
+#define KOELSYNTH_QUALITY_METRICS_H
+
+#include <cmath>
+#include <complex>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#ifndef M_PI
+    #define M_PI 3.14159265358979323846
+#endif
+
+// Measures of how far a rendered signal is from a reference rendering.
+// Used to put a number on the quality cost of the fast rendering modes.
+
+namespace signal {
+
+// Signal to noise ratio of test against reference in dB, where the noise is
+// the difference. Identical signals give infinity.
+inline double compute_snr_db(
+    const std::vector<float> &reference,
+    const std::vector<float> &test
+) {
+    if (reference.size() != test.size()) {
+        throw std::invalid_argument("signal sizes do not match");
+    }
+    double signal_energy = 0;
+    double error_energy = 0;
+    for (size_t ii = 0; ii < reference.size(); ii++) {
+        double diff = test[ii] - reference[ii];
+        signal_energy += static_cast<double>(reference[ii]) * reference[ii];
+        error_energy += diff * diff;
+    }
+    if (error_energy == 0) {
+        return INFINITY;
+    }
+    return 10 * log10(signal_energy / error_energy);
+}
+
+// Largest absolute sample difference
+inline double compute_max_abs_error(
+    const std::vector<float> &reference,
+    const std::vector<float> &test
+) {
+    if (reference.size() != test.size()) {
+        throw std::invalid_argument("signal sizes do not match");
+    }
+    double result = 0;
+    for (size_t ii = 0; ii < reference.size(); ii++) {
+        result = std::max(result, std::fabs(
+            static_cast<double>(test[ii]) - reference[ii]));
+    }
+    return result;
+}
+
+// In-place radix 2 FFT. The size must be a power of 2.
+inline void fft(std::vector<std::complex<double>> &data) {
+    size_t size = data.size();
+    if (size == 0 || (size & (size - 1)) != 0) {
+        throw std::invalid_argument("FFT size must be a power of 2");
+    }
+    for (size_t ii = 1, jj = 0; ii < size; ii++) {
+        size_t bit = size >> 1;
+        for (; jj & bit; bit >>= 1) {
+            jj ^= bit;
+        }
+        jj ^= bit;
+        if (ii < jj) {
+            std::swap(data[ii], data[jj]);
+        }
+    }
+    for (size_t len = 2; len <= size; len <<= 1) {
+        double angle = -2 * M_PI / len;
+        std::complex<double> step(cos(angle), sin(angle));
+        for (size_t start = 0; start < size; start += len) {
+            std::complex<double> twiddle(1, 0);
+            for (size_t ii = 0; ii < len / 2; ii++) {
+                std::complex<double> even = data[start + ii];
+                std::complex<double> odd = data[start + ii + len / 2] * twiddle;
+                data[start + ii] = even + odd;
+                data[start + ii + len / 2] = even - odd;
+                twiddle *= step;
+            }
+        }
+    }
+}
+
+// Magnitude spectra (Hann window) of the frames of a signal, frame by frame
+inline std::vector<std::vector<double>> compute_spectrogram(
+    const std::vector<float> &samples, size_t fft_size, size_t hop
+) {
+    std::vector<double> window(fft_size);
+    for (size_t ii = 0; ii < fft_size; ii++) {
+        window[ii] = 0.5 - 0.5 * cos(2 * M_PI * ii / fft_size);
+    }
+    std::vector<std::vector<double>> result;
+    std::vector<std::complex<double>> buffer(fft_size);
+    for (size_t start = 0; start + fft_size <= samples.size(); start += hop) {
+        for (size_t ii = 0; ii < fft_size; ii++) {
+            buffer[ii] = samples[start + ii] * window[ii];
+        }
+        fft(buffer);
+        std::vector<double> magnitudes(fft_size / 2 + 1);
+        for (size_t ii = 0; ii < magnitudes.size(); ii++) {
+            magnitudes[ii] = std::abs(buffer[ii]);
+        }
+        result.push_back(magnitudes);
+    }
+    return result;
+}
+
+// Mean absolute difference in dB between the short time spectra of test and
+// reference. Only bins of the reference within floor_db of its loudest bin
+// are counted, so that silence and the noise floor do not dominate.
+inline double compute_spectral_deviation_db(
+    const std::vector<float> &reference,
+    const std::vector<float> &test,
+    size_t fft_size = 1024,
+    double floor_db = 60
+) {
+    if (reference.size() != test.size()) {
+        throw std::invalid_argument("signal sizes do not match");
+    }
+    auto ref_spec = compute_spectrogram(reference, fft_size, fft_size / 2);
+    auto test_spec = compute_spectrogram(test, fft_size, fft_size / 2);
+
+    double peak = 0;
+    for (auto &frame: ref_spec) {
+        for (double mag: frame) {
+            peak = std::max(peak, mag);
+        }
+    }
+    if (peak == 0) {
+        return 0;
+    }
+    double threshold = peak * pow(10.0, -floor_db / 20);
+    // Keeps log10 finite where test has a zero bin
+    double tiny = threshold * 1e-3;
+
+    double total = 0;
+    size_t count = 0;
+    for (size_t frame = 0; frame < ref_spec.size(); frame++) {
+        for (size_t bin = 0; bin < ref_spec[frame].size(); bin++) {
+            double ref_mag = ref_spec[frame][bin];
+            if (ref_mag < threshold) {
+                continue;
+            }
+            double test_mag = test_spec[frame][bin] + tiny;
+            total += std::fabs(20 * log10(test_mag / ref_mag));
+            count++;
+        }
+    }
+    return count == 0 ? 0 : total / count;
+}
+
+}
+
+#endif
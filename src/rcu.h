@@ -0,0 +1,158 @@
+#ifndef KOELSYNTH_RCU_H
+#define KOELSYNTH_RCU_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+// Read-copy-update for data shared with the rendering threads.
+//
+// A writer publishes a new version with an atomic pointer swap and retires
+// the old one. Readers load the pointer inside a read section (like the
+// rendering of a block) and must not keep it past the end of the section.
+// A retired version is freed once every reader has been outside of a read
+// section since it was retired. Readers never wait or lock: a section costs
+// an atomic load and two atomic stores. Freeing is done by the writers.
+//
+// Every reader has a record in the domain. Between sections the record
+// says the reader is quiescent, so readers that do not render at all do
+// not hold back the freeing.
+
+class RcuDomain;
+
+// The record of a reader (like a Sequencer)
+class RcuReader {
+    friend class RcuDomain;
+    // Epoch of the domain when the current read section started, 0 when
+    // outside of a read section
+    std::atomic<uint64_t> epoch {0};
+};
+
+
+class RcuDomain {
+    struct Retired {
+        // Epoch after the version was replaced
+        uint64_t epoch = 0;
+        std::function<void()> free;
+    };
+
+    // Advanced by every retire. Starts at 1, since 0 marks quiescent readers.
+    std::atomic<uint64_t> epoch {1};
+    // Protects readers and retired (not used by read sections)
+    std::mutex mutex;
+    std::vector<RcuReader*> readers;
+    std::vector<Retired> retired;
+
+    // Free the retired versions no reader can still see. mutex must be held.
+    void reclaim_locked() {
+        uint64_t oldest = UINT64_MAX;
+        for (auto reader: readers) {
+            uint64_t reader_epoch = reader->epoch.load();
+            if (reader_epoch != 0) {
+                oldest = std::min(oldest, reader_epoch);
+            }
+        }
+        // A reader that started its section at epoch e can only see
+        // versions replaced after e
+        std::vector<Retired> pending;
+        for (auto &entry: retired) {
+            if (entry.epoch <= oldest) {
+                entry.free();
+            } else {
+                pending.push_back(std::move(entry));
+            }
+        }
+        retired.swap(pending);
+    }
+
+public:
+    RcuDomain() = default;
+    RcuDomain(const RcuDomain&) = delete;
+    RcuDomain& operator=(const RcuDomain&) = delete;
+
+    // The domain used by sequencers and instruments
+    static RcuDomain& global() {
+        static RcuDomain domain;
+        return domain;
+    }
+
+    void add_reader(RcuReader *reader) {
+        std::lock_guard<std::mutex> lock(mutex);
+        readers.push_back(reader);
+    }
+
+    // The reader must be outside of a read section
+    void remove_reader(RcuReader *reader) {
+        std::lock_guard<std::mutex> lock(mutex);
+        readers.erase(std::remove(readers.begin(), readers.end(), reader),
+                      readers.end());
+        reclaim_locked();
+    }
+
+    // Start a read section: pointers loaded from here on stay valid until
+    // end_read
+    void begin_read(RcuReader &reader) {
+        reader.epoch.store(epoch.load());
+    }
+
+    // End a read section (a quiescent state of the reader)
+    void end_read(RcuReader &reader) {
+        reader.epoch.store(0);
+    }
+
+    // Free a version with free once no reader can see it. Call after the
+    // version was replaced in the shared pointer.
+    void retire(std::function<void()> free) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Retired entry;
+        entry.epoch = epoch.fetch_add(1) + 1;
+        entry.free = std::move(free);
+        retired.push_back(std::move(entry));
+        reclaim_locked();
+    }
+
+    // Free what can be freed now (retire does this as well)
+    void reclaim() {
+        std::lock_guard<std::mutex> lock(mutex);
+        reclaim_locked();
+    }
+
+    // Versions waiting to be freed
+    size_t get_retired_count() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return retired.size();
+    }
+
+    // Readers are gone by now
+    ~RcuDomain() {
+        for (auto &entry: retired) {
+            entry.free();
+        }
+    }
+};
+
+
+// A read section for the lifetime of the object
+class RcuReadSection {
+    RcuDomain &domain;
+    RcuReader &reader;
+
+public:
+    RcuReadSection(RcuDomain &domain_, RcuReader &reader_):
+        domain(domain_),
+        reader(reader_) {
+        domain.begin_read(reader);
+    }
+
+    RcuReadSection(const RcuReadSection&) = delete;
+    RcuReadSection& operator=(const RcuReadSection&) = delete;
+
+    ~RcuReadSection() {
+        domain.end_read(reader);
+    }
+};
+
+#endif
@@ -0,0 +1,342 @@
+#ifndef KOELSYNTH_RENDER_ENGINE_H
+#define KOELSYNTH_RENDER_ENGINE_H
+
+#include <ctime>
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdexcept>
+#include <condition_variable>
+
+#include "sequencer.h"
+
+// CPU time used by the calling thread, in seconds
+inline double thread_cpu_seconds() {
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+
+// Rendering statistics of a stream
+struct StreamStats {
+    // Frames rendered
+    size_t frames = 0;
+    // CPU time spent rendering, in seconds
+    double cpu_seconds = 0;
+    // Longest time to render a frame, in seconds
+    double max_frame_seconds = 0;
+    // Frames finished after the time they were due to play
+    size_t deadline_misses = 0;
+    // Frames requested by the reader before they were rendered
+    size_t underruns = 0;
+    // Rendering threw, and the stream renders no more frames
+    bool failed = false;
+    // Message of the error when failed
+    std::string error;
+};
+
+
+// Renders many sequencers (streams) on a fixed pool of worker threads.
+//
+// Every stream has a queue of rendered frames. Workers keep the queues
+// full, always picking the stream whose next frame is due to play first
+// (earliest deadline first). Frame k of a stream is due k + 1 frame
+// durations after the stream was added, as if it is played in real time
+// with every frame rendered during the frame before it. Readers
+// take frames from the queues at their own pace, from any thread.
+//
+// While a sequencer is registered, events must be added to it with post(),
+// and it must not be rendered directly.
+//
+// If rendering a stream throws, the stream is marked as failed and no
+// longer rendered; the other streams go on. Its reader gets the frames
+// rendered before, and then the error from read_frame.
+class RenderEngine {
+    typedef std::chrono::steady_clock Clock;
+
+    struct Stream {
+        size_t id = 0;
+        // Not owned
+        Sequencer *seq = nullptr;
+        size_t frame_size = 0;
+        size_t num_channels = 1;
+        // Play time of one frame
+        Clock::duration frame_duration;
+        Clock::time_point start_time;
+        // Rendered frames, in a ring of queue_frames frames
+        std::vector<float> queue;
+        size_t queue_frames = 0;
+        // Frames written to and read from the queue so far
+        size_t written = 0;
+        size_t read = 0;
+        // A worker is rendering this stream
+        bool busy = false;
+        // What rendering threw (the stream is failed), or null
+        std::exception_ptr error;
+        StreamStats stats;
+
+        Clock::time_point next_deadline() const {
+            return start_time + frame_duration * (written + 1);
+        }
+
+        bool has_space() const {
+            return written - read < queue_frames;
+        }
+    };
+
+    std::vector<std::unique_ptr<Stream>> streams;
+    size_t next_id = 0;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    // Signalled when there may be work for the workers
+    std::condition_variable work_ready;
+    // Signalled when a frame is rendered
+    std::condition_variable frame_ready;
+    bool stopping = false;
+
+    Stream* find_stream(size_t id) {
+        for (auto &stream: streams) {
+            if (stream->id == id) {
+                return stream.get();
+            }
+        }
+        throw std::invalid_argument("unknown stream");
+    }
+
+    static std::string describe_error(std::exception_ptr error) {
+        try {
+            std::rethrow_exception(error);
+        } catch (std::exception &e) {
+            return e.what();
+        } catch (...) {
+            return "unknown error";
+        }
+    }
+
+    // Stream with the earliest deadline that needs a frame, or nullptr
+    Stream* pick_stream() {
+        Stream *best = nullptr;
+        for (auto &stream: streams) {
+            if (stream->busy || stream->error || !stream->has_space()) {
+                continue;
+            }
+            if (best == nullptr
+                || stream->next_deadline() < best->next_deadline()) {
+                best = stream.get();
+            }
+        }
+        return best;
+    }
+
+    void worker_loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            Stream *stream = nullptr;
+            work_ready.wait(lock, [&] {
+                stream = pick_stream();
+                return stopping || stream != nullptr;
+            });
+            if (stopping) {
+                return;
+            }
+
+            // The stream is rendered without the lock. Only this worker
+            // writes to its free queue slot while busy is set.
+            stream->busy = true;
+            size_t slot = stream->written % stream->queue_frames;
+            float *out = stream->queue.data()
+                + slot * stream->frame_size * stream->num_channels;
+            Clock::time_point deadline = stream->next_deadline();
+            lock.unlock();
+
+            double cpu_start = thread_cpu_seconds();
+            Clock::time_point start = Clock::now();
+            std::exception_ptr error;
+            try {
+                TRACE_SCOPE_ARGS("engine", "stream",
+                                 trace::stream_args(stream->id));
+                stream->seq->render(out, stream->frame_size);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            Clock::time_point end = Clock::now();
+            double cpu_time = thread_cpu_seconds() - cpu_start;
+
+            lock.lock();
+            StreamStats &stats = stream->stats;
+            if (error) {
+                // The frame is not written, and the reader gets the error
+                stream->error = error;
+                stats.failed = true;
+                stats.error = describe_error(error);
+                stream->busy = false;
+                frame_ready.notify_all();
+                continue;
+            }
+            stats.frames++;
+            stats.cpu_seconds += cpu_time;
+            double elapsed = std::chrono::duration<double>(end - start).count();
+            if (elapsed > stats.max_frame_seconds) {
+                stats.max_frame_seconds = elapsed;
+            }
+            if (end > deadline) {
+                stats.deadline_misses++;
+            }
+            stream->written++;
+            stream->busy = false;
+            frame_ready.notify_all();
+        }
+    }
+
+public:
+    // num_workers : number of worker threads (0 for one per core)
+    RenderEngine(size_t num_workers = 0) {
+        if (num_workers == 0) {
+            num_workers = std::thread::hardware_concurrency();
+            if (num_workers == 0) {
+                num_workers = 1;
+            }
+        }
+        for (size_t ii = 0; ii < num_workers; ii++) {
+            workers.emplace_back(&RenderEngine::worker_loop, this);
+        }
+    }
+
+    RenderEngine(const RenderEngine&) = delete;
+    RenderEngine& operator=(const RenderEngine&) = delete;
+
+    size_t get_worker_count() {
+        return workers.size();
+    }
+
+    // Register a sequencer (not owned) and return its stream id.
+    // sample_rate sets the deadlines of its frames. Up to queue_frames
+    // frames are rendered ahead of the reader.
+    size_t add_stream(Sequencer *seq, float sample_rate,
+                      size_t queue_frames = 4) {
+        if (seq == nullptr || sample_rate <= 0 || queue_frames == 0) {
+            throw std::invalid_argument("invalid stream parameters");
+        }
+        auto stream = std::unique_ptr<Stream>(new Stream());
+        stream->seq = seq;
+        stream->frame_size = seq->get_frame_size();
+        stream->num_channels = seq->get_num_channels();
+        stream->frame_duration = std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(stream->frame_size / sample_rate));
+        stream->start_time = Clock::now();
+        stream->queue_frames = queue_frames;
+        stream->queue.assign(
+            queue_frames * stream->frame_size * stream->num_channels, 0.0f);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        stream->id = next_id++;
+        size_t id = stream->id;
+        streams.push_back(std::move(stream));
+        work_ready.notify_all();
+        return id;
+    }
+
+    // Unregister a stream, waiting for a frame being rendered to finish.
+    // The sequencer can be used directly again afterwards.
+    void remove_stream(size_t id) {
+        std::unique_lock<std::mutex> lock(mutex);
+        Stream *stream = find_stream(id);
+        frame_ready.wait(lock, [&] {
+            return !stream->busy;
+        });
+        for (size_t ii = 0; ii < streams.size(); ii++) {
+            if (streams[ii].get() == stream) {
+                streams.erase(streams.begin() + ii);
+                break;
+            }
+        }
+        // Readers waiting on this stream have to notice the removal
+        frame_ready.notify_all();
+    }
+
+    size_t get_stream_count() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return streams.size();
+    }
+
+    size_t get_frame_size(size_t id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return find_stream(id)->frame_size;
+    }
+
+    // Copy the next frame of a stream (frame_size samples of every channel,
+    // interleaved) to out.
+    // If it is not rendered yet, waits for it when wait is true and
+    // otherwise returns false. Once the frames rendered before a failure
+    // are read, throws what the rendering threw. Frames of a stream must be
+    // read by one thread at a time.
+    bool read_frame(size_t id, float *out, bool wait = true) {
+        std::unique_lock<std::mutex> lock(mutex);
+        Stream *stream = find_stream(id);
+        if (stream->written == stream->read) {
+            if (stream->error) {
+                std::rethrow_exception(stream->error);
+            }
+            stream->stats.underruns++;
+            if (!wait) {
+                return false;
+            }
+            // The stream may be removed or fail while waiting
+            frame_ready.wait(lock, [&] {
+                for (auto &item: streams) {
+                    if (item.get() == stream) {
+                        return stream->written > stream->read
+                            || stream->error;
+                    }
+                }
+                return true;
+            });
+            stream = find_stream(id);
+            if (stream->written == stream->read) {
+                std::rethrow_exception(stream->error);
+            }
+        }
+        size_t slot = stream->read % stream->queue_frames;
+        size_t count = stream->frame_size * stream->num_channels;
+        const float *src = stream->queue.data() + slot * count;
+        for (size_t ii = 0; ii < count; ii++) {
+            out[ii] = src[ii];
+        }
+        stream->read++;
+        work_ready.notify_one();
+        return true;
+    }
+
+    size_t get_num_channels(size_t id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return find_stream(id)->num_channels;
+    }
+
+    StreamStats get_stats(size_t id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return find_stream(id)->stats;
+    }
+
+    ~RenderEngine() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work_ready.notify_all();
+        for (auto &worker: workers) {
+            worker.join();
+        }
+    }
+};
+
+#endif
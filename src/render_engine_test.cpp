@@ -0,0 +1,242 @@
+
+#include <chrono>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+#include "simple_tester.h"
+#include "signal_generators.h"
+#include "sequencer.h"
+#include "render_engine.h"
+
+using tester::TestError;
+using namespace signal;
+
+FrameGenerator* make_note(float key) {
+    AdsrParams env_params = {
+        .attack = 100,
+        .decay = 200,
+        .sustain = 2000,
+        .release = 300,
+    };
+    FmSynthModParams mod_params({2, 5}, {1, 1});
+    return new FmSynthGenerator(
+        mod_params, env_params, env_params,
+        key_to_phase_per_sample(key, 16000.0f), 0.5f);
+}
+
+void test_parallel_render() {
+    size_t num_streams = 12;
+    size_t num_frames = 40;
+    size_t frame_size = 128;
+
+    RenderEngine engine(4);
+    std::vector<Sequencer*> rendered;
+    std::vector<Sequencer*> reference;
+    std::vector<size_t> ids;
+    for (size_t ii = 0; ii < num_streams; ii++) {
+        rendered.push_back(new Sequencer(frame_size));
+        reference.push_back(new Sequencer(frame_size));
+        rendered[ii]->add(make_note(ii));
+        reference[ii]->add(make_note(ii));
+        ids.push_back(engine.add_stream(rendered[ii], 16000, 3));
+    }
+    THROW_IF(engine.get_stream_count() != num_streams, "Stream count mismatch");
+
+    std::vector<float> frame(frame_size);
+    std::vector<float> expected(frame_size);
+    for (size_t count = 0; count < num_frames; count++) {
+        for (size_t ii = 0; ii < num_streams; ii++) {
+            if (count == 10) {
+                // Events posted while the engine renders
+                rendered[ii]->post(make_note(ii + 7));
+            }
+            THROW_IF(!engine.read_frame(ids[ii], frame.data()),
+                     "Blocking read failed");
+            if (count >= 10) {
+                // Frames from here may include the posted events
+                continue;
+            }
+            reference[ii]->next_frame(expected);
+            for (size_t jj = 0; jj < frame_size; jj++) {
+                THROW_IF(frame[jj] != expected[jj],
+                         "Engine output differs from direct rendering");
+            }
+        }
+    }
+
+    for (size_t ii = 0; ii < num_streams; ii++) {
+        StreamStats stats = engine.get_stats(ids[ii]);
+        THROW_IF(stats.frames < num_frames, "Frame count mismatch");
+        THROW_IF(stats.cpu_seconds <= 0, "CPU time not accounted");
+        engine.remove_stream(ids[ii]);
+    }
+    THROW_IF(engine.get_stream_count() != 0, "Streams not removed");
+
+    bool threw = false;
+    try {
+        engine.read_frame(ids[0], frame.data());
+    } catch (const std::invalid_argument&) {
+        threw = true;
+    }
+    THROW_IF(!threw, "Reading a removed stream must fail");
+
+    for (size_t ii = 0; ii < num_streams; ii++) {
+        delete rendered[ii];
+        delete reference[ii];
+    }
+}
+
+void test_post_from_other_thread() {
+    size_t frame_size = 64;
+    Sequencer seq(frame_size);
+    RenderEngine engine(2);
+    size_t id = engine.add_stream(&seq, 16000);
+
+    std::thread poster([&] {
+        for (size_t ii = 0; ii < 50; ii++) {
+            seq.post(new ConstantGenerator(0.01f, 4 * frame_size));
+        }
+    });
+
+    std::vector<float> frame(frame_size);
+    float total = 0;
+    for (size_t count = 0; count < 400; count++) {
+        engine.read_frame(id, frame.data());
+        for (float x: frame) {
+            total += x;
+        }
+    }
+    poster.join();
+    // Drain whatever is left of the posted constants
+    for (size_t count = 0; count < 8; count++) {
+        engine.read_frame(id, frame.data());
+        for (float x: frame) {
+            total += x;
+        }
+    }
+    engine.remove_stream(id);
+    float expected = 50 * 0.01f * 4 * frame_size;
+    THROW_IF(std::abs(total - expected) > 1e-3f * expected,
+             "Posted generators were not all rendered");
+}
+
+// A generator that takes delay to render each frame
+class SlowGenerator: public ConstantGenerator {
+    std::chrono::microseconds delay;
+
+public:
+    SlowGenerator(std::chrono::microseconds delay_):
+        ConstantGenerator(0.5f, 1000000),
+        delay(delay_) {
+    }
+
+    virtual bool next_frame(std::vector<float> &frame) {
+        std::this_thread::sleep_for(delay);
+        return ConstantGenerator::next_frame(frame);
+    }
+};
+
+void test_deadline_misses() {
+    size_t num_frames = 8;
+    RenderEngine engine(2);
+
+    // 64 ms per frame: rendered long before the frames are due
+    size_t fast_size = 1024;
+    Sequencer fast(fast_size);
+    fast.add(new ConstantGenerator(0.25f, 100 * fast_size));
+    size_t fast_id = engine.add_stream(&fast, 16000);
+
+    // 1 ms per frame, but 5 ms to render: every frame is late
+    size_t slow_size = 16;
+    Sequencer slow(slow_size);
+    slow.add(new SlowGenerator(std::chrono::milliseconds(5)));
+    size_t slow_id = engine.add_stream(&slow, 16000);
+
+    std::vector<float> frame(fast_size);
+    for (size_t count = 0; count < num_frames; count++) {
+        engine.read_frame(fast_id, frame.data());
+        engine.read_frame(slow_id, frame.data());
+    }
+    StreamStats fast_stats = engine.get_stats(fast_id);
+    THROW_IF(fast_stats.frames < num_frames, "Frame count mismatch");
+    THROW_IF(fast_stats.deadline_misses != 0,
+             "Frames in time counted as deadline misses");
+    StreamStats slow_stats = engine.get_stats(slow_id);
+    THROW_IF(slow_stats.frames < num_frames, "Frame count mismatch");
+    THROW_IF(slow_stats.deadline_misses != slow_stats.frames,
+             "Late frames not counted as deadline misses");
+    engine.remove_stream(fast_id);
+    engine.remove_stream(slow_id);
+}
+
+// A generator that throws on its frame number fail_at
+class FailingGenerator: public ConstantGenerator {
+    size_t frames = 0;
+    size_t fail_at = 0;
+
+public:
+    FailingGenerator(size_t fail_at_):
+        ConstantGenerator(0.5f, 1000000),
+        fail_at(fail_at_) {
+    }
+
+    virtual bool next_frame(std::vector<float> &frame) {
+        if (frames++ == fail_at) {
+            throw std::runtime_error("render failed");
+        }
+        return ConstantGenerator::next_frame(frame);
+    }
+};
+
+void test_failed_stream() {
+    size_t frame_size = 64;
+    Sequencer failing(frame_size);
+    failing.add(new FailingGenerator(2));
+    Sequencer working(frame_size);
+    working.add(new ConstantGenerator(0.25f, 100 * frame_size));
+    RenderEngine engine(2);
+    size_t failing_id = engine.add_stream(&failing, 16000);
+    size_t working_id = engine.add_stream(&working, 16000);
+
+    // The frames before the failure are read, then the error
+    std::vector<float> frame(frame_size);
+    for (size_t count = 0; count < 2; count++) {
+        THROW_IF(!engine.read_frame(failing_id, frame.data()),
+                 "Frame before the failure lost");
+        THROW_IF(frame[0] != 0.5f, "Wrong frame before the failure");
+    }
+    for (bool wait: {true, false}) {
+        bool threw = false;
+        try {
+            engine.read_frame(failing_id, frame.data(), wait);
+        } catch (const std::runtime_error &error) {
+            threw = std::string(error.what()) == "render failed";
+        }
+        THROW_IF(!threw, "Render error not passed to the reader");
+    }
+    StreamStats stats = engine.get_stats(failing_id);
+    THROW_IF(!stats.failed || stats.error != "render failed",
+             "Failure not in the stats");
+    THROW_IF(stats.frames != 2, "Frames rendered after the failure");
+
+    // The other streams go on
+    for (size_t count = 0; count < 20; count++) {
+        engine.read_frame(working_id, frame.data());
+        THROW_IF(frame[0] != 0.25f, "Other stream stopped");
+    }
+    THROW_IF(engine.get_stats(working_id).failed, "Other stream failed");
+    engine.remove_stream(failing_id);
+    engine.remove_stream(working_id);
+}
+
+int main() {
+    using namespace tester;
+
+    TestCollection tests;
+    ADD_TEST(tests, test_parallel_render);
+    ADD_TEST(tests, test_post_from_other_thread);
+    ADD_TEST(tests, test_deadline_misses);
+    ADD_TEST(tests, test_failed_stream);
+    return run_tests(tests) ? 1 : 0;
+}
@@ -0,0 +1,287 @@
+#ifndef KOELSYNTH_RESAMPLER_H
+#define KOELSYNTH_RESAMPLER_H
+
+#include <cmath>
+#include <vector>
+#include <stdexcept>
+
+#include "frame_generator.h"
+
+#ifndef M_PI
+    #define M_PI 3.14159265358979323846
+#endif
+
+namespace signal {
+
+// Zeroth order modified Bessel function (for the Kaiser window)
+inline double bessel_i0(double x) {
+    double sum = 1.0;
+    double term = 1.0;
+    for (int k = 1; k < 50; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+        if (term < 1e-12 * sum) {
+            break;
+        }
+    }
+    return sum;
+}
+
+
+// Interpolates a signal by an integer factor using a polyphase FIR filter.
+// Every input sample produces factor output samples. The prototype is a
+// Kaiser windowed sinc with cutoff at the input Nyquist frequency.
+class PolyphaseInterpolator {
+    // Interpolation factor
+    size_t factor = 1;
+    // Number of taps of every polyphase branch
+    size_t taps = 0;
+    // Coefficients, stored branch by branch with taps reversed
+    std::vector<float> coeffs;
+    // Last taps inputs, stored twice so that a window is always contiguous
+    std::vector<float> history;
+    // Write position in history
+    size_t pos = 0;
+
+    friend class Signal_Tester;
+
+public:
+    // factor_ : interpolation factor
+    // taps_   : taps per polyphase branch (filter length is factor * taps)
+    PolyphaseInterpolator(size_t factor_, size_t taps_ = 12):
+        factor(factor_),
+        taps(taps_) {
+        if (factor == 0 || taps == 0) {
+            throw std::invalid_argument("factor and taps must be positive");
+        }
+
+        // Odd length prototype, so that the delay is a whole sample.
+        // The last slot of the last branch stays 0.
+        size_t length = factor * taps - 1;
+        double center = (length - 1) / 2.0;
+        double cutoff = 0.5 / factor;
+        // About 60 dB of image rejection
+        double beta = 5.65;
+        double norm = bessel_i0(beta);
+
+        coeffs.assign(factor * taps, 0.0f);
+        for (size_t n = 0; n < length; n++) {
+            double t = n - center;
+            double sinc = 1.0;
+            if (t != 0.0) {
+                sinc = sin(2 * M_PI * cutoff * t) / (2 * M_PI * cutoff * t);
+            }
+            double r = t / (center + 1.0);
+            double window = bessel_i0(beta * sqrt(1.0 - r * r)) / norm;
+            // Gain of factor makes up for the inserted zeros
+            double h = factor * 2 * cutoff * sinc * window;
+            // Output phase p uses h[p + j * factor] with input x[n - j]
+            size_t phase = n % factor;
+            size_t tap = n / factor;
+            coeffs[phase * taps + (taps - 1 - tap)] = static_cast<float>(h);
+        }
+
+        history.assign(2 * taps, 0.0f);
+    }
+
+    size_t get_factor() {
+        return factor;
+    }
+
+    // Delay introduced by the filter, in output samples
+    size_t get_delay() {
+        return (factor * taps - 2) / 2;
+    }
+
+    // Push one input sample and write factor output samples to out
+    void push(float x, float *out) {
+        history[pos] = x;
+        history[pos + taps] = x;
+        pos++;
+        if (pos == taps) {
+            pos = 0;
+        }
+        // Oldest to newest input
+        const float *window = history.data() + pos;
+        for (size_t phase = 0; phase < factor; phase++) {
+            const float *h = coeffs.data() + phase * taps;
+            float acc = 0;
+            for (size_t ii = 0; ii < taps; ii++) {
+                acc += h[ii] * window[ii];
+            }
+            out[phase] = acc;
+        }
+    }
+};
+
+
+// Pick the largest rate divider (1, 2 or 4) that keeps a signal with the
+// given bandwidth (highest significant frequency, in radians per sample)
+// inside the pass band of the interpolator.
+inline size_t choose_rate_divider(float bandwidth) {
+    // Interpolator pass band edge, as a fraction of the reduced Nyquist
+    const float pass_band = 0.7f;
+    for (size_t divider = 4; divider > 1; divider /= 2) {
+        if (bandwidth * divider < pass_band * M_PI) {
+            return divider;
+        }
+    }
+    return 1;
+}
+
+
+// Runs a generator at a reduced sample rate and interpolates its output
+// back to the full rate. The output is aligned with (and has the same size
+// as) the output the generator would give at the full rate.
+class MultirateGenerator: public FrameGenerator {
+    // Generator running at the reduced rate (owned)
+    FrameGenerator *inner = nullptr;
+    PolyphaseInterpolator interpolator;
+    // Size of the output at the full rate
+    size_t size = 0;
+    // Samples produced so far
+    size_t progress = 0;
+    // Frame size at the full rate
+    size_t frame_size = DEFAULT_FRAME_SIZE;
+    // Outputs still to be dropped to make up for the filter delay
+    size_t skip = 0;
+    // Reduced rate frame
+    std::vector<float> low;
+    // Interpolated samples not yet returned
+    std::vector<float> pending;
+    size_t pending_pos = 0;
+
+    // Interpolate the next frame of the inner generator. Once it has ended,
+    // zeros are fed to flush the filter.
+    void refill() {
+        if (!inner->has_ended()) {
+            inner->next_frame(low);
+        } else {
+            low.assign((frame_size + interpolator.get_factor() - 1)
+                       / interpolator.get_factor(), 0.0f);
+        }
+        size_t factor = interpolator.get_factor();
+        pending.resize(low.size() * factor);
+        for (size_t ii = 0; ii < low.size(); ii++) {
+            interpolator.push(low[ii], &pending[ii * factor]);
+        }
+        pending_pos = skip < pending.size() ? skip : pending.size();
+        skip -= pending_pos;
+    }
+
+public:
+    // inner_     : generator already set to run at 1/factor of the rate
+    // factor     : rate divider
+    // full_size  : size of the output at the full rate
+    MultirateGenerator(FrameGenerator *inner_, size_t factor,
+                       size_t full_size):
+        inner(inner_),
+        interpolator(factor),
+        size(full_size) {
+        // Inner sample k stands for output sample k * factor + factor - 1,
+        // but lands at k * factor after interpolation
+        skip = interpolator.get_delay() - (factor - 1);
+        set_frame_size(frame_size);
+    }
+
+    // Copies the state, with a copy of the inner generator
+    MultirateGenerator(const MultirateGenerator &other):
+        inner(other.inner->clone()),
+        interpolator(other.interpolator),
+        size(other.size),
+        progress(other.progress),
+        frame_size(other.frame_size),
+        skip(other.skip),
+        low(other.low),
+        pending(other.pending),
+        pending_pos(other.pending_pos) {
+    }
+
+    MultirateGenerator& operator=(const MultirateGenerator&) = delete;
+
+    virtual void set_frame_size(size_t num_samples) {
+        frame_size = num_samples;
+        size_t factor = interpolator.get_factor();
+        inner->set_frame_size((num_samples + factor - 1) / factor);
+    }
+
+    virtual void set_control_rate(size_t num_samples) {
+        size_t reduced = num_samples / interpolator.get_factor();
+        inner->set_control_rate(reduced > 0 ? reduced : 1);
+    }
+
+    virtual void set_quality(int level) {
+        inner->set_quality(level);
+    }
+
+    virtual const char* get_name() {
+        return inner->get_name();
+    }
+
+    virtual size_t get_num_harmonics() {
+        return inner->get_num_harmonics();
+    }
+
+    virtual bool has_ended() {
+        return progress >= size;
+    }
+
+    virtual size_t get_size() {
+        return size;
+    }
+
+    virtual FrameGenerator* clone() {
+        return new MultirateGenerator(*this);
+    }
+
+    virtual bool next_frame(std::vector<float> &frame) {
+        size_t result_size = frame_size;
+        if (size - progress < result_size) {
+            result_size = size - progress;
+        }
+
+        frame.resize(result_size);
+        size_t filled = 0;
+        while (filled < result_size) {
+            if (pending_pos == pending.size()) {
+                refill();
+                continue;
+            }
+            size_t chunk = pending.size() - pending_pos;
+            if (result_size - filled < chunk) {
+                chunk = result_size - filled;
+            }
+            for (size_t ii = 0; ii < chunk; ii++) {
+                frame[filled + ii] = pending[pending_pos + ii];
+            }
+            pending_pos += chunk;
+            filled += chunk;
+        }
+
+        progress += result_size;
+        return progress >= size;
+    }
+
+    virtual ~MultirateGenerator() {
+        delete inner;
+    }
+};
+
+
+// Wrap gen in a MultirateGenerator if its bandwidth allows a reduced rate
+// and it supports running at one. Returns the generator to use.
+inline FrameGenerator* make_multirate(FrameGenerator *gen) {
+    size_t divider = choose_rate_divider(gen->get_bandwidth());
+    if (divider == 1) {
+        return gen;
+    }
+    size_t full_size = gen->get_size();
+    if (!gen->set_rate_divider(divider)) {
+        return gen;
+    }
+    return new MultirateGenerator(gen, divider, full_size);
+}
+
+}
+
+#endif
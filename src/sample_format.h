@@ -0,0 +1,129 @@
+#ifndef KOELSYNTH_SAMPLE_FORMAT_H
+#define KOELSYNTH_SAMPLE_FORMAT_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+
+// Output sample formats. Integer formats are little endian.
+enum class SampleFormat {
+    float32,
+    int16,
+    int24,
+};
+
+inline SampleFormat parse_sample_format(const std::string &name) {
+    if (name == "float32") {
+        return SampleFormat::float32;
+    }
+    if (name == "int16") {
+        return SampleFormat::int16;
+    }
+    if (name == "int24") {
+        return SampleFormat::int24;
+    }
+    throw std::invalid_argument("unknown sample format: " + name);
+}
+
+inline size_t bytes_per_sample(SampleFormat format) {
+    switch (format) {
+    case SampleFormat::int16:
+        return 2;
+    case SampleFormat::int24:
+        return 3;
+    default:
+        return 4;
+    }
+}
+
+
+// Triangular (TPDF) dither with an amplitude of +/- 1 LSB.
+// Uses a small xorshift generator, so it is cheap and deterministic.
+class TpdfDither {
+    uint32_t state = 0x12345678u;
+
+    float uniform() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        // Top 24 bits to [0, 1)
+        return static_cast<float>(state >> 8) * (1.0f / 16777216.0f);
+    }
+
+public:
+    TpdfDither() = default;
+
+    TpdfDither(uint32_t seed): state(seed ? seed : 0x12345678u) {
+    }
+
+    // Next dither value in LSB units, in the range (-1, 1)
+    float next() {
+        return uniform() - uniform();
+    }
+};
+
+
+// Convert a single sample to an integer of the given full scale value.
+// The sample is clipped to [-1, 1] before dither is added and the result is
+// clipped again to the integer range.
+inline int32_t quantize_sample(float x, float full_scale, float dither) {
+    if (x > 1.0f) {
+        x = 1.0f;
+    } else if (x < -1.0f) {
+        x = -1.0f;
+    }
+    int32_t value = static_cast<int32_t>(lrintf(x * full_scale + dither));
+    int32_t max_value = static_cast<int32_t>(full_scale);
+    if (value > max_value) {
+        value = max_value;
+    } else if (value < -max_value - 1) {
+        value = -max_value - 1;
+    }
+    return value;
+}
+
+
+// Scale count samples by gain and write them to out in the given format.
+// Every input sample is repeated for each of the num_channels interleaved
+// output channels. Gain, clipping, dither and packing are done in a single
+// pass. Pass nullptr as dither to disable it.
+inline void write_samples(
+    const float *samples, size_t count, float gain,
+    SampleFormat format, size_t num_channels,
+    uint8_t *out, TpdfDither *dither
+) {
+    if (format == SampleFormat::float32) {
+        for (size_t ii = 0; ii < count; ii++) {
+            float value = samples[ii] * gain;
+            for (size_t ch = 0; ch < num_channels; ch++) {
+                // The hosts we build for are little endian
+                std::memcpy(out, &value, 4);
+                out += 4;
+            }
+        }
+        return;
+    }
+
+    bool is_int16 = format == SampleFormat::int16;
+    float full_scale = is_int16 ? 32767.0f : 8388607.0f;
+    for (size_t ii = 0; ii < count; ii++) {
+        float x = samples[ii] * gain;
+        for (size_t ch = 0; ch < num_channels; ch++) {
+            float noise = dither ? dither->next() : 0.0f;
+            uint32_t value = static_cast<uint32_t>(
+                quantize_sample(x, full_scale, noise));
+            out[0] = static_cast<uint8_t>(value & 0xff);
+            out[1] = static_cast<uint8_t>((value >> 8) & 0xff);
+            if (is_int16) {
+                out += 2;
+            } else {
+                out[2] = static_cast<uint8_t>((value >> 16) & 0xff);
+                out += 3;
+            }
+        }
+    }
+}
+
+#endif
@@ -1,12 +1,23 @@
 #ifndef KOELSYNTH_SEQUENCER_H
 #define KOELSYNTH_SEQUENCER_H
 
+#include <cmath>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <atomic>
 #include <vector>
 #include <stdexcept>
 
 #include "frame_generator.h"
+#include "resampler.h"
+#include "effects.h"
+#include "quality_governor.h"
+#include "rcu.h"
+#include "sample_format.h"
+#include "trace.h"
 
-void accumulate(
+inline void accumulate(
     std::vector<float> &acc,
     std::vector<float> &frame
 ) {
@@ -19,82 +30,652 @@ void accumulate(
     }
 }
 
-void scale_vector(std::vector<float> &vec, float scale) {
+// Gains of a voice for num_channels output channels, which are taken to be
+// evenly spaced from pan -1 (first channel) to pan 1 (last channel).
+// The voice is placed at pan and spread over the neighbouring channels by
+// spread (0 for the nearest channels only, 1 for all of them). Both are
+// clamped to their range. The gains have unit power, so the loudness does
+// not depend on the placement. A single channel always gets gain 1.
+inline void compute_pan_gains(size_t num_channels, float pan, float spread,
+                              float *gains) {
+    if (num_channels == 1) {
+        gains[0] = 1.0f;
+        return;
+    }
+    pan = std::min(std::max(pan, -1.0f), 1.0f);
+    spread = std::min(std::max(spread, 0.0f), 1.0f);
+    float spacing = 2.0f / (num_channels - 1);
+    // Distance at which a channel gets nothing
+    float width = spacing * (1 + spread * (num_channels - 1));
+    float power = 0;
+    for (size_t ch = 0; ch < num_channels; ch++) {
+        float position = -1.0f + spacing * ch;
+        float weight = 1.0f - std::abs(pan - position) / width;
+        gains[ch] = weight > 0 ? weight : 0.0f;
+        power += gains[ch] * gains[ch];
+    }
+    float scale = 1.0f / sqrtf(power);
+    for (size_t ch = 0; ch < num_channels; ch++) {
+        gains[ch] *= scale;
+    }
+}
+
+// Trace arguments identifying a generator
+inline trace::TraceArgs voice_trace_args(FrameGenerator *gen) {
+    trace::TraceArgs args;
+    args.instrument = gen->get_name();
+    args.voice = static_cast<int64_t>(reinterpret_cast<uintptr_t>(gen));
+    args.harmonics = static_cast<int64_t>(gen->get_num_harmonics());
+    return args;
+}
+
+inline void scale_vector(std::vector<float> &vec, float scale) {
     for (auto &x: vec) {
         x *= scale;
     }
 }
 
+// Receives the events given to a Sequencer (like for recording them).
+// Called from the thread that adds the event, or from the rendering thread
+// for posted events. block is the index of the first internal block that
+// includes the event. The methods must not call back into the Sequencer
+// (they run under its lock, see Sequencer::set_listener).
+class SequencerListener {
+public:
+    virtual void on_add(size_t block, FrameGenerator *gen,
+                        float pan, float spread) = 0;
+    virtual void on_control_rate(size_t block, size_t num_samples) = 0;
+    virtual void on_multirate(size_t block, bool enable) = 0;
+    // effect is owned by the Sequencer, and already added
+    virtual void on_add_effect(size_t block, signal::Effect *effect) = 0;
+    virtual void on_clear_effects(size_t block) = 0;
+    virtual void on_quality(size_t block, int level) = 0;
+    // seconds is 0 when the frame budget is turned off
+    virtual void on_frame_budget(size_t block, double seconds,
+                                 const QualityGovernorParams &params) = 0;
+    virtual ~SequencerListener() {}
+};
+
+// A generator in a Sequencer, with its placement in the output channels
+struct SequencerVoice {
+    // Owned by the Sequencer
+    FrameGenerator *gen = nullptr;
+    float pan = 0.0f;
+    float spread = 0.0f;
+    // Gain for every output channel (from pan and spread)
+    std::vector<float> channel_gains;
+};
+
 class Sequencer {
-    // Sequence of active generators
-    std::vector<FrameGenerator*> generators;
+    // Active generators
+    std::vector<SequencerVoice> voices;
     // Frame size of processing
     size_t frame_size = DEFAULT_FRAME_SIZE;
     // Apply gain for every sample
     float gain = 1.0f;
+    // Number of output channels
+    size_t num_channels = 1;
+    // Samples per control signal update for the generators
+    size_t control_rate = 1;
+    // Whether narrow band generators run at a reduced sample rate
+    bool multirate = false;
+    // Quality level of the generators (see QualityLevel)
+    int quality = QUALITY_FULL;
+    // Frame buffer reused for every generator
+    std::vector<float> scratch;
+    // Mix of the current internal block (before gain), channel by channel
+    // (frame_size samples each)
+    std::vector<float> mix;
+    // Read position in mix. A new block is mixed when it reaches frame_size.
+    size_t mix_pos = 0;
+    // Gain to apply when reading mix (1 when the effects applied it)
+    float mix_gain = 1.0f;
+    // Effects applied to every block after the gain
+    signal::EffectsChain effects;
+    // Dither source for integer output formats
+    TpdfDither dither;
+    // Interleaved samples for converting a multichannel mix
+    std::vector<float> interleaved;
+    // Generators posted from other threads, added at the next block
+    std::vector<SequencerVoice> inbox;
+    // Protects inbox and listener
+    std::mutex inbox_mutex;
+    std::atomic<bool> has_inbox {false};
+    // Internal blocks mixed so far (read by listeners attaching from other
+    // threads)
+    std::atomic<size_t> block_count {0};
+    // Notified of every event (not owned)
+    SequencerListener *listener = nullptr;
+    // Sets the quality from the render time of every block (if any)
+    std::unique_ptr<QualityGovernor> governor;
+    // Record in the global RcuDomain. Every block is a read section, so
+    // voices can read shared parameters (see instrument.h).
+    RcuReader rcu_reader;
 
     // Remove all the generators that has ended (also delete them).
     // Update the current generators with active ones.
     void remove_ended() {
-        std::vector<FrameGenerator*> result;
-        for (auto gen: generators) {
-            if (gen->has_ended()) {
-                delete gen;
+        std::vector<SequencerVoice> result;
+        for (auto &voice: voices) {
+            if (voice.gen->has_ended()) {
+                TRACE_INSTANT("voice", "voice_end",
+                              voice_trace_args(voice.gen));
+                delete voice.gen;
             } else {
-                result.push_back(gen);
+                result.push_back(std::move(voice));
+            }
+        }
+        voices.swap(result);
+    }
+
+    void release_generators() {
+        for (auto &voice: voices) {
+            delete voice.gen;
+        }
+        for (auto &voice: inbox) {
+            delete voice.gen;
+        }
+        voices.clear();
+        inbox.clear();
+    }
+
+    // Call notify_listener(listener) if there is a listener. The lock is
+    // held for the call, so that set_listener from another thread waits
+    // for it to finish.
+    template<typename Notify>
+    void notify(Notify notify_listener) {
+        std::lock_guard<std::mutex> lock(inbox_mutex);
+        if (listener != nullptr) {
+            notify_listener(listener);
+        }
+    }
+
+    // Move the posted generators to the active ones
+    void drain_inbox() {
+        std::vector<SequencerVoice> posted;
+        {
+            std::lock_guard<std::mutex> lock(inbox_mutex);
+            posted.swap(inbox);
+            has_inbox = false;
+        }
+        for (auto &voice: posted) {
+            add(voice.gen, voice.pan, voice.spread);
+        }
+    }
+
+    // Add the frame of a voice to every channel of output, with the gain of
+    // the channel
+    void accumulate_voice(std::vector<float> &output,
+                          const std::vector<float> &frame,
+                          const SequencerVoice &voice) {
+        if (frame.size() > frame_size) {
+            throw std::invalid_argument("frame size cannot exceed acc size");
+        }
+        size_t count = frame.size();
+        const float *src = frame.data();
+        for (size_t ch = 0; ch < num_channels; ch++) {
+            float channel_gain = voice.channel_gains[ch];
+            float *dst = output.data() + ch * frame_size;
+            for (size_t ii = 0; ii < count; ii++) {
+                dst[ii] += src[ii] * channel_gain;
             }
         }
-        generators = result;
+    }
+
+    // Control rate of the generators at the current quality
+    size_t voice_control_rate() {
+        if (quality >= QUALITY_COARSE_CONTROL) {
+            return std::max<size_t>(4 * control_rate, 32);
+        }
+        return control_rate;
+    }
+
+    void apply_quality(int level) {
+        if (level == quality) {
+            return;
+        }
+        quality = level;
+        for (auto &voice: voices) {
+            voice.gen->set_quality(quality);
+            voice.gen->set_control_rate(voice_control_rate());
+        }
+    }
+
+    // Sum the next frame of all active generators into output (no gain)
+    void mix_generators(std::vector<float> &output) {
+        TRACE_SCOPE_ARGS("sequencer", "frame",
+                         trace::count_args(voices.size()));
+        std::chrono::steady_clock::time_point start;
+        if (governor) {
+            start = std::chrono::steady_clock::now();
+        }
+        RcuReadSection read_section(RcuDomain::global(), rcu_reader);
+        if (has_inbox) {
+            drain_inbox();
+        }
+        output.assign(frame_size * num_channels, 0);
+        std::vector<float> &frame = scratch;
+        bool clean_generators = false;
+        for (auto &voice: voices) {
+            if (voice.gen->has_ended()) {
+                clean_generators = true;
+                continue;
+            }
+            {
+                TRACE_SCOPE_ARGS("voice", "voice", voice_trace_args(voice.gen));
+                voice.gen->next_frame(frame);
+            }
+            accumulate_voice(output, frame, voice);
+        }
+        if (clean_generators) {
+            remove_ended();
+        }
+        if (effects.empty()) {
+            mix_gain = gain;
+        } else {
+            TRACE_SCOPE("sequencer", "effects");
+            scale_vector(output, gain);
+            effects.process(output.data());
+            mix_gain = 1.0f;
+        }
+        block_count++;
+        if (governor) {
+            std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start;
+            apply_quality(governor->update(elapsed.count()));
+        }
+    }
+
+    // Mix a new block if the current one is used up, and return the number
+    // of its samples (per channel) to use next, up to num_samples
+    size_t next_chunk(size_t num_samples) {
+        if (mix_pos == frame_size) {
+            mix_generators(mix);
+            mix_pos = 0;
+        }
+        size_t chunk = frame_size - mix_pos;
+        return num_samples < chunk ? num_samples : chunk;
     }
 
 public:
+    // num_channels_ : number of output channels. Voices are placed in them
+    //                 with their pan and spread.
     Sequencer(size_t frame_size_ = DEFAULT_FRAME_SIZE,
-              float gain_ = 1.0f) {
+              float gain_ = 1.0f, size_t num_channels_ = 1) {
+        if (frame_size_ == 0) {
+            throw std::invalid_argument("frame size must be positive");
+        }
+        if (num_channels_ == 0) {
+            throw std::invalid_argument("num_channels must be positive");
+        }
         frame_size = frame_size_;
         gain = gain_;
+        num_channels = num_channels_;
+        mix_pos = frame_size;
+        mix_gain = gain;
+        effects.prepare(num_channels, frame_size);
+        RcuDomain::global().add_reader(&rcu_reader);
+    }
+
+    // Copy the complete state of other: the active and posted generators
+    // (with their phases and envelope progress), the rest of the current
+    // block and the settings. The copy continues independently and gives
+    // the same output as other from here on. The listener is not copied.
+    // other must not be rendering at the same time.
+    Sequencer(Sequencer &other):
+        frame_size(other.frame_size),
+        gain(other.gain),
+        num_channels(other.num_channels),
+        control_rate(other.control_rate),
+        multirate(other.multirate),
+        quality(other.quality),
+        mix(other.mix),
+        mix_pos(other.mix_pos),
+        mix_gain(other.mix_gain),
+        effects(other.effects),
+        dither(other.dither),
+        block_count(other.block_count.load()) {
+        if (other.governor) {
+            governor.reset(new QualityGovernor(*other.governor));
+        }
+        RcuDomain::global().add_reader(&rcu_reader);
+        try {
+            for (auto &voice: other.voices) {
+                SequencerVoice copy = voice;
+                copy.gen = nullptr;
+                voices.push_back(copy);
+                voices.back().gen = voice.gen->clone();
+            }
+            std::lock_guard<std::mutex> lock(other.inbox_mutex);
+            for (auto &voice: other.inbox) {
+                SequencerVoice copy = voice;
+                copy.gen = nullptr;
+                inbox.push_back(copy);
+                inbox.back().gen = voice.gen->clone();
+            }
+            has_inbox = !inbox.empty();
+        } catch (...) {
+            RcuDomain::global().remove_reader(&rcu_reader);
+            release_generators();
+            throw;
+        }
+    }
+
+    Sequencer& operator=(const Sequencer&) = delete;
+
+    // A snapshot of this sequencer (see the copy constructor), to resume
+    // from later or to render in parallel. Owned by the caller.
+    Sequencer* clone() {
+        return new Sequencer(*this);
     }
 
-    void add(FrameGenerator *gen) {
+    // Add a generator (owned by the sequencer once add returns), placed at
+    // pan with spread in the output channels (see compute_pan_gains). If
+    // add throws, gen is still owned by the caller.
+    void add(FrameGenerator *gen, float pan = 0.0f, float spread = 0.0f) {
+        notify([&](SequencerListener *target) {
+            target->on_add(block_count, gen, pan, spread);
+        });
+        // Allocate first, so that nothing throws once gen is wrapped
+        SequencerVoice voice;
+        voice.pan = pan;
+        voice.spread = spread;
+        voice.channel_gains.resize(num_channels);
+        compute_pan_gains(num_channels, pan, spread,
+                          voice.channel_gains.data());
+        if (voices.size() == voices.capacity()) {
+            voices.reserve(2 * voices.size() + 1);
+        }
+        if (multirate) {
+            gen = signal::make_multirate(gen);
+        }
         gen->set_frame_size(frame_size);
-        generators.push_back(gen);
+        gen->set_control_rate(voice_control_rate());
+        gen->set_quality(quality);
+        voice.gen = gen;
+        voices.push_back(std::move(voice));
+        TRACE_INSTANT("voice", "voice_start", voice_trace_args(gen));
+    }
+
+    // Same as add, but safe to call from any thread while another thread
+    // renders. The generator is added at the start of the next block.
+    void post(FrameGenerator *gen, float pan = 0.0f, float spread = 0.0f) {
+        SequencerVoice voice;
+        voice.gen = gen;
+        voice.pan = pan;
+        voice.spread = spread;
+        std::lock_guard<std::mutex> lock(inbox_mutex);
+        inbox.push_back(voice);
+        has_inbox = true;
+    }
+
+    // Append an effect (owned by the sequencer from here on) to the chain
+    // applied to the output, after the gain. Like add, not to be called
+    // while another thread renders.
+    void add_effect(signal::Effect *effect) {
+        effects.add(effect);
+        notify([&](SequencerListener *target) {
+            target->on_add_effect(block_count, effect);
+        });
+    }
+
+    // Remove all the effects
+    void clear_effects() {
+        effects.clear();
+        notify([&](SequencerListener *target) {
+            target->on_clear_effects(block_count);
+        });
+    }
+
+    size_t get_effect_count() {
+        return effects.size();
+    }
+
+    // Effect at position index of the chain (owned by the sequencer)
+    signal::Effect* get_effect(size_t index) {
+        return effects.get(index);
+    }
+
+    // Evaluate slowly varying control signals (like envelopes) once every
+    // num_samples samples and interpolate in between. 1 means every sample.
+    // Applies to the active generators and to the ones added later.
+    void set_control_rate(size_t num_samples) {
+        if (num_samples == 0) {
+            throw std::invalid_argument("control rate must be positive");
+        }
+        control_rate = num_samples;
+        notify([&](SequencerListener *target) {
+            target->on_control_rate(block_count, num_samples);
+        });
+        for (auto &voice: voices) {
+            voice.gen->set_control_rate(voice_control_rate());
+        }
+    }
+
+    size_t get_control_rate() {
+        return control_rate;
+    }
+
+    // When enabled, generators added later whose output is narrow band (like
+    // low pitched notes) are rendered at 1/2 or 1/4 of the sample rate and
+    // interpolated back to the full rate.
+    void set_multirate(bool enable) {
+        multirate = enable;
+        notify([&](SequencerListener *target) {
+            target->on_multirate(block_count, enable);
+        });
+    }
+
+    bool get_multirate() {
+        return multirate;
+    }
+
+    // Render the generators at the given quality level (see QualityLevel).
+    // From QUALITY_COARSE_CONTROL, the control rate is 4 times higher (at
+    // least 32). With a frame budget, the governor overrides this from the
+    // next block on.
+    void set_quality(int level) {
+        if (level < QUALITY_FULL || level > QUALITY_COARSE_CONTROL) {
+            throw std::invalid_argument("invalid quality level");
+        }
+        apply_quality(level);
+        notify([&](SequencerListener *target) {
+            target->on_quality(block_count, level);
+        });
+    }
+
+    int get_quality() {
+        return quality;
+    }
+
+    // Adapt the quality to the time available for rendering a block
+    // (frame_size / sample_rate for real time), so that heavy polyphony
+    // loses some accuracy instead of missing the deadline (see
+    // QualityGovernor). 0 turns it off and restores the full quality.
+    void set_frame_budget(double seconds,
+                          QualityGovernorParams params =
+                              QualityGovernorParams()) {
+        if (seconds <= 0) {
+            governor.reset();
+            apply_quality(QUALITY_FULL);
+            seconds = 0;
+        } else {
+            governor.reset(new QualityGovernor(seconds, params));
+        }
+        notify([&](SequencerListener *target) {
+            target->on_frame_budget(block_count, seconds, params);
+        });
+    }
+
+    // Frame budget of the quality governor (0 without one)
+    double get_frame_budget() {
+        return governor ? governor->get_frame_budget() : 0.0;
+    }
+
+    QualityGovernorParams get_governor_params() {
+        return governor ? governor->get_params() : QualityGovernorParams();
+    }
+
+    // Smoothed render time per block over the frame budget (0 without one)
+    double get_load() {
+        return governor ? governor->get_load() : 0.0;
     }
 
     size_t get_frame_size() {
         return frame_size;
     }
 
+    float get_gain() {
+        return gain;
+    }
+
+    size_t get_num_channels() {
+        return num_channels;
+    }
+
+    // Number of internal blocks mixed so far
+    size_t get_block_count() {
+        return block_count;
+    }
+
+    // Notify listener (not owned, nullptr for none) of every event.
+    // Safe to call from any thread while another thread renders. Once it
+    // returns, the previous listener is not called any more (a call in
+    // progress has finished), so it can be destroyed.
+    void set_listener(SequencerListener *listener_) {
+        std::lock_guard<std::mutex> lock(inbox_mutex);
+        listener = listener_;
+    }
+
     size_t get_generator_count() {
-        return generators.size();
+        return voices.size();
     }
 
-    std::vector<float> next_frame() {
-        std::vector<float> output(frame_size, 0);
-        std::vector<float> frame;
-        bool clean_generators = false;
-        for (auto gen: generators) {
-            if (gen->has_ended()) {
-                clean_generators = true;
-                continue;
+    // No generators are left and the effects have no tail left (like the
+    // echoes of a delay), so the rest of the output is silent. Renders that
+    // should end with the music stop here rather than at the last
+    // generator.
+    bool is_done() {
+        return voices.empty() && effects.is_silent();
+    }
+
+    // Number of samples (per channel) of the current internal block not yet
+    // returned
+    size_t get_buffered_size() {
+        return frame_size - mix_pos;
+    }
+
+    // Render the next num_samples samples (with gain) of every channel to
+    // out, interleaved (num_samples * num_channels values).
+    // Any count is allowed. Generators are still processed in blocks of
+    // frame_size, and the unused part of a block is carried over to the
+    // next call. Events added in between take effect from the next block.
+    void render(float *out, size_t num_samples) {
+        while (num_samples > 0) {
+            size_t chunk = next_chunk(num_samples);
+            TRACE_SCOPE("sequencer", "mix");
+            if (num_channels == 1) {
+                const float *src = mix.data() + mix_pos;
+                for (size_t ii = 0; ii < chunk; ii++) {
+                    out[ii] = src[ii] * mix_gain;
+                }
+            } else {
+                for (size_t ch = 0; ch < num_channels; ch++) {
+                    const float *src = mix.data() + ch * frame_size + mix_pos;
+                    float *dst = out + ch;
+                    for (size_t ii = 0; ii < chunk; ii++) {
+                        dst[ii * num_channels] = src[ii] * mix_gain;
+                    }
+                }
             }
-            gen->next_frame(frame);
-            accumulate(output, frame);
+            out += chunk * num_channels;
+            mix_pos += chunk;
+            num_samples -= chunk;
         }
-        if (clean_generators) {
-            remove_ended();
+    }
+
+    // Same as render, but every channel goes to its own buffer:
+    // channels[ch] receives num_samples samples of channel ch.
+    void render_planar(float *const *channels, size_t num_samples) {
+        size_t done = 0;
+        while (done < num_samples) {
+            size_t chunk = next_chunk(num_samples - done);
+            TRACE_SCOPE("sequencer", "mix");
+            for (size_t ch = 0; ch < num_channels; ch++) {
+                const float *src = mix.data() + ch * frame_size + mix_pos;
+                float *dst = channels[ch] + done;
+                for (size_t ii = 0; ii < chunk; ii++) {
+                    dst[ii] = src[ii] * mix_gain;
+                }
+            }
+            mix_pos += chunk;
+            done += chunk;
         }
-        if (gain != 1.0f) {
-            // Apply amplitude adjustment (if needed)
-            for (auto &el: output) {
-                el *= gain;
+    }
+
+    // Same as render, but writes the samples in the given format,
+    // interleaved in num_channels channels. A single channel sequencer
+    // repeats every sample in all of them; otherwise num_channels must be
+    // the number of channels of the sequencer. out must hold
+    // num_samples * num_channels * bytes_per_sample(format) bytes.
+    // Gain, clipping and dither are applied while converting the mix.
+    void render_pcm(
+        uint8_t *out, size_t num_samples, SampleFormat format,
+        size_t num_channels_ = 1, bool use_dither = true
+    ) {
+        if (num_channels > 1 && num_channels_ != num_channels) {
+            throw std::invalid_argument("channel count of the sequencer "
+                                        "and the output differ");
+        }
+        size_t stride = num_channels_ * bytes_per_sample(format);
+        TpdfDither *dither_source = use_dither ? &dither : nullptr;
+        while (num_samples > 0) {
+            size_t chunk = next_chunk(num_samples);
+            TRACE_SCOPE("sequencer", "mix");
+            if (num_channels == 1) {
+                write_samples(mix.data() + mix_pos, chunk, mix_gain, format,
+                              num_channels_, out, dither_source);
+            } else {
+                interleaved.resize(chunk * num_channels);
+                for (size_t ch = 0; ch < num_channels; ch++) {
+                    const float *src = mix.data() + ch * frame_size + mix_pos;
+                    for (size_t ii = 0; ii < chunk; ii++) {
+                        interleaved[ii * num_channels + ch] = src[ii];
+                    }
+                }
+                write_samples(interleaved.data(), interleaved.size(), mix_gain,
+                              format, 1, out, dither_source);
             }
+            out += chunk * stride;
+            mix_pos += chunk;
+            num_samples -= chunk;
         }
+    }
+
+    std::vector<float> next_frame() {
+        std::vector<float> output;
+        next_frame(output);
         return output;
     }
 
+    // Fill the next frame_size samples of every channel (interleaved) into
+    // output. Avoids allocating a new vector for every frame.
+    void next_frame(std::vector<float> &output) {
+        output.resize(frame_size * num_channels);
+        render(output.data(), frame_size);
+    }
+
+    // Fill the next frame_size samples into out in the given format
+    void next_frame_pcm(
+        uint8_t *out, SampleFormat format,
+        size_t num_channels_ = 1, bool use_dither = true
+    ) {
+        render_pcm(out, frame_size, format, num_channels_, use_dither);
+    }
+
     ~Sequencer() {
-        for (auto gen: generators) {
-            delete gen;
-        }
+        RcuDomain::global().remove_reader(&rcu_reader);
+        release_generators();
     }
 };
 
@@ -0,0 +1,548 @@
+#ifndef KOELSYNTH_SIGNAL_EXPRESSIONS_H
+#define KOELSYNTH_SIGNAL_EXPRESSIONS_H
+
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+
+#include "frame_generator.h"
+#include "signal_generators.h"
+
+// Expression templates over the simple signals in signal_generators.h.
+//
+// Signals like ramp(0, 1, n) * exponential(1, 400, n) are composed at
+// compile time into a single expression object. Filling a frame from it is
+// one loop that evaluates the whole expression per sample, without a frame
+// buffer for every building block.
+//
+// Every expression provides:
+//   get_size()      : number of samples in the signal
+//   begin_block(n)  : prepare to evaluate the next n samples
+//   eval(i)         : value of sample i of the current block (no side effect)
+//   advance(n)      : move past the n samples of the current block
+// eval() depends only on the index, which keeps the loop vectorizable.
+
+namespace signal {
+
+// Size of signals that never end
+const size_t UNBOUNDED_SIZE = SIZE_MAX;
+
+// Base of all expressions (CRTP). Only used to select the operators below.
+template<typename E>
+struct SignalExpr {
+    E& self() {
+        return static_cast<E&>(*this);
+    }
+
+    const E& self() const {
+        return static_cast<const E&>(*this);
+    }
+};
+
+
+// Expression version of ConstantGenerator
+class ConstantExpr: public SignalExpr<ConstantExpr> {
+    float value = 0;
+    size_t size = 0;
+
+public:
+    ConstantExpr(float value_, size_t size_ = UNBOUNDED_SIZE):
+        value(value_),
+        size(size_) {
+    }
+
+    size_t get_size() const {
+        return size;
+    }
+
+    void begin_block(size_t) {
+    }
+
+    float eval(size_t) const {
+        return value;
+    }
+
+    void advance(size_t) {
+    }
+};
+
+
+// Expression version of RampGenerator (same values)
+class RampExpr: public SignalExpr<RampExpr> {
+    float start = 0;
+    float end = 0;
+    size_t size = 0;
+    // Position of the first sample of the current block
+    size_t progress = 0;
+    // progress as a float (exact up to 2^24 samples)
+    float block_start = 0;
+
+public:
+    RampExpr(float start_, float end_, size_t size_):
+        start(start_),
+        end(end_),
+        size(size_) {
+    }
+
+    size_t get_size() const {
+        return size;
+    }
+
+    void begin_block(size_t) {
+        block_start = cf32(progress);
+    }
+
+    float eval(size_t index) const {
+        float span = (size - 1);
+        // 32 bit index converts to float in vector registers
+        float pos = block_start + cf32(static_cast<int32_t>(index));
+        float alpha = (span - pos) / span;
+        float beta = pos / span;
+        return alpha * start + beta * end;
+    }
+
+    void advance(size_t num_samples) {
+        progress += num_samples;
+    }
+};
+
+
+// Expression version of ExponentialGenerator.
+// Sample i of a block is the value at the block start times decay^i. The
+// powers are kept in a table, so samples do not depend on each other.
+class ExponentialExpr: public SignalExpr<ExponentialExpr> {
+    // Value at the start of the current block
+    float current = 0;
+    // Decay for every step
+    float decay = 0;
+    size_t size = 0;
+    // decay^i for the samples of a block
+    std::vector<float> powers;
+
+public:
+    // start_ : starting value of the signal
+    // halfing_size : number of samples to for a decay of 1/2
+    ExponentialExpr(float start_, float halfing_size, size_t size_):
+        current(start_),
+        decay(halfing_size_to_decay(halfing_size)),
+        size(size_) {
+    }
+
+    size_t get_size() const {
+        return size;
+    }
+
+    void begin_block(size_t num_samples) {
+        if (powers.size() >= num_samples + 1) {
+            return;
+        }
+        size_t old_size = powers.size();
+        powers.resize(num_samples + 1);
+        float value = old_size == 0 ? 1.0f : powers[old_size - 1] * decay;
+        for (size_t ii = old_size; ii < powers.size(); ii++) {
+            powers[ii] = value;
+            value *= decay;
+        }
+    }
+
+    float eval(size_t index) const {
+        return current * powers[index];
+    }
+
+    void advance(size_t num_samples) {
+        current *= powers[num_samples];
+    }
+};
+
+
+// Element-wise sum of two expressions
+template<typename A, typename B>
+class SumExpr: public SignalExpr<SumExpr<A, B>> {
+    A a;
+    B b;
+
+public:
+    SumExpr(const A &a_, const B &b_): a(a_), b(b_) {
+    }
+
+    size_t get_size() const {
+        return std::min(a.get_size(), b.get_size());
+    }
+
+    void begin_block(size_t num_samples) {
+        a.begin_block(num_samples);
+        b.begin_block(num_samples);
+    }
+
+    float eval(size_t index) const {
+        return a.eval(index) + b.eval(index);
+    }
+
+    void advance(size_t num_samples) {
+        a.advance(num_samples);
+        b.advance(num_samples);
+    }
+};
+
+
+// Element-wise product of two expressions
+template<typename A, typename B>
+class ProductExpr: public SignalExpr<ProductExpr<A, B>> {
+    A a;
+    B b;
+
+public:
+    ProductExpr(const A &a_, const B &b_): a(a_), b(b_) {
+    }
+
+    size_t get_size() const {
+        return std::min(a.get_size(), b.get_size());
+    }
+
+    void begin_block(size_t num_samples) {
+        a.begin_block(num_samples);
+        b.begin_block(num_samples);
+    }
+
+    float eval(size_t index) const {
+        return a.eval(index) * b.eval(index);
+    }
+
+    void advance(size_t num_samples) {
+        a.advance(num_samples);
+        b.advance(num_samples);
+    }
+};
+
+
+// An expression limited to [lower, upper]
+template<typename A>
+class ClampExpr: public SignalExpr<ClampExpr<A>> {
+    A a;
+    float lower = 0;
+    float upper = 0;
+
+public:
+    ClampExpr(const A &a_, float lower_, float upper_):
+        a(a_),
+        lower(lower_),
+        upper(upper_) {
+    }
+
+    size_t get_size() const {
+        return a.get_size();
+    }
+
+    void begin_block(size_t num_samples) {
+        a.begin_block(num_samples);
+    }
+
+    float eval(size_t index) const {
+        return std::min(std::max(a.eval(index), lower), upper);
+    }
+
+    void advance(size_t num_samples) {
+        a.advance(num_samples);
+    }
+};
+
+
+inline ConstantExpr constant(float value, size_t size = UNBOUNDED_SIZE) {
+    return ConstantExpr(value, size);
+}
+
+inline RampExpr ramp(float start, float end, size_t size) {
+    return RampExpr(start, end, size);
+}
+
+inline ExponentialExpr exponential(
+    float start, float halfing_size, size_t size
+) {
+    return ExponentialExpr(start, halfing_size, size);
+}
+
+template<typename A>
+ClampExpr<A> clamp(const SignalExpr<A> &a, float lower, float upper) {
+    return ClampExpr<A>(a.self(), lower, upper);
+}
+
+template<typename A, typename B>
+SumExpr<A, B> operator+(const SignalExpr<A> &a, const SignalExpr<B> &b) {
+    return SumExpr<A, B>(a.self(), b.self());
+}
+
+template<typename A>
+SumExpr<A, ConstantExpr> operator+(const SignalExpr<A> &a, float b) {
+    return SumExpr<A, ConstantExpr>(a.self(), ConstantExpr(b));
+}
+
+template<typename A>
+SumExpr<ConstantExpr, A> operator+(float a, const SignalExpr<A> &b) {
+    return SumExpr<ConstantExpr, A>(ConstantExpr(a), b.self());
+}
+
+template<typename A, typename B>
+ProductExpr<A, B> operator*(const SignalExpr<A> &a, const SignalExpr<B> &b) {
+    return ProductExpr<A, B>(a.self(), b.self());
+}
+
+template<typename A>
+ProductExpr<A, ConstantExpr> operator*(const SignalExpr<A> &a, float b) {
+    return ProductExpr<A, ConstantExpr>(a.self(), ConstantExpr(b));
+}
+
+template<typename A>
+ProductExpr<ConstantExpr, A> operator*(float a, const SignalExpr<A> &b) {
+    return ProductExpr<ConstantExpr, A>(ConstantExpr(a), b.self());
+}
+
+
+// Evaluate the next num_samples samples of expr into out, in one loop
+template<typename E>
+void fill_expr(E &expr, float *__restrict out, size_t num_samples) {
+    expr.begin_block(num_samples);
+    for (size_t ii = 0; ii < num_samples; ii++) {
+        out[ii] = expr.eval(ii);
+    }
+    expr.advance(num_samples);
+}
+
+
+// A generator that produces the samples of an expression.
+// Usable as a signal source in the Sequencer.
+template<typename E>
+class ExprGenerator: public FrameGenerator {
+    E expr;
+    size_t size = 0;
+    size_t progress = 0;
+    size_t frame_size = DEFAULT_FRAME_SIZE;
+
+public:
+    ExprGenerator(const E &expr_):
+        expr(expr_),
+        size(expr_.get_size()) {
+        if (size == UNBOUNDED_SIZE) {
+            throw std::invalid_argument("expression must have a finite size");
+        }
+    }
+
+    virtual void set_frame_size(size_t num_samples) {
+        frame_size = num_samples;
+    }
+
+    virtual bool has_ended() {
+        return progress >= size;
+    }
+
+    virtual size_t get_size() {
+        return size;
+    }
+
+    virtual FrameGenerator* clone() {
+        return new ExprGenerator(*this);
+    }
+
+    virtual bool next_frame(std::vector<float> &frame) {
+        size_t result_size = frame_size;
+        if (size - progress < result_size) {
+            result_size = size - progress;
+        }
+        frame.resize(result_size);
+        fill_expr(expr, frame.data(), result_size);
+        progress += result_size;
+        return progress >= size;
+    }
+};
+
+
+// Applies an expression as a time varying gain on another generator, in the
+// same loop that reads the frame. Usable for per-voice gain curves (like
+// tremolo or fades) in the Sequencer. Ends with the generator; the
+// expression must be at least as long.
+template<typename E>
+class GainCurveGenerator: public FrameGenerator {
+    // The generator whose output is scaled (owned)
+    FrameGenerator *inner = nullptr;
+    E gain_curve;
+
+public:
+    GainCurveGenerator(FrameGenerator *inner_, const E &gain_curve_):
+        inner(inner_),
+        gain_curve(gain_curve_) {
+        if (gain_curve.get_size() < inner->get_size()) {
+            throw std::invalid_argument("gain curve is shorter than signal");
+        }
+    }
+
+    // Copies the state, with a copy of the inner generator
+    GainCurveGenerator(const GainCurveGenerator &other):
+        inner(other.inner->clone()),
+        gain_curve(other.gain_curve) {
+    }
+
+    GainCurveGenerator& operator=(const GainCurveGenerator&) = delete;
+
+    virtual void set_frame_size(size_t num_samples) {
+        inner->set_frame_size(num_samples);
+    }
+
+    virtual void set_control_rate(size_t num_samples) {
+        inner->set_control_rate(num_samples);
+    }
+
+    virtual void set_quality(int level) {
+        inner->set_quality(level);
+    }
+
+    virtual float get_bandwidth() {
+        return inner->get_bandwidth();
+    }
+
+    virtual const char* get_name() {
+        return inner->get_name();
+    }
+
+    virtual size_t get_num_harmonics() {
+        return inner->get_num_harmonics();
+    }
+
+    virtual bool has_ended() {
+        return inner->has_ended();
+    }
+
+    virtual size_t get_size() {
+        return inner->get_size();
+    }
+
+    virtual FrameGenerator* clone() {
+        return new GainCurveGenerator(*this);
+    }
+
+    virtual bool next_frame(std::vector<float> &frame) {
+        bool ended = inner->next_frame(frame);
+        size_t count = frame.size();
+        float *__restrict data = frame.data();
+        gain_curve.begin_block(count);
+        for (size_t ii = 0; ii < count; ii++) {
+            data[ii] *= gain_curve.eval(ii);
+        }
+        gain_curve.advance(count);
+        return ended;
+    }
+
+    virtual ~GainCurveGenerator() {
+        delete inner;
+    }
+};
+
+
+// Scales the modulation depth of an FM voice by an expression, evaluated
+// for every sample together with the modulation envelope. Usable for
+// brightness swells or an LFO on the timbre. Ends with the voice; the
+// expression must be at least as long. The voice stays at the full rate,
+// since the expression can widen its spectrum beyond get_bandwidth.
+template<typename E>
+class ModDepthGenerator: public FrameGenerator {
+    // The voice whose modulation is scaled (owned)
+    FmSynthGenerator *inner = nullptr;
+    E depth_curve;
+    size_t size = 0;
+    size_t progress = 0;
+    size_t frame_size = DEFAULT_FRAME_SIZE;
+    // Depth for every sample of the current frame
+    std::vector<float> depth;
+
+public:
+    ModDepthGenerator(FmSynthGenerator *inner_, const E &depth_curve_):
+        inner(inner_),
+        depth_curve(depth_curve_),
+        size(inner_->get_size()) {
+        if (depth_curve.get_size() < size) {
+            throw std::invalid_argument("depth curve is shorter than signal");
+        }
+    }
+
+    // Copies the state, with a copy of the inner voice
+    ModDepthGenerator(const ModDepthGenerator &other):
+        inner(new FmSynthGenerator(*other.inner)),
+        depth_curve(other.depth_curve),
+        size(other.size),
+        progress(other.progress),
+        frame_size(other.frame_size) {
+    }
+
+    ModDepthGenerator& operator=(const ModDepthGenerator&) = delete;
+
+    virtual void set_frame_size(size_t num_samples) {
+        frame_size = num_samples;
+        inner->set_frame_size(num_samples);
+    }
+
+    virtual void set_control_rate(size_t num_samples) {
+        inner->set_control_rate(num_samples);
+    }
+
+    virtual void set_quality(int level) {
+        inner->set_quality(level);
+    }
+
+    virtual float get_bandwidth() {
+        return inner->get_bandwidth();
+    }
+
+    virtual const char* get_name() {
+        return inner->get_name();
+    }
+
+    virtual size_t get_num_harmonics() {
+        return inner->get_num_harmonics();
+    }
+
+    virtual bool has_ended() {
+        return inner->has_ended();
+    }
+
+    virtual size_t get_size() {
+        return size;
+    }
+
+    virtual FrameGenerator* clone() {
+        return new ModDepthGenerator(*this);
+    }
+
+    virtual bool next_frame(std::vector<float> &frame) {
+        size_t count = std::min(frame_size, size - progress);
+        depth.resize(count);
+        fill_expr(depth_curve, depth.data(), count);
+        progress += count;
+        return inner->next_frame(frame, depth.data());
+    }
+
+    virtual ~ModDepthGenerator() {
+        delete inner;
+    }
+};
+
+
+template<typename E>
+ExprGenerator<E>* make_expr_generator(const SignalExpr<E> &expr) {
+    return new ExprGenerator<E>(expr.self());
+}
+
+template<typename E>
+GainCurveGenerator<E>* make_gain_curve(
+    FrameGenerator *gen, const SignalExpr<E> &gain_curve
+) {
+    return new GainCurveGenerator<E>(gen, gain_curve.self());
+}
+
+template<typename E>
+ModDepthGenerator<E>* make_mod_depth(
+    FmSynthGenerator *gen, const SignalExpr<E> &depth_curve
+) {
+    return new ModDepthGenerator<E>(gen, depth_curve.self());
+}
+
+}
+
+#endif
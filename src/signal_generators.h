@@ -3,10 +3,13 @@
 
 #include <cmath>
 #include <cassert>
+#include <cstdint>
+#include <algorithm>
 #include <stdexcept>
 #include <string>
 
 #include "frame_generator.h"
+#include "resampler.h"
 
 #ifndef M_PI
     #define M_PI 3.14159265358979323846
@@ -68,6 +71,10 @@ public:
     virtual size_t get_size() {
         return size;
     }
+
+    virtual FrameGenerator* clone() {
+        return new ConstantGenerator(*this);
+    }
 };
 
 
@@ -125,10 +132,14 @@ public:
     virtual size_t get_size() {
         return size;
     }
+
+    virtual FrameGenerator* clone() {
+        return new RampGenerator(*this);
+    }
 };
 
 
-float halfing_size_to_decay(float halfing_size) {
+inline float halfing_size_to_decay(float halfing_size) {
     return powf(0.5f, 1.0f / halfing_size);
 }
 
@@ -173,6 +184,10 @@ public:
         return size;
     }
 
+    virtual FrameGenerator* clone() {
+        return new ExponentialGenerator(*this);
+    }
+
     virtual bool next_frame(std::vector<float> &frame) {
         size_t remaining = size - progress;
         size_t result_size = frame_size;
@@ -193,6 +208,22 @@ public:
 };
 
 
+// A linearly interpolated segment of a control signal.
+// Control signals are evaluated once per segment and interpolated in between.
+struct LinearRamp {
+    // Current value
+    float value = 0;
+    // Change per sample
+    float step = 0;
+
+    float next() {
+        float result = value;
+        value += step;
+        return result;
+    }
+};
+
+
 struct AdsrParams {
     size_t attack = 0;
     size_t decay = 0;
@@ -246,6 +277,13 @@ class AdsrEnvelope: public FrameGenerator {
     size_t frame_size = DEFAULT_FRAME_SIZE;
     // Total size of the signal
     size_t size = 0;
+    // Samples of envelope time per generated sample
+    size_t time_step = 1;
+    // After a change of the levels, the difference to the old envelope
+    // fades out linearly over level_ramp samples from level_ramp_start
+    size_t level_ramp_start = 0;
+    size_t level_ramp = 0;
+    float level_offset = 0.0f;
 
     friend class Signal_Tester;
 
@@ -277,11 +315,53 @@ public:
         return size;
     }
 
-    float get_next_sample() {
-        size_t index = progress;
+    virtual FrameGenerator* clone() {
+        return new AdsrEnvelope(*this);
+    }
+
+    AdsrParams get_params() {
+        return params;
+    }
 
+    // Change the sustain levels from the next sample on (the timing stays).
+    // The envelope moves to the new levels linearly over ramp samples, so
+    // that a held note does not click.
+    void set_levels(float slevel1, float slevel2, size_t ramp = 0) {
+        float before = value_at(progress);
+        params.slevel1 = slevel1;
+        params.slevel2 = slevel2;
+        log_slevel1 = logf(params.slevel1);
+        log_slevel2 = logf(params.slevel2);
+        level_ramp_start = progress;
+        level_ramp = ramp;
+        level_offset = ramp > 0 ? before - curve_at(progress) : 0.0f;
+    }
+
+    // Advance the envelope by num_samples for every generated sample,
+    // starting at sample index start. Used when the envelope drives a
+    // generator running at a reduced rate.
+    void set_time_step(size_t num_samples, size_t start = 0) {
+        time_step = num_samples > 0 ? num_samples : 1;
+        progress = start;
+    }
+
+    // Value of the envelope at the given sample index (0 after the end)
+    float value_at(size_t index) {
+        float result = curve_at(index);
+        size_t ramp_end = level_ramp_start + level_ramp;
+        if (index >= level_ramp_start && index < ramp_end && index < size) {
+            result += level_offset * (ramp_end - index) / cf32(level_ramp);
+        }
+        return result;
+    }
+
+    // Value of the envelope for the current levels, without the ramp from
+    // the old ones
+    float curve_at(size_t index) {
         float result = 0;
-        if (index < decay_start) {
+        if (index >= size) {
+            result = 0;
+        } else if (index < decay_start) {
             // Attack phase
             result = cf32(index) / cf32(params.attack);
         } else if (index < sustain_start) {
@@ -307,14 +387,55 @@ public:
             float deviation = position / cf32(params.release) * max_change;
             result = params.slevel2 - deviation;
         }
+        return result;
+    }
 
-        progress++;
+    float get_next_sample() {
+        float result = value_at(progress);
+        progress += time_step;
         return result;
     }
 
+    // Number of generated samples (at least 1) until the next corner of the
+    // envelope: the end of the attack, decay, sustain, release or of a ramp
+    // to new levels. Attack, decay and release are linear, so segments (see
+    // next_segment) that do not cross a corner follow them exactly.
+    size_t samples_to_corner() {
+        size_t corners[] = {decay_start, sustain_start, release_start, size};
+        size_t result = SIZE_MAX;
+        for (size_t corner: corners) {
+            if (corner > progress) {
+                result = (corner - progress + time_step - 1) / time_step;
+                break;
+            }
+        }
+        // The end of a ramp to new levels is a corner as well
+        size_t ramp_end = level_ramp_start + level_ramp;
+        if (ramp_end > progress) {
+            result = std::min(result,
+                              (ramp_end - progress + time_step - 1) / time_step);
+        }
+        return result;
+    }
+
+    // Return a ramp that interpolates the next num_samples samples from the
+    // envelope values at both ends, and move past those samples.
+    LinearRamp next_segment(size_t num_samples) {
+        LinearRamp ramp;
+        size_t span = num_samples * time_step;
+        ramp.value = value_at(progress);
+        float end = value_at(progress + span);
+        ramp.step = (end - ramp.value) / cf32(num_samples);
+        progress += span;
+        return ramp;
+    }
+
 
     virtual bool next_frame(std::vector<float> &frame) {
-        size_t remaining = size - progress;
+        size_t remaining = 0;
+        if (progress < size) {
+            remaining = (size - progress + time_step - 1) / time_step;
+        }
         size_t result_size = frame_size;
         if (remaining < result_size) {
             result_size = remaining;
@@ -360,17 +481,32 @@ struct FmSynthModParams {
 };
 
 
-float compute_phase_per_sample(float f, float fs) {
+inline float compute_phase_per_sample(float f, float fs) {
     return (2 * M_PI) * (f / fs);
 }
 
 
-float key2hz(float key) {
+// Sine of any phase, with an error below 1.2e-3. A parabola through the
+// zeros and the peaks of the sine, refined by a second parabola. Cheaper
+// than sinf, for the reduced quality levels.
+inline float fast_sinf(float phase) {
+    const float two_pi = static_cast<float>(2 * M_PI);
+    const float inv_two_pi = static_cast<float>(1 / (2 * M_PI));
+    // Wrap to [-pi, pi)
+    float x = phase - two_pi * floorf(phase * inv_two_pi + 0.5f);
+    const float b = static_cast<float>(4 / M_PI);
+    const float c = static_cast<float>(-4 / (M_PI * M_PI));
+    float y = b * x + c * x * std::abs(x);
+    return 0.225f * (y * std::abs(y) - y) + y;
+}
+
+
+inline float key2hz(float key) {
     return 110.0f * powf(2.0f, (key / 12.0f));
 }
 
 
-float key_to_phase_per_sample(float key, float fs) {
+inline float key_to_phase_per_sample(float key, float fs) {
     float freq = key2hz(key);
     return compute_phase_per_sample(freq, fs);
 }
@@ -403,10 +539,66 @@ class FmSynthGenerator: public FrameGenerator {
     float base_phase = 0;
     // Phase values for modulation components
     std::vector<float> mod_phase_vec;
+    // Amplitudes for modulation components
+    std::vector<float> mod_amp_vec;
 
     // gain for this event
     float gain = 1.0f;
 
+    // Number of samples per envelope evaluation (1 for audio rate)
+    size_t control_rate = 1;
+    // Shortest ramp (in samples) for a change of the envelope levels
+    static constexpr size_t min_level_ramp = 64;
+    // The generator runs at 1/rate_divider of the sample rate
+    size_t rate_divider = 1;
+
+    // Quality level (see set_quality)
+    int quality = QUALITY_FULL;
+    // Modulation components in use (all of them unless pruned)
+    std::vector<size_t> active_comps;
+    // Progress when the components were pruned
+    size_t pruned_at = 0;
+    // Whether the oscillators use fast_sinf
+    bool fast_sine = false;
+
+    // Keep the components below the Nyquist frequency that add at least
+    // 2% of the total modulation
+    void prune_components() {
+        float total = 0;
+        for (auto amp: mod_amp_vec) {
+            total += std::abs(amp);
+        }
+        active_comps.clear();
+        for (size_t comp = 0; comp < mod_freq_vec.size(); comp++) {
+            // Frequency at the full rate
+            float freq = std::abs(mod_freq_vec[comp]) / rate_divider;
+            if (freq < M_PI && std::abs(mod_amp_vec[comp]) >= 0.02f * total) {
+                active_comps.push_back(comp);
+            }
+        }
+        pruned_at = progress;
+    }
+
+    // Use all the components again, with the phases they would have now
+    void restore_components() {
+        std::vector<bool> active(mod_freq_vec.size(), false);
+        for (auto comp: active_comps) {
+            active[comp] = true;
+        }
+        double steps = static_cast<double>(progress - pruned_at);
+        active_comps.clear();
+        for (size_t comp = 0; comp < mod_freq_vec.size(); comp++) {
+            if (!active[comp]) {
+                double phase = mod_phase_vec[comp] + steps * mod_freq_vec[comp];
+                mod_phase_vec[comp] = static_cast<float>(
+                    fmod(phase, 2 * M_PI));
+            }
+            active_comps.push_back(comp);
+        }
+    }
+
+    friend class Signal_Tester;
+
 public:
 
     // phase_per_sample -> per sample phase change for base frequency.
@@ -441,6 +633,10 @@ public:
         }
         // Phase to be updated after every sample. Starts at 0.
         mod_phase_vec.resize(mod_params.harmonics.size(), 0);
+        mod_amp_vec = mod_params.amps;
+        for (size_t comp = 0; comp < mod_freq_vec.size(); comp++) {
+            active_comps.push_back(comp);
+        }
     }
 
     virtual void set_frame_size(size_t num_samples) {
@@ -455,34 +651,239 @@ public:
         return size;
     }
 
-    // Compute the next sample using FM synthesis
-    float get_next_sample() {
+    virtual FrameGenerator* clone() {
+        return new FmSynthGenerator(*this);
+    }
+
+    virtual void set_control_rate(size_t num_samples) {
+        control_rate = num_samples > 0 ? num_samples : 1;
+    }
+
+    virtual const char* get_name() {
+        return "fmsynth";
+    }
+
+    // QUALITY_PRUNED skips the modulation components above the Nyquist
+    // frequency or below 2% of the total modulation, and QUALITY_FAST_SINE
+    // also uses fast_sinf. Skipped components keep their phase, so they
+    // come back in place.
+    virtual void set_quality(int level) {
+        bool prune = level >= QUALITY_PRUNED;
+        bool pruned = quality >= QUALITY_PRUNED;
+        if (prune && !pruned) {
+            prune_components();
+        } else if (!prune && pruned) {
+            restore_components();
+        }
+        fast_sine = level >= QUALITY_FAST_SINE;
+        quality = level;
+    }
+
+    int get_quality() {
+        return quality;
+    }
+
+    // Number of modulation components in use
+    size_t get_active_harmonics() {
+        return active_comps.size();
+    }
+
+    FmSynthModParams get_mod_params() {
+        return mod_params;
+    }
+
+    AdsrParams get_mod_env_params() {
+        return mod_env_gen.get_params();
+    }
+
+    AdsrParams get_env_params() {
+        return env_gen.get_params();
+    }
+
+    // Per sample phase change of the base frequency (at the reduced rate
+    // after set_rate_divider)
+    float get_phase_rate() {
+        return phase_rate;
+    }
+
+    float get_gain() {
+        return gain;
+    }
+
+    virtual size_t get_num_harmonics() {
+        return mod_params.harmonics.size();
+    }
+
+    // Highest significant frequency of the output, with a margin so that
+    // the voice stays accurate at a reduced rate (checked with
+    // quality_bench):
+    // - The modulation: Carson's rule for every component (its peak
+    //   deviation plus its frequency), summed, since the sidebands of the
+    //   components mix with each other. The plain Carson's rule for the sum
+    //   leaves out sidebands of bright timbres.
+    // - The envelopes: the corners of a ramp of n samples spread the
+    //   spectrum by about 8 pi / n.
+    virtual float get_bandwidth() {
+        return compute_bandwidth(mod_params);
+    }
+
+    // get_bandwidth with the given modulation parameters
+    float compute_bandwidth(const FmSynthModParams &params) {
+        float sidebands = 0;
+        for (size_t comp = 0; comp < params.harmonics.size(); comp++) {
+            sidebands += std::abs(params.harmonics[comp])
+                + std::abs(params.amps[comp]);
+        }
+        size_t shortest_ramp = SIZE_MAX;
+        AdsrParams envs[] = {mod_env_gen.get_params(), env_gen.get_params()};
+        for (auto &env: envs) {
+            for (size_t ramp: {env.attack, env.decay, env.release}) {
+                if (ramp > 0) {
+                    shortest_ramp = std::min(shortest_ramp, ramp);
+                }
+            }
+        }
+        float envelope_spread = 0;
+        if (shortest_ramp != SIZE_MAX) {
+            // Ramps are counted in samples at the full rate
+            envelope_spread = 8 * M_PI / shortest_ramp;
+        }
+        return std::abs(phase_rate) * (1 + sidebands) / rate_divider
+            + envelope_spread;
+    }
+
+    // Gain of the sum of a sine with phase change delta over steps samples
+    static float step_gain(float delta, float steps) {
+        float denom = steps * sinf(delta / 2);
+        if (std::abs(denom) > 1e-9f) {
+            return sinf(steps * delta / 2) / denom;
+        }
+        return 1.0f;
+    }
+
+    // Change the harmonics and their amplitudes, from the next sample on.
+    // The number of harmonics must stay the same; the phases carry on.
+    // At a reduced rate (see set_rate_divider), the new bandwidth must
+    // still fit that rate, or the voice would alias.
+    void set_mod_params(const FmSynthModParams &params) {
+        if (params.harmonics.size() != mod_params.harmonics.size()
+                || params.amps.size() != params.harmonics.size()) {
+            throw std::invalid_argument("number of harmonics cannot change");
+        }
+        if (rate_divider > 1
+                && choose_rate_divider(compute_bandwidth(params))
+                    < rate_divider) {
+            throw std::invalid_argument(
+                "modulation too wide for the reduced rate");
+        }
+        bool pruned = quality >= QUALITY_PRUNED;
+        if (pruned) {
+            restore_components();
+        }
+        mod_params = params;
+        float steps = cf32(rate_divider);
+        // Per sample phase change of the base frequency at the full rate
+        float base_rate = phase_rate / steps;
+        for (size_t comp = 0; comp < mod_freq_vec.size(); comp++) {
+            float delta = params.harmonics[comp] * base_rate;
+            mod_amp_vec[comp] = params.amps[comp];
+            if (rate_divider > 1) {
+                mod_amp_vec[comp] *= step_gain(delta, steps);
+                // Move the phase from the middle of the step at the old
+                // frequency to the middle at the new one (see
+                // set_rate_divider)
+                float old_delta = mod_freq_vec[comp] / steps;
+                mod_phase_vec[comp] -= (steps - 1) * (delta - old_delta) / 2;
+            }
+            mod_freq_vec[comp] = steps * delta;
+        }
+        if (pruned) {
+            prune_components();
+        }
+    }
+
+    // Change the sustain levels of both envelopes (see
+    // AdsrEnvelope::set_levels). The envelopes ramp to the new levels over a
+    // control segment, and over at least min_level_ramp samples.
+    void set_env_levels(const AdsrParams &mod_env_params,
+                        const AdsrParams &env_params) {
+        size_t ramp = std::max(control_rate * rate_divider, min_level_ramp);
+        mod_env_gen.set_levels(mod_env_params.slevel1, mod_env_params.slevel2,
+                               ramp);
+        env_gen.set_levels(env_params.slevel1, env_params.slevel2, ramp);
+    }
+
+    // Can only be set once, before the first frame.
+    // Every step at the reduced rate adds up the phase increments of
+    // divider samples at the full rate. The sum of the modulator sines over
+    // those samples has a closed form: a sine with a phase offset and a
+    // gain, which are folded into the starting phases and the amplitudes.
+    virtual bool set_rate_divider(size_t divider) {
+        if (divider == 0 || rate_divider != 1 || progress > 0) {
+            return false;
+        }
+        float steps = cf32(divider);
+        for (size_t comp = 0; comp < mod_freq_vec.size(); comp++) {
+            float delta = mod_freq_vec[comp];
+            mod_amp_vec[comp] *= step_gain(delta, steps);
+            mod_phase_vec[comp] = -(steps - 1) * delta / 2;
+            mod_freq_vec[comp] = steps * delta;
+        }
+        rate_divider = divider;
+        phase_rate *= steps;
+        // The modulation envelope is taken at the middle of every step and
+        // the output envelope at its last sample.
+        mod_env_gen.set_time_step(divider, (divider - 1) / 2);
+        env_gen.set_time_step(divider, divider - 1);
+        size = (size + divider - 1) / divider;
+        return true;
+    }
+
+    float oscillate(float phase) {
+        return fast_sine ? fast_sinf(phase) : sinf(phase);
+    }
+
+    // Compute the next sample using FM synthesis, given the values of the
+    // modulation envelope and the signal envelope for this sample.
+    float next_sample(float mod_env, float signal_env) {
         // Sum of all modulation components
         float comp_sum = 0;
-        for (size_t comp = 0; comp < mod_freq_vec.size(); comp++) {
+        for (auto comp: active_comps) {
             // Update the phases of modulation signal
             mod_phase_vec[comp] += mod_freq_vec[comp];
             // Modulation component value, with scaling
-            float val = sinf(mod_phase_vec[comp]) * mod_params.amps[comp];
+            float val = oscillate(mod_phase_vec[comp]) * mod_amp_vec[comp];
             // Update sum of all components
             comp_sum += val;
         }
-        // Get modulation signal's envelope
-        float mod_env = mod_env_gen.get_next_sample();
         // Find the final modulating signal
         float mod_signal_value = 1 + comp_sum * mod_env;
         // Update final phase for the signal
         base_phase += (phase_rate * mod_signal_value);
-        // Envelope for the final signal
-        float signal_env = env_gen.get_next_sample();
         // Convert to final signal
-        float sig = sinf(base_phase) * signal_env * gain;
+        float sig = oscillate(base_phase) * signal_env * gain;
         // Update progress
         progress++;
         return sig;
     }
 
+    // Compute the next sample using FM synthesis
+    float get_next_sample() {
+        // Get modulation signal's envelope
+        float mod_env = mod_env_gen.get_next_sample();
+        // Envelope for the final signal
+        float signal_env = env_gen.get_next_sample();
+        return next_sample(mod_env, signal_env);
+    }
+
     virtual bool next_frame(std::vector<float> &frame) {
+        return next_frame(frame, nullptr);
+    }
+
+    // Same as next_frame, with the modulation envelope of sample ii of the
+    // frame scaled by depth[ii] (see ModDepthGenerator). depth holds a
+    // value for every sample of the frame, or is nullptr for none.
+    bool next_frame(std::vector<float> &frame, const float *depth) {
         size_t remaining = size - progress;
         size_t result_size = frame_size;
         if (remaining < result_size) {
@@ -490,8 +891,35 @@ public:
         }
 
         frame.resize(result_size);
-        for (size_t ii = 0; ii < result_size; ii++) {
-            frame[ii] = get_next_sample();
+        if (control_rate <= 1) {
+            for (size_t ii = 0; ii < result_size; ii++) {
+                if (depth == nullptr) {
+                    frame[ii] = get_next_sample();
+                    continue;
+                }
+                float mod_env = mod_env_gen.get_next_sample() * depth[ii];
+                frame[ii] = next_sample(mod_env, env_gen.get_next_sample());
+            }
+            return progress >= size;
+        }
+
+        // Envelopes are evaluated once every control_rate samples (and at
+        // their corners) and linearly interpolated in between. Only the
+        // oscillators run for every sample.
+        size_t count = 0;
+        for (size_t start = 0; start < result_size; start += count) {
+            count = std::min(result_size - start, control_rate);
+            count = std::min(count, mod_env_gen.samples_to_corner());
+            count = std::min(count, env_gen.samples_to_corner());
+            LinearRamp mod_env = mod_env_gen.next_segment(count);
+            LinearRamp signal_env = env_gen.next_segment(count);
+            for (size_t ii = start; ii < start + count; ii++) {
+                float mod_value = mod_env.next();
+                if (depth != nullptr) {
+                    mod_value *= depth[ii];
+                }
+                frame[ii] = next_sample(mod_value, signal_env.next());
+            }
         }
 
         return progress >= size;
@@ -1,9 +1,13 @@
 
 #include <fstream>
 #include <cmath>
+#include <algorithm>
 
 #include "simple_tester.h"
 #include "signal_generators.h"
+#include "resampler.h"
+#include "signal_expressions.h"
+#include "sequencer.h"
 
 namespace signal {
 
@@ -23,6 +27,21 @@ std::vector<float> collect_frames(FrameGenerator *gen) {
     return output;
 }
 
+// Render part of gen, clone it, and check that the clone continues with
+// the same samples without affecting gen
+void check_clone(FrameGenerator *gen, size_t frames_before) {
+    std::vector<float> frame;
+    for (size_t ii = 0; ii < frames_before; ii++) {
+        gen->next_frame(frame);
+    }
+    FrameGenerator *copy = gen->clone();
+    std::vector<float> copy_samples = collect_frames(copy);
+    std::vector<float> samples = collect_frames(gen);
+    delete copy;
+    THROW_IF(samples.empty(), "Nothing left to compare");
+    THROW_IF(copy_samples != samples, "Clone output differs");
+}
+
 
 class Signal_Tester {
 public:
@@ -149,6 +168,65 @@ public:
                 "Maximum sample difference beyond threshold");
     }
 
+    static void test_AdsrEnvelope_set_levels() {
+        AdsrParams params = {
+            .attack = 200,
+            .decay = 100,
+            .sustain = 2000,
+            .release = 300,
+            .slevel1 = 0.7,
+            .slevel2 = 0.5,
+        };
+        AdsrParams changed = params;
+        changed.slevel1 = 0.2;
+        changed.slevel2 = 0.1;
+        size_t ramp = 64;
+
+        // Change the levels of a held note at a frame boundary
+        AdsrEnvelope envelope(params);
+        envelope.set_frame_size(200);
+        std::vector<float> samples;
+        std::vector<float> frame;
+        for (size_t ii = 0; ii < 5; ii++) {
+            envelope.next_frame(frame);
+            samples.insert(samples.end(), frame.begin(), frame.end());
+        }
+        envelope.set_levels(changed.slevel1, changed.slevel2, ramp);
+        bool done = false;
+        while (!done) {
+            done = envelope.next_frame(frame);
+            samples.insert(samples.end(), frame.begin(), frame.end());
+        }
+        THROW_IF(samples.size() != params.get_size(), "Total size mismatch");
+
+        // No step at the change
+        for (size_t ii = 1; ii < samples.size(); ii++) {
+            THROW_IF(fabs(samples[ii] - samples[ii-1]) > 0.01f,
+                     "Level change steps instead of ramping");
+        }
+
+        // After the ramp, the envelope follows the new levels
+        AdsrEnvelope reference(changed);
+        reference.set_frame_size(params.get_size());
+        reference.next_frame(frame);
+        for (size_t ii = 1000 + ramp; ii < samples.size(); ii++) {
+            THROW_IF(fabs(samples[ii] - frame[ii]) > 1e-6f,
+                     "Envelope does not reach the new levels");
+        }
+
+        // Control-rate segments end at the end of the ramp
+        AdsrEnvelope segmented(params);
+        segmented.next_segment(1000);
+        segmented.set_levels(changed.slevel1, changed.slevel2, ramp);
+        THROW_IF(segmented.samples_to_corner() != ramp,
+                 "End of ramp is not a corner");
+        LinearRamp segment = segmented.next_segment(ramp);
+        for (size_t ii = 0; ii < ramp; ii++) {
+            THROW_IF(fabs(segment.next() - samples[1000 + ii]) > 1e-3f,
+                     "Segment does not follow the ramp");
+        }
+    }
+
     static void test_FmSynthGenerator() {
         size_t frame_size = 160;
         AdsrParams env_params = {
@@ -160,14 +238,11 @@ public:
             .slevel2 = 0.05,
         };
 
-        FmSynthModParams mod_params = {
-            .harmonics = {2, 6, 11},
-            .amps = {1, 1, 1}
-        };
+        FmSynthModParams mod_params({2, 6, 11}, {1, 1, 1});
 
         FmSynthGenerator fmsynth(
             mod_params, env_params, env_params,
-            compute_phase_per_sample(440.0f, 16000.0f)
+            compute_phase_per_sample(440.0f, 16000.0f), 1.0f
         );
         fmsynth.set_frame_size(frame_size);
 
@@ -177,11 +252,597 @@ public:
         // TODO: add more tests!
     }
 
+    static void test_FmSynthGenerator_control_rate() {
+        size_t frame_size = 160;
+        AdsrParams env_params = {
+            .attack = 800,
+            .decay = 800,
+            .sustain = 8000,
+            .release = 800,
+            .slevel1 = 0.5,
+            .slevel2 = 0.05,
+        };
+        FmSynthModParams mod_params({2, 6, 11}, {1, 1, 1});
+        float phase_rate = compute_phase_per_sample(440.0f, 16000.0f);
+
+        FmSynthGenerator reference(
+            mod_params, env_params, env_params, phase_rate, 1.0f);
+        reference.set_frame_size(frame_size);
+        FmSynthGenerator fast(
+            mod_params, env_params, env_params, phase_rate, 1.0f);
+        fast.set_frame_size(frame_size);
+        fast.set_control_rate(32);
+
+        std::vector<float> expected = collect_frames(&reference);
+        std::vector<float> samples = collect_frames(&fast);
+        THROW_IF(samples.size() != expected.size(), "Total size mismatch");
+        float max_abs_diff = 0;
+        for (size_t ii = 0; ii < samples.size(); ii++) {
+            max_abs_diff = std::max(max_abs_diff,
+                                    std::abs(samples[ii] - expected[ii]));
+        }
+        THROW_IF(max_abs_diff > 0.01,
+                 "Control rate output deviates too much " +
+                 std::to_string(max_abs_diff));
+
+        // Attacks shorter than the control period are followed, since the
+        // segments stop at the corners of the envelopes
+        AdsrParams sharp = env_params;
+        sharp.attack = 20;
+        sharp.decay = 300;
+        FmSynthGenerator sharp_reference(
+            mod_params, sharp, sharp, phase_rate, 1.0f);
+        FmSynthGenerator sharp_fast(mod_params, sharp, sharp, phase_rate, 1.0f);
+        sharp_fast.set_control_rate(64);
+        expected = collect_frames(&sharp_reference);
+        samples = collect_frames(&sharp_fast);
+        max_abs_diff = 0;
+        for (size_t ii = 0; ii < samples.size(); ii++) {
+            max_abs_diff = std::max(max_abs_diff,
+                                    std::abs(samples[ii] - expected[ii]));
+        }
+        THROW_IF(max_abs_diff > 1e-3,
+                 "Sharp attack deviates at control rate " +
+                 std::to_string(max_abs_diff));
+    }
+
+    static void test_fast_sinf() {
+        float max_error = 0;
+        for (int ii = -20000; ii <= 20000; ii++) {
+            float phase = ii * 0.01f;
+            max_error = std::max(max_error,
+                                 std::abs(fast_sinf(phase) - sinf(phase)));
+        }
+        THROW_IF(max_error > 1.2e-3f, "Fast sine error too large " +
+                 std::to_string(max_error));
+    }
+
+    static void test_FmSynthGenerator_quality() {
+        AdsrParams env_params = {
+            .attack = 800,
+            .decay = 800,
+            .sustain = 8000,
+            .release = 800,
+            .slevel1 = 0.5,
+            .slevel2 = 0.05,
+        };
+        float phase_rate = compute_phase_per_sample(440.0f, 16000.0f);
+        // 40 is above the Nyquist frequency, and 0.01 is too weak
+        FmSynthModParams mod_params({2, 6, 11, 40}, {1, 1, 0.01f, 1});
+        FmSynthModParams kept({2, 6}, {1, 1});
+
+        // Pruning gives the same output as leaving the components out
+        FmSynthGenerator pruned(
+            mod_params, env_params, env_params, phase_rate, 1.0f);
+        pruned.set_quality(QUALITY_PRUNED);
+        THROW_IF(pruned.get_active_harmonics() != 2, "Wrong components kept");
+        FmSynthGenerator reference(
+            kept, env_params, env_params, phase_rate, 1.0f);
+        std::vector<float> expected = collect_frames(&reference);
+        THROW_IF(collect_frames(&pruned) != expected, "Wrong pruned output");
+
+        // The fast sine stays close to the reference
+        FmSynthGenerator fast(kept, env_params, env_params, phase_rate, 1.0f);
+        fast.set_quality(QUALITY_FAST_SINE);
+        std::vector<float> samples = collect_frames(&fast);
+        THROW_IF(samples.size() != expected.size(), "Total size mismatch");
+        double error = 0;
+        double power = 0;
+        for (size_t ii = 0; ii < samples.size(); ii++) {
+            error += (samples[ii] - expected[ii]) * (samples[ii] - expected[ii]);
+            power += expected[ii] * expected[ii];
+        }
+        THROW_IF(10 * log10(power / error) < 30, "Fast sine SNR too low");
+
+        // Back to full quality, all the components are used again, with
+        // the phases of a generator that was never pruned
+        FmSynthGenerator restored(
+            mod_params, env_params, env_params, phase_rate, 1.0f);
+        FmSynthGenerator unpruned(
+            mod_params, env_params, env_params, phase_rate, 1.0f);
+        std::vector<float> frame;
+        std::vector<float> expected_frame;
+        restored.set_quality(QUALITY_FAST_SINE);
+        restored.next_frame(frame);
+        unpruned.next_frame(expected_frame);
+        restored.set_quality(QUALITY_FULL);
+        THROW_IF(restored.get_active_harmonics() != 4,
+                 "Components not restored");
+        // The carrier phase drifted while the components were left out,
+        // which is the cost of pruning and not undone
+        restored.base_phase = unpruned.base_phase;
+        // The first frame shows the restored phases. Later on the rounding
+        // of the phases differs (they are wrapped when restored) and adds up
+        // in the carrier phase.
+        float first_diff = 0;
+        float max_abs_diff = 0;
+        bool done = false;
+        for (size_t count = 0; !done; count++) {
+            done = restored.next_frame(frame);
+            unpruned.next_frame(expected_frame);
+            THROW_IF(frame.size() != expected_frame.size(), "Size mismatch");
+            for (size_t ii = 0; ii < frame.size(); ii++) {
+                max_abs_diff = std::max(
+                    max_abs_diff, std::abs(frame[ii] - expected_frame[ii]));
+            }
+            if (count == 0) {
+                first_diff = max_abs_diff;
+            }
+        }
+        THROW_IF(first_diff > 1e-4, "Restored phases differ from the "
+                 "unpruned ones " + std::to_string(first_diff));
+        THROW_IF(max_abs_diff > 0.02, "Restored output differs from the "
+                 "unpruned one " + std::to_string(max_abs_diff));
+    }
+
+    static void test_PolyphaseInterpolator() {
+        size_t factor = 4;
+        PolyphaseInterpolator interpolator(factor);
+        // A sine well inside the pass band, at the reduced rate
+        float phase_rate = 0.3f;
+        size_t count = 400;
+        std::vector<float> output(count * factor);
+        for (size_t ii = 0; ii < count; ii++) {
+            interpolator.push(sinf(phase_rate * ii), &output[ii * factor]);
+        }
+        size_t delay = interpolator.get_delay();
+        float max_abs_diff = 0;
+        for (size_t jj = 100; jj < output.size(); jj++) {
+            float expected = sinf(phase_rate * (jj - cf32(delay)) / factor);
+            max_abs_diff = std::max(max_abs_diff,
+                                    std::abs(output[jj] - expected));
+        }
+        THROW_IF(max_abs_diff > 0.002,
+                 "Interpolated sine deviates too much " +
+                 std::to_string(max_abs_diff));
+    }
+
+    static void test_MultirateGenerator() {
+        size_t frame_size = 100;
+        AdsrParams env_params = {
+            .attack = 200,
+            .decay = 400,
+            .sustain = 4000,
+            .release = 400,
+            .slevel1 = 0.5,
+            .slevel2 = 0.1,
+        };
+        FmSynthModParams mod_params({2, 5}, {1, 2});
+        float phase_rate = compute_phase_per_sample(110.0f, 48000.0f);
+
+        FmSynthGenerator reference(
+            mod_params, env_params, env_params, phase_rate, 1.0f);
+        reference.set_frame_size(frame_size);
+        FrameGenerator *fast = make_multirate(new FmSynthGenerator(
+            mod_params, env_params, env_params, phase_rate, 1.0f));
+        fast->set_frame_size(frame_size);
+        THROW_IF(dynamic_cast<MultirateGenerator*>(fast) == nullptr,
+                 "Low note is expected to run at a reduced rate");
+
+        std::vector<float> expected = collect_frames(&reference);
+        std::vector<float> samples = collect_frames(fast);
+        delete fast;
+        THROW_IF(samples.size() != expected.size(), "Total size mismatch");
+        double signal_energy = 0;
+        double error_energy = 0;
+        for (size_t ii = 0; ii < samples.size(); ii++) {
+            float diff = samples[ii] - expected[ii];
+            signal_energy += expected[ii] * expected[ii];
+            error_energy += diff * diff;
+        }
+        double snr = 10 * log10(signal_energy / error_energy);
+        THROW_IF(snr < 40, "Multirate SNR too low " + std::to_string(snr));
+
+        // The same note with strong high modulation, or with a sharp
+        // attack, stays at the full rate
+        FmSynthModParams bright({2, 3, 7, 11, 13}, {3, 2, 1, 0.5f, 0.1f});
+        FrameGenerator *full = make_multirate(new FmSynthGenerator(
+            bright, env_params, env_params, phase_rate * 2, 1.0f));
+        THROW_IF(dynamic_cast<MultirateGenerator*>(full) != nullptr,
+                 "Bright note is expected to run at the full rate");
+        delete full;
+        AdsrParams sharp = env_params;
+        sharp.attack = 20;
+        full = make_multirate(new FmSynthGenerator(
+            mod_params, sharp, sharp, phase_rate * 2, 1.0f));
+        THROW_IF(dynamic_cast<MultirateGenerator*>(full) != nullptr,
+                 "Sharp attack is expected to run at the full rate");
+        delete full;
+
+        // New modulation parameters at the reduced rate give the same phase
+        // offsets and step gains as starting with them
+        FmSynthModParams changed({3, 7}, {0.5f, 1});
+        FmSynthGenerator updated(
+            mod_params, env_params, env_params, phase_rate, 1.0f);
+        THROW_IF(!updated.set_rate_divider(4), "Rate divider not set");
+        updated.set_mod_params(changed);
+        FmSynthGenerator direct(
+            changed, env_params, env_params, phase_rate, 1.0f);
+        direct.set_rate_divider(4);
+        samples = collect_frames(&updated);
+        expected = collect_frames(&direct);
+        THROW_IF(samples.size() != expected.size(), "Total size mismatch");
+        float max_abs_diff = 0;
+        for (size_t ii = 0; ii < samples.size(); ii++) {
+            max_abs_diff = std::max(max_abs_diff,
+                                    std::abs(samples[ii] - expected[ii]));
+        }
+        THROW_IF(max_abs_diff > 1e-4, "Updated parameters at the reduced "
+                 "rate differ " + std::to_string(max_abs_diff));
+
+        // Parameters too wide for the reduced rate are rejected
+        bool thrown = false;
+        try {
+            updated.set_mod_params(FmSynthModParams({9, 17}, {8, 4}));
+        } catch (std::invalid_argument&) {
+            thrown = true;
+        }
+        THROW_IF(!thrown, "Aliasing parameters accepted");
+    }
+
+    static void test_SignalExpr() {
+        size_t size = 1000;
+        size_t frame_size = 96;
+        RampGenerator ramp_gen(0.1f, 2.0f, size);
+        ramp_gen.set_frame_size(frame_size);
+        ExponentialGenerator exp_gen(3.0f, 200, size);
+        exp_gen.set_frame_size(frame_size);
+        std::vector<float> ramp_samples = collect_frames(&ramp_gen);
+        std::vector<float> exp_samples = collect_frames(&exp_gen);
+
+        auto expr = clamp(ramp(0.1f, 2.0f, size) * exponential(3.0f, 200, size)
+                          + 0.25f, 0.0f, 2.5f);
+        THROW_IF(expr.get_size() != size, "Expression size mismatch");
+        ExprGenerator<decltype(expr)> gen(expr);
+        gen.set_frame_size(frame_size);
+        std::vector<float> samples = collect_frames(&gen);
+        THROW_IF(samples.size() != size, "Total size mismatch");
+        for (size_t ii = 0; ii < size; ii++) {
+            float expected = ramp_samples[ii] * exp_samples[ii] + 0.25f;
+            expected = std::min(std::max(expected, 0.0f), 2.5f);
+            THROW_IF(std::abs(samples[ii] - expected) > 1e-5f,
+                     "Fused expression deviates from generators");
+        }
+
+        // Growing block sizes extend the table of powers
+        auto exp_expr = exponential(3.0f, 200, size);
+        std::vector<float> grown(size);
+        size_t pos = 0;
+        for (size_t block = 4; pos < size; block *= 2) {
+            size_t count = std::min(block, size - pos);
+            fill_expr(exp_expr, grown.data() + pos, count);
+            pos += count;
+        }
+        for (size_t ii = 0; ii < size; ii++) {
+            THROW_IF(std::abs(grown[ii] - exp_samples[ii])
+                     > 1e-5f * exp_samples[0],
+                     "Exponential deviates with growing blocks");
+        }
+    }
+
+    static void test_GainCurveGenerator() {
+        size_t size = 500;
+        FrameGenerator *gen = make_gain_curve(
+            new ConstantGenerator(2.0f, size), ramp(0.0f, 1.0f, size));
+        gen->set_frame_size(64);
+        std::vector<float> samples = collect_frames(gen);
+        delete gen;
+        THROW_IF(samples.size() != size, "Total size mismatch");
+        THROW_IF(std::abs(samples[0]) > 1e-6f, "Gain curve start mismatch");
+        THROW_IF(std::abs(samples[size - 1] - 2.0f) > 1e-5f,
+                 "Gain curve end mismatch");
+    }
+
+    static void test_ModDepthGenerator() {
+        AdsrParams env_params = {
+            .attack = 200,
+            .decay = 400,
+            .sustain = 2000,
+            .release = 400,
+            .slevel1 = 0.5,
+            .slevel2 = 0.1,
+        };
+        FmSynthModParams mod_params({2, 5}, {1, 2});
+        FmSynthModParams no_mod({2, 5}, {0, 0});
+        float phase_rate = compute_phase_per_sample(220.0f, 16000.0f);
+        size_t size = env_params.get_size();
+
+        for (size_t control_rate: {1, 16}) {
+            // Unit depth leaves the voice as it is
+            std::vector<FrameGenerator*> gens = {
+                make_mod_depth(new FmSynthGenerator(
+                    mod_params, env_params, env_params, phase_rate, 1.0f),
+                    constant(1.0f)),
+                new FmSynthGenerator(
+                    mod_params, env_params, env_params, phase_rate, 1.0f),
+                // Zero depth removes the modulation
+                make_mod_depth(new FmSynthGenerator(
+                    mod_params, env_params, env_params, phase_rate, 1.0f),
+                    constant(0.0f, size)),
+                new FmSynthGenerator(
+                    no_mod, env_params, env_params, phase_rate, 1.0f),
+            };
+            std::vector<std::vector<float>> samples;
+            for (auto gen: gens) {
+                gen->set_frame_size(100);
+                gen->set_control_rate(control_rate);
+                samples.push_back(collect_frames(gen));
+            }
+            THROW_IF(samples[0].size() != size, "Total size mismatch");
+            THROW_IF(samples[0] != samples[1], "Unit depth changes the voice");
+            THROW_IF(samples[2] != samples[3], "Zero depth keeps modulation");
+            THROW_IF(gens[0]->set_rate_divider(2),
+                     "Depth curve must keep the voice at the full rate");
+            for (auto gen: gens) {
+                delete gen;
+            }
+        }
+
+        // A depth curve shorter than the voice is refused
+        auto voice = new FmSynthGenerator(
+            mod_params, env_params, env_params, phase_rate, 1.0f);
+        bool thrown = false;
+        try {
+            make_mod_depth(voice, ramp(0.0f, 1.0f, size - 1));
+        } catch (std::invalid_argument&) {
+            thrown = true;
+        }
+        delete voice;
+        THROW_IF(!thrown, "Short depth curve accepted");
+    }
+
+    static void test_clone() {
+        AdsrParams env_params = {
+            .attack = 200,
+            .decay = 400,
+            .sustain = 2000,
+            .release = 400,
+            .slevel1 = 0.5,
+            .slevel2 = 0.1,
+        };
+        FmSynthModParams mod_params({2, 5}, {1, 2});
+        float phase_rate = compute_phase_per_sample(110.0f, 48000.0f);
+
+        std::vector<FrameGenerator*> gens = {
+            new ConstantGenerator(0.5f, 1000),
+            new RampGenerator(0.1f, 2.0f, 1000),
+            new ExponentialGenerator(3.0f, 200, 1000),
+            new AdsrEnvelope(env_params),
+            new FmSynthGenerator(mod_params, env_params, env_params,
+                                 phase_rate, 1.0f),
+            make_multirate(new FmSynthGenerator(
+                mod_params, env_params, env_params, phase_rate, 1.0f)),
+            make_expr_generator(ramp(0.0f, 1.0f, 1000) * 0.5f),
+            make_gain_curve(new ConstantGenerator(2.0f, 1000),
+                            ramp(0.0f, 1.0f, 1000)),
+            make_mod_depth(new FmSynthGenerator(
+                mod_params, env_params, env_params, phase_rate, 1.0f),
+                ramp(0.0f, 2.0f, env_params.get_size())),
+        };
+        THROW_IF(dynamic_cast<MultirateGenerator*>(gens[5]) == nullptr,
+                 "Low note is expected to run at a reduced rate");
+        for (auto gen: gens) {
+            gen->set_frame_size(64);
+            check_clone(gen, 5);
+            delete gen;
+        }
+    }
+
+    static void test_Sequencer_clone() {
+        AdsrParams env_params = {
+            .attack = 200,
+            .decay = 400,
+            .sustain = 3000,
+            .release = 400,
+            .slevel1 = 0.5,
+            .slevel2 = 0.1,
+        };
+        FmSynthModParams mod_params({2, 5}, {1, 2});
+        Sequencer seq(128, 0.5f);
+        seq.set_control_rate(16);
+        seq.set_multirate(true);
+        seq.add(new FmSynthGenerator(
+            mod_params, env_params, env_params,
+            compute_phase_per_sample(110.0f, 48000.0f), 1.0f));
+        seq.add(new FmSynthGenerator(
+            mod_params, env_params, env_params,
+            compute_phase_per_sample(880.0f, 48000.0f), 1.0f));
+
+        // Stop in the middle of a block, with an event still posted
+        std::vector<float> out(1000);
+        seq.render(out.data(), 300);
+        seq.post(new ConstantGenerator(0.25f, 500));
+        Sequencer *copy = seq.clone();
+        THROW_IF(copy->get_generator_count() != seq.get_generator_count()
+                 || copy->get_buffered_size() != seq.get_buffered_size()
+                 || copy->get_block_count() != seq.get_block_count()
+                 || copy->get_control_rate() != 16 || !copy->get_multirate(),
+                 "Clone state mismatch");
+
+        std::vector<float> copy_out(out.size());
+        seq.render(out.data(), out.size());
+        // An event added to the original must not reach the copy
+        seq.add(new ConstantGenerator(1.0f, 500));
+        std::vector<float> more(out.size());
+        seq.render(more.data(), more.size());
+        copy->render(copy_out.data(), copy_out.size());
+        THROW_IF(copy_out != out, "Clone output differs");
+        copy->render(copy_out.data(), copy_out.size());
+        THROW_IF(copy_out == more, "Clone is not independent");
+        delete copy;
+    }
+
+    static void test_compute_pan_gains() {
+        float gains[5];
+        compute_pan_gains(1, 0.7f, 0.5f, gains);
+        THROW_IF(gains[0] != 1.0f, "Mono gain must be 1");
+        compute_pan_gains(2, -1.0f, 0.0f, gains);
+        THROW_IF(gains[0] != 1.0f || gains[1] != 0.0f, "Hard left mismatch");
+        compute_pan_gains(2, 0.0f, 0.0f, gains);
+        THROW_IF(std::abs(gains[0] - sqrtf(0.5f)) > 1e-6f
+                 || std::abs(gains[1] - sqrtf(0.5f)) > 1e-6f,
+                 "Center mismatch");
+        for (size_t channels = 2; channels <= 5; channels++) {
+            for (float pan = -1.5f; pan <= 1.5f; pan += 0.25f) {
+                for (float spread = 0; spread <= 1; spread += 0.5f) {
+                    compute_pan_gains(channels, pan, spread, gains);
+                    float power = 0;
+                    for (size_t ch = 0; ch < channels; ch++) {
+                        THROW_IF(gains[ch] < 0, "Negative gain");
+                        power += gains[ch] * gains[ch];
+                    }
+                    THROW_IF(std::abs(power - 1) > 1e-5f,
+                             "Gains must have unit power");
+                }
+            }
+        }
+        // Spread reaches the far channels
+        compute_pan_gains(4, -1.0f, 0.0f, gains);
+        THROW_IF(gains[3] != 0.0f, "Far channel used without spread");
+        compute_pan_gains(4, -1.0f, 1.0f, gains);
+        THROW_IF(gains[3] <= 0.0f, "Far channel unused with spread");
+    }
+
+    static FrameGenerator* make_sequencer_note(float key) {
+        AdsrParams env_params = {
+            .attack = 30,
+            .decay = 50,
+            .sustain = 400,
+            .release = 100,
+        };
+        FmSynthModParams mod_params({2, 3}, {1, 0.5f});
+        return new FmSynthGenerator(
+            mod_params, env_params, env_params,
+            key_to_phase_per_sample(key, 16000.0f), 0.5f);
+    }
+
+    static void test_Sequencer_render_sizes() {
+        size_t frame_size = 64;
+        size_t sizes[] = {
+            1, frame_size - 1, 3 * frame_size + 5, frame_size, 17, 1, 1,
+            2 * frame_size, frame_size + 1, 200, 3, frame_size - 3, 500,
+        };
+        Sequencer seq(frame_size, 0.7f);
+        Sequencer reference(frame_size, 0.7f);
+        seq.add(make_sequencer_note(10));
+        reference.add(make_sequencer_note(10));
+
+        // Rendered in uneven sizes, with events added between the calls
+        std::vector<float> out;
+        std::vector<size_t> event_blocks;
+        for (size_t ii = 0; ii < sizeof(sizes) / sizeof(sizes[0]); ii++) {
+            if (ii % 3 == 1) {
+                seq.add(make_sequencer_note(cf32(12 + ii)));
+                // Takes effect from the next block
+                event_blocks.push_back(
+                    (out.size() + frame_size - 1) / frame_size);
+            }
+            std::vector<float> chunk(sizes[ii]);
+            seq.render(chunk.data(), chunk.size());
+            out.insert(out.end(), chunk.begin(), chunk.end());
+        }
+
+        // The same events at the same blocks, in whole frames
+        std::vector<float> expected;
+        std::vector<float> frame;
+        size_t next_event = 0;
+        for (size_t block = 0; expected.size() < out.size(); block++) {
+            while (next_event < event_blocks.size()
+                   && event_blocks[next_event] == block) {
+                size_t ii = 1 + 3 * next_event;
+                reference.add(make_sequencer_note(cf32(12 + ii)));
+                next_event++;
+            }
+            reference.next_frame(frame);
+            expected.insert(expected.end(), frame.begin(), frame.end());
+        }
+        for (size_t ii = 0; ii < out.size(); ii++) {
+            THROW_IF(out[ii] != expected[ii],
+                     "Uneven render differs from whole frames at "
+                     + std::to_string(ii));
+        }
+    }
+
+    static void test_Sequencer_channels() {
+        size_t frame_size = 64;
+        Sequencer seq(frame_size, 0.5f, 2);
+        seq.add(new ConstantGenerator(1.0f, 300), -1.0f);
+        seq.add(new ConstantGenerator(0.5f, 300), 1.0f);
+        seq.add(new ConstantGenerator(0.2f, 300));
+        float center = 0.2f * sqrtf(0.5f);
+
+        // Interleaved, in a size that is not a multiple of the block size
+        std::vector<float> out(2 * 100);
+        seq.render(out.data(), 100);
+        for (size_t ii = 0; ii < 100; ii++) {
+            THROW_IF(std::abs(out[2 * ii] - 0.5f * (1.0f + center)) > 1e-6f
+                     || std::abs(out[2 * ii + 1] - 0.5f * (0.5f + center))
+                     > 1e-6f, "Interleaved output mismatch");
+        }
+
+        // Planar
+        std::vector<float> left(100);
+        std::vector<float> right(100);
+        float *channels[] = {left.data(), right.data()};
+        seq.render_planar(channels, 100);
+        for (size_t ii = 0; ii < 100; ii++) {
+            THROW_IF(left[ii] != out[2 * ii] || right[ii] != out[2 * ii + 1],
+                     "Planar output mismatch");
+        }
+
+        // float32 PCM is the interleaved output
+        std::vector<float> pcm(2 * 50);
+        seq.render_pcm(reinterpret_cast<uint8_t*>(pcm.data()), 50,
+                       SampleFormat::float32, 2, false);
+        for (size_t ii = 0; ii < 50; ii++) {
+            THROW_IF(pcm[2 * ii] != out[2 * ii]
+                     || pcm[2 * ii + 1] != out[2 * ii + 1],
+                     "PCM output mismatch");
+        }
+        bool thrown = false;
+        try {
+            seq.render_pcm(reinterpret_cast<uint8_t*>(pcm.data()), 10,
+                           SampleFormat::float32, 1, false);
+        } catch (std::invalid_argument&) {
+            thrown = true;
+        }
+        THROW_IF(!thrown, "Channel count mismatch accepted");
+
+        // A clone keeps the placement
+        Sequencer *copy = seq.clone();
+        std::vector<float> copy_out(2 * 40);
+        copy->render(copy_out.data(), 40);
+        seq.render(out.data(), 40);
+        delete copy;
+        THROW_IF(!std::equal(copy_out.begin(), copy_out.end(), out.begin()),
+                 "Clone placement mismatch");
+    }
+
 };
 
 }
 
-void test_all() {
+bool test_all() {
     using namespace signal;
     using namespace tester;
 
@@ -190,11 +851,24 @@ void test_all() {
     ADD_TEST(tests, Signal_Tester::test_RampGenerator);
     ADD_TEST(tests, Signal_Tester::test_ExponentialGenerator);
     ADD_TEST(tests, Signal_Tester::test_AdsrEnvelope);
+    ADD_TEST(tests, Signal_Tester::test_AdsrEnvelope_set_levels);
     ADD_TEST(tests, Signal_Tester::test_FmSynthGenerator);
-    run_tests(tests);
+    ADD_TEST(tests, Signal_Tester::test_FmSynthGenerator_control_rate);
+    ADD_TEST(tests, Signal_Tester::test_fast_sinf);
+    ADD_TEST(tests, Signal_Tester::test_FmSynthGenerator_quality);
+    ADD_TEST(tests, Signal_Tester::test_PolyphaseInterpolator);
+    ADD_TEST(tests, Signal_Tester::test_MultirateGenerator);
+    ADD_TEST(tests, Signal_Tester::test_SignalExpr);
+    ADD_TEST(tests, Signal_Tester::test_GainCurveGenerator);
+    ADD_TEST(tests, Signal_Tester::test_ModDepthGenerator);
+    ADD_TEST(tests, Signal_Tester::test_clone);
+    ADD_TEST(tests, Signal_Tester::test_Sequencer_clone);
+    ADD_TEST(tests, Signal_Tester::test_compute_pan_gains);
+    ADD_TEST(tests, Signal_Tester::test_Sequencer_channels);
+    ADD_TEST(tests, Signal_Tester::test_Sequencer_render_sizes);
+    return run_tests(tests);
 }
 
 int main() {
-    test_all();
-    return 0;
+    return test_all() ? 1 : 0;
 }
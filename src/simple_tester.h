@@ -48,7 +48,7 @@ do { \
 
 // Run all the given tests
 // Return true on error
-bool run_tests(TestCollection &tests) {
+inline bool run_tests(TestCollection &tests) {
     bool has_error = false;
     for (auto &test: tests) {
         try {
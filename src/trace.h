@@ -0,0 +1,373 @@
+#ifndef KOELSYNTH_TRACE_H
+#define KOELSYNTH_TRACE_H
+
+// Optional tracing of the render stages, exported as Chrome trace JSON
+// (viewable in chrome://tracing or Perfetto).
+//
+// Tracing is compiled in only when KOELSYNTH_TRACE is defined. Otherwise
+// the TRACE_* macros expand to nothing and cost nothing. When compiled in,
+// recording is switched on and off at run time with trace::start() and
+// trace::stop(). Events go to a preallocated ring, which keeps the most
+// recent events; recording an event is a relaxed atomic increment plus a
+// few stores, without locks or allocation.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace trace {
+
+// Optional arguments of an event. Unset values are not exported.
+struct TraceArgs {
+    // Kind of voice (like "fmsynth")
+    const char *instrument = nullptr;
+    // Voice identity
+    int64_t voice = -1;
+    // Number of harmonics of a voice
+    int64_t harmonics = -1;
+    // Count of items (like voices in a frame)
+    int64_t count = -1;
+    // Stream identity in a render engine
+    int64_t stream = -1;
+};
+
+// A recorded event
+struct TraceRecord {
+    // Static strings
+    const char *name = nullptr;
+    const char *category = nullptr;
+    // 'X' for a complete (scoped) event, 'i' for an instant
+    char phase = 'X';
+    uint32_t thread_id = 0;
+    // Nanoseconds since the tracer was created
+    int64_t start_ns = 0;
+    int64_t duration_ns = 0;
+    TraceArgs args;
+};
+
+// A slot of the ring, guarded by a sequence number (a seqlock). Readers
+// copy the fields while a writer may overwrite them, and check the
+// sequence afterwards, so the fields are relaxed atomics.
+struct TraceEvent {
+    // Index of the event plus 1 once written, 0 while being written
+    std::atomic<uint64_t> sequence {0};
+    std::atomic<const char*> name {nullptr};
+    std::atomic<const char*> category {nullptr};
+    std::atomic<char> phase {'X'};
+    std::atomic<uint32_t> thread_id {0};
+    std::atomic<int64_t> start_ns {0};
+    std::atomic<int64_t> duration_ns {0};
+    std::atomic<const char*> instrument {nullptr};
+    std::atomic<int64_t> voice {-1};
+    std::atomic<int64_t> harmonics {-1};
+    std::atomic<int64_t> count {-1};
+    std::atomic<int64_t> stream {-1};
+
+    void store(const TraceRecord &record) {
+        const auto relaxed = std::memory_order_relaxed;
+        name.store(record.name, relaxed);
+        category.store(record.category, relaxed);
+        phase.store(record.phase, relaxed);
+        thread_id.store(record.thread_id, relaxed);
+        start_ns.store(record.start_ns, relaxed);
+        duration_ns.store(record.duration_ns, relaxed);
+        instrument.store(record.args.instrument, relaxed);
+        voice.store(record.args.voice, relaxed);
+        harmonics.store(record.args.harmonics, relaxed);
+        count.store(record.args.count, relaxed);
+        stream.store(record.args.stream, relaxed);
+    }
+
+    TraceRecord load() const {
+        const auto relaxed = std::memory_order_relaxed;
+        TraceRecord record;
+        record.name = name.load(relaxed);
+        record.category = category.load(relaxed);
+        record.phase = phase.load(relaxed);
+        record.thread_id = thread_id.load(relaxed);
+        record.start_ns = start_ns.load(relaxed);
+        record.duration_ns = duration_ns.load(relaxed);
+        record.args.instrument = instrument.load(relaxed);
+        record.args.voice = voice.load(relaxed);
+        record.args.harmonics = harmonics.load(relaxed);
+        record.args.count = count.load(relaxed);
+        record.args.stream = stream.load(relaxed);
+        return record;
+    }
+};
+
+class Tracer {
+    std::vector<TraceEvent> events;
+    // Total number of events recorded (the ring keeps the last ones)
+    std::atomic<uint64_t> next_index {0};
+    std::atomic<bool> enabled {false};
+    std::chrono::steady_clock::time_point origin;
+
+public:
+    Tracer(size_t capacity = 1 << 16):
+        events(capacity),
+        origin(std::chrono::steady_clock::now()) {
+    }
+
+    bool is_enabled() {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    // Drop the recorded events and start recording
+    void start() {
+        for (auto &event: events) {
+            event.sequence.store(0, std::memory_order_relaxed);
+        }
+        next_index.store(0);
+        enabled.store(true);
+    }
+
+    void stop() {
+        enabled.store(false);
+    }
+
+    // Number of events recorded since start (including overwritten ones)
+    uint64_t get_event_count() {
+        return next_index.load();
+    }
+
+    size_t get_capacity() {
+        return events.size();
+    }
+
+    int64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - origin).count();
+    }
+
+    void record(const char *category, const char *name, char phase,
+                int64_t start_ns, int64_t duration_ns, const TraceArgs &args);
+
+    // Write the recorded events as Chrome trace JSON. Events being written
+    // at the same time are left out.
+    void write_chrome_json(std::ostream &out);
+
+    // Write the Chrome trace JSON to a file. Returns false on failure.
+    bool dump(const std::string &path) {
+        std::ofstream out(path);
+        write_chrome_json(out);
+        return static_cast<bool>(out);
+    }
+};
+
+// Small number identifying the calling thread in traces
+inline uint32_t thread_id() {
+    static std::atomic<uint32_t> next_thread_id {1};
+    thread_local uint32_t id = next_thread_id.fetch_add(1);
+    return id;
+}
+
+inline void Tracer::record(
+    const char *category, const char *name, char phase,
+    int64_t start_ns, int64_t duration_ns, const TraceArgs &args
+) {
+    uint64_t index = next_index.fetch_add(1, std::memory_order_relaxed);
+    TraceEvent &event = events[index % events.size()];
+    TraceRecord record;
+    record.name = name;
+    record.category = category;
+    record.phase = phase;
+    record.thread_id = thread_id();
+    record.start_ns = start_ns;
+    record.duration_ns = duration_ns;
+    record.args = args;
+    // The fence keeps the payload stores after the sequence is cleared
+    event.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    event.store(record);
+    event.sequence.store(index + 1, std::memory_order_release);
+}
+
+inline void write_json_string(std::ostream &out, const char *text) {
+    out << '"';
+    for (const char *ch = text; *ch; ch++) {
+        if (*ch == '"' || *ch == '\\') {
+            out << '\\';
+        }
+        out << *ch;
+    }
+    out << '"';
+}
+
+inline void Tracer::write_chrome_json(std::ostream &out) {
+    uint64_t end = next_index.load(std::memory_order_acquire);
+    uint64_t begin = end > events.size() ? end - events.size() : 0;
+    std::ios::fmtflags flags = out.flags();
+    std::streamsize precision = out.precision();
+    out << std::fixed << std::setprecision(3);
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+    for (uint64_t index = begin; index < end; index++) {
+        TraceEvent &event = events[index % events.size()];
+        if (event.sequence.load(std::memory_order_acquire) != index + 1) {
+            continue;
+        }
+        TraceRecord copy = event.load();
+        // The fence keeps the payload loads before the sequence check
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (event.sequence.load(std::memory_order_relaxed) != index + 1) {
+            // Overwritten while copying
+            continue;
+        }
+
+        out << (first ? "\n" : ",\n");
+        first = false;
+        out << "{\"name\":";
+        write_json_string(out, copy.name);
+        out << ",\"cat\":";
+        write_json_string(out, copy.category);
+        out << ",\"ph\":\"" << copy.phase << "\"";
+        out << ",\"pid\":1,\"tid\":" << copy.thread_id;
+        // Chrome traces are in microseconds
+        out << ",\"ts\":" << copy.start_ns / 1000.0;
+        if (copy.phase == 'X') {
+            out << ",\"dur\":" << copy.duration_ns / 1000.0;
+        } else {
+            out << ",\"s\":\"t\"";
+        }
+        out << ",\"args\":{";
+        const char *sep = "";
+        if (copy.args.instrument != nullptr) {
+            out << "\"instrument\":";
+            write_json_string(out, copy.args.instrument);
+            sep = ",";
+        }
+        if (copy.args.voice >= 0) {
+            out << sep << "\"voice\":" << copy.args.voice;
+            sep = ",";
+        }
+        if (copy.args.harmonics >= 0) {
+            out << sep << "\"harmonics\":" << copy.args.harmonics;
+            sep = ",";
+        }
+        if (copy.args.count >= 0) {
+            out << sep << "\"count\":" << copy.args.count;
+            sep = ",";
+        }
+        if (copy.args.stream >= 0) {
+            out << sep << "\"stream\":" << copy.args.stream;
+        }
+        out << "}}";
+    }
+    out << "\n]}\n";
+    out.flags(flags);
+    out.precision(precision);
+}
+
+// The process wide tracer used by the TRACE_* macros
+inline Tracer& global_tracer() {
+    static Tracer tracer;
+    return tracer;
+}
+
+inline void start() {
+    global_tracer().start();
+}
+
+inline void stop() {
+    global_tracer().stop();
+}
+
+inline bool dump(const std::string &path) {
+    return global_tracer().dump(path);
+}
+
+// Whether tracing is compiled in
+inline bool is_compiled_in() {
+#ifdef KOELSYNTH_TRACE
+    return true;
+#else
+    return false;
+#endif
+}
+
+inline TraceArgs count_args(size_t count) {
+    TraceArgs args;
+    args.count = static_cast<int64_t>(count);
+    return args;
+}
+
+inline TraceArgs stream_args(size_t stream) {
+    TraceArgs args;
+    args.stream = static_cast<int64_t>(stream);
+    return args;
+}
+
+// Records a complete event for its scope (if tracing is enabled)
+class ScopedEvent {
+    const char *category = nullptr;
+    const char *name = nullptr;
+    TraceArgs args;
+    int64_t start_ns = 0;
+    bool active = false;
+
+public:
+    ScopedEvent(const char *category_, const char *name_,
+                const TraceArgs &args_ = TraceArgs()):
+        category(category_),
+        name(name_),
+        args(args_) {
+        Tracer &tracer = global_tracer();
+        active = tracer.is_enabled();
+        if (active) {
+            start_ns = tracer.now_ns();
+        }
+    }
+
+    ScopedEvent(const ScopedEvent&) = delete;
+    ScopedEvent& operator=(const ScopedEvent&) = delete;
+
+    ~ScopedEvent() {
+        if (active) {
+            Tracer &tracer = global_tracer();
+            tracer.record(category, name, 'X', start_ns,
+                          tracer.now_ns() - start_ns, args);
+        }
+    }
+};
+
+inline void instant(const char *category, const char *name,
+                    const TraceArgs &args) {
+    Tracer &tracer = global_tracer();
+    if (tracer.is_enabled()) {
+        tracer.record(category, name, 'i', tracer.now_ns(), 0, args);
+    }
+}
+
+}
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+
+#ifdef KOELSYNTH_TRACE
+    // Record the enclosing scope. args is only evaluated when enabled.
+    #define TRACE_SCOPE(category, name) \
+        trace::ScopedEvent TRACE_CONCAT(trace_scope_, __LINE__)( \
+            category, name)
+    #define TRACE_SCOPE_ARGS(category, name, args) \
+        trace::ScopedEvent TRACE_CONCAT(trace_scope_, __LINE__)( \
+            category, name, trace::global_tracer().is_enabled() \
+                ? (args) : trace::TraceArgs())
+    #define TRACE_INSTANT(category, name, args) \
+        do { \
+            if (trace::global_tracer().is_enabled()) { \
+                trace::instant(category, name, args); \
+            } \
+        } while (0)
+#else
+    #define TRACE_SCOPE(category, name)
+    #define TRACE_SCOPE_ARGS(category, name, args)
+    #define TRACE_INSTANT(category, name, args) do {} while (0)
+#endif
+
+#endif
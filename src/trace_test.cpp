@@ -0,0 +1,137 @@
+
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "simple_tester.h"
+#include "signal_generators.h"
+#include "sequencer.h"
+#include "trace.h"
+
+using tester::TestError;
+using namespace signal;
+
+size_t count_occurrences(const std::string &text, const std::string &part) {
+    size_t count = 0;
+    for (size_t pos = text.find(part); pos != std::string::npos;
+         pos = text.find(part, pos + 1)) {
+        count++;
+    }
+    return count;
+}
+
+void test_sequencer_trace() {
+    AdsrParams env_params = {
+        .attack = 100,
+        .decay = 100,
+        .sustain = 300,
+        .release = 100,
+    };
+    FmSynthModParams mod_params({2, 5, 7}, {1, 1, 1});
+    Sequencer seq(100);
+
+    // Nothing is recorded before start
+    seq.next_frame();
+    THROW_IF(trace::global_tracer().get_event_count() != 0,
+             "Events recorded while stopped");
+
+    trace::start();
+    seq.add(new FmSynthGenerator(
+        mod_params, env_params, env_params, 0.1f, 1.0f));
+    for (size_t ii = 0; ii < 8; ii++) {
+        seq.next_frame();
+    }
+    trace::stop();
+    seq.next_frame();
+
+    std::ostringstream out;
+    trace::global_tracer().write_chrome_json(out);
+    std::string json = out.str();
+
+    THROW_IF(json.find("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[") != 0,
+             "Missing trace header");
+    THROW_IF(count_occurrences(json, "\"name\":\"frame\"") != 8,
+             "Frame events mismatch");
+    // 600 samples in frames of 100
+    THROW_IF(count_occurrences(json, "\"name\":\"voice\"") != 6,
+             "Voice events mismatch");
+    THROW_IF(count_occurrences(json, "\"name\":\"voice_start\"") != 1,
+             "Voice start missing");
+    THROW_IF(count_occurrences(json, "\"name\":\"voice_end\"") != 1,
+             "Voice end missing");
+    THROW_IF(count_occurrences(json, "\"name\":\"mix\"") != 8,
+             "Mix events mismatch");
+    THROW_IF(json.find("\"instrument\":\"fmsynth\"") == std::string::npos,
+             "Missing instrument tag");
+    THROW_IF(json.find("\"harmonics\":3") == std::string::npos,
+             "Missing harmonic count");
+}
+
+void test_ring_wraps() {
+    trace::Tracer tracer(16);
+    tracer.start();
+    for (size_t ii = 0; ii < 40; ii++) {
+        tracer.record("test", "event", 'i', ii, 0, trace::count_args(ii));
+    }
+    std::ostringstream out;
+    tracer.write_chrome_json(out);
+    std::string json = out.str();
+    THROW_IF(tracer.get_event_count() != 40, "Event count mismatch");
+    THROW_IF(count_occurrences(json, "\"name\":\"event\"") != 16,
+             "Ring must keep the last events");
+    THROW_IF(json.find("\"count\":39") == std::string::npos,
+             "Newest event missing");
+    THROW_IF(json.find("\"count\":23") != std::string::npos,
+             "Overwritten event present");
+}
+
+void test_dump_while_recording() {
+    // Events are overwritten while they are exported. Every exported event
+    // must be consistent: its time stamp (in microseconds) is its count.
+    trace::Tracer tracer(1024);
+    tracer.start();
+    std::atomic<bool> done {false};
+    std::thread writer([&] {
+        // In bursts, so that a part of the ring outlives an export
+        for (int64_t ii = 0; !done; ii++) {
+            tracer.record("test", "event", 'i', 1000 * ii, 0,
+                          trace::count_args(ii));
+            if (ii % 32 == 31) {
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        }
+    });
+    // Export once the ring has wrapped
+    while (tracer.get_event_count() < 2048) {
+        std::this_thread::yield();
+    }
+    size_t exported = 0;
+    for (size_t pass = 0; pass < 200; pass++) {
+        std::ostringstream out;
+        tracer.write_chrome_json(out);
+        std::string json = out.str();
+        for (size_t pos = json.find("\"ts\":"); pos != std::string::npos;
+             pos = json.find("\"ts\":", pos + 1)) {
+            long long stamp = std::stoll(json.substr(pos + 5));
+            size_t count_pos = json.find("\"count\":", pos);
+            long long count = std::stoll(json.substr(count_pos + 8));
+            THROW_IF(stamp != count, "Torn event exported");
+            exported++;
+        }
+    }
+    done = true;
+    writer.join();
+    THROW_IF(exported == 0, "Nothing exported");
+}
+
+int main() {
+    using namespace tester;
+
+    TestCollection tests;
+    ADD_TEST(tests, test_sequencer_trace);
+    ADD_TEST(tests, test_ring_wraps);
+    ADD_TEST(tests, test_dump_while_recording);
+    return run_tests(tests) ? 1 : 0;
+}
@@ -0,0 +1,386 @@
+#ifndef KOELSYNTH_WAV_WRITER_H
+#define KOELSYNTH_WAV_WRITER_H
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <stdexcept>
+
+#include "sample_format.h"
+#include "sequencer.h"
+
+// A WAV file that is written incrementally.
+// The header is written with placeholder sizes when the file is opened and
+// the sizes are patched when the file is closed. Samples are interleaved if
+// there is more than one channel. Files with more than 2 channels or more
+// than 16 bits per integer sample have a WAVE_FORMAT_EXTENSIBLE header, as
+// the format requires.
+class WavFile {
+    // Output stream
+    std::ofstream file;
+    // Format of the samples in the file
+    SampleFormat format = SampleFormat::float32;
+    // Number of interleaved channels
+    size_t num_channels = 1;
+    // Sample rate in Hz
+    size_t sample_rate = 0;
+    // Number of bytes written to the data chunk so far
+    size_t data_bytes = 0;
+    // Offset of the data chunk size field
+    size_t data_size_pos = 0;
+    // Offset of the fact chunk sample count (float32 only)
+    size_t fact_pos = 0;
+    // Converted samples waiting to be written
+    std::vector<char> scratch;
+    // Dither source for integer formats
+    TpdfDither dither;
+    // Whether integer samples are dithered
+    bool use_dither = true;
+
+    void put_u16(uint16_t value) {
+        char bytes[2] = {
+            static_cast<char>(value & 0xff),
+            static_cast<char>((value >> 8) & 0xff),
+        };
+        file.write(bytes, 2);
+    }
+
+    void put_u32(uint32_t value) {
+        char bytes[4];
+        for (size_t ii = 0; ii < 4; ii++) {
+            bytes[ii] = static_cast<char>((value >> (8 * ii)) & 0xff);
+        }
+        file.write(bytes, 4);
+    }
+
+    void patch_u32(size_t pos, uint32_t value) {
+        file.seekp(pos);
+        put_u32(value);
+    }
+
+    // Speaker positions of the channels for WAVE_FORMAT_EXTENSIBLE. The
+    // sequencer places more than 2 channels on a line, not on speakers, so
+    // their positions are left to the player.
+    uint32_t channel_mask() {
+        switch (num_channels) {
+        case 1:
+            return 0x4;  // Front center
+        case 2:
+            return 0x3;  // Front left and right
+        default:
+            return 0;
+        }
+    }
+
+    void write_header() {
+        bool is_float = format == SampleFormat::float32;
+        size_t sample_bytes = bytes_per_sample(format);
+        size_t block_align = sample_bytes * num_channels;
+        bool extensible = num_channels > 2 || (!is_float && sample_bytes > 2);
+        uint16_t format_tag = is_float ? 3 : 1;
+
+        file.write("RIFF", 4);
+        put_u32(0);
+        file.write("WAVE", 4);
+
+        file.write("fmt ", 4);
+        // Non-PCM formats carry an extension size field
+        put_u32(extensible ? 40 : is_float ? 18 : 16);
+        put_u16(extensible ? 0xfffe : format_tag);
+        put_u16(static_cast<uint16_t>(num_channels));
+        put_u32(static_cast<uint32_t>(sample_rate));
+        put_u32(static_cast<uint32_t>(sample_rate * block_align));
+        put_u16(static_cast<uint16_t>(block_align));
+        put_u16(static_cast<uint16_t>(8 * sample_bytes));
+        if (extensible) {
+            put_u16(22);
+            // Valid bits, speaker positions and the format as a GUID
+            put_u16(static_cast<uint16_t>(8 * sample_bytes));
+            put_u32(channel_mask());
+            put_u16(format_tag);
+            file.write("\x00\x00\x00\x00\x10\x00\x80\x00"
+                       "\x00\xaa\x00\x38\x9b\x71", 14);
+        } else if (is_float) {
+            put_u16(0);
+        }
+        if (is_float) {
+            // Non-PCM formats need a fact chunk with the sample count
+            file.write("fact", 4);
+            put_u32(4);
+            fact_pos = static_cast<size_t>(file.tellp());
+            put_u32(0);
+        }
+
+        file.write("data", 4);
+        data_size_pos = static_cast<size_t>(file.tellp());
+        put_u32(0);
+    }
+
+public:
+    // path         : output file path
+    // sample_rate_ : sample rate in Hz
+    // format_      : sample format in the file
+    // num_channels_: number of interleaved channels
+    // use_dither_  : dither integer samples (see TpdfDither)
+    WavFile(const std::string &path, size_t sample_rate_,
+            SampleFormat format_ = SampleFormat::float32,
+            size_t num_channels_ = 1, bool use_dither_ = true):
+        file(path, std::ios::binary | std::ios::trunc),
+        format(format_),
+        num_channels(num_channels_),
+        sample_rate(sample_rate_),
+        use_dither(use_dither_) {
+        if (!file) {
+            throw std::runtime_error("unable to open " + path);
+        }
+        if (num_channels == 0) {
+            throw std::invalid_argument("num_channels must be positive");
+        }
+        write_header();
+    }
+
+    WavFile(const WavFile&) = delete;
+    WavFile& operator=(const WavFile&) = delete;
+
+    bool is_open() {
+        return file.is_open();
+    }
+
+    size_t get_num_channels() {
+        return num_channels;
+    }
+
+    // Write count samples (interleaved if multichannel)
+    void write(const float *samples, size_t count) {
+        if (!file.is_open()) {
+            throw std::runtime_error("wav file is closed");
+        }
+
+        scratch.resize(count * bytes_per_sample(format));
+        write_samples(samples, count, 1.0f, format, 1,
+                      reinterpret_cast<uint8_t*>(scratch.data()),
+                      use_dither ? &dither : nullptr);
+        file.write(scratch.data(), scratch.size());
+        if (!file) {
+            throw std::runtime_error("failed writing wav data");
+        }
+        data_bytes += scratch.size();
+    }
+
+    // Patch the header with the final sizes and close the file
+    void close() {
+        if (!file.is_open()) {
+            return;
+        }
+        size_t padding = data_bytes % 2;
+        if (padding) {
+            // Chunks are word aligned
+            file.put(0);
+        }
+        size_t riff_size = static_cast<size_t>(file.tellp()) - 8;
+        patch_u32(4, static_cast<uint32_t>(riff_size));
+        patch_u32(data_size_pos, static_cast<uint32_t>(data_bytes));
+        if (format == SampleFormat::float32) {
+            size_t frames = data_bytes / (4 * num_channels);
+            patch_u32(fact_pos, static_cast<uint32_t>(frames));
+        }
+        file.close();
+    }
+
+    ~WavFile() {
+        try {
+            close();
+        } catch (...) {
+            // Nothing useful can be done in a destructor
+        }
+    }
+};
+
+
+// Streams samples to a WavFile from a background thread.
+// The producer fills one buffer while the writer thread drains the other.
+// Memory use is fixed by buffer_size, independent of the length of the
+// stream.
+class StreamingWavWriter {
+    WavFile file;
+    // Number of samples per buffer
+    size_t buffer_size = 0;
+    // Buffer filled by the producer
+    std::vector<float> front;
+    // Buffer drained by the writer thread
+    std::vector<float> back;
+    // Whether back holds samples waiting to be written
+    bool back_ready = false;
+    // Set when the writer thread should exit
+    bool stopping = false;
+    // Error raised in the writer thread (if any)
+    std::exception_ptr error;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::thread worker;
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cond.wait(lock, [this] { return back_ready || stopping; });
+            if (!back_ready) {
+                break;
+            }
+            lock.unlock();
+            try {
+                file.write(back.data(), back.size());
+            } catch (...) {
+                lock.lock();
+                error = std::current_exception();
+                back_ready = false;
+                cond.notify_all();
+                break;
+            }
+            lock.lock();
+            back.clear();
+            back_ready = false;
+            cond.notify_all();
+        }
+    }
+
+    // Once the writer thread fails, every later call reports the error
+    void rethrow_error() {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    // Hand the front buffer over to the writer thread
+    void flush_front() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [this] { return !back_ready; });
+        rethrow_error();
+        std::swap(front, back);
+        back_ready = true;
+        cond.notify_all();
+    }
+
+public:
+    // buffer_size_ : number of samples per buffer (two are allocated)
+    // use_dither   : dither integer samples
+    StreamingWavWriter(const std::string &path, size_t sample_rate,
+                       SampleFormat format = SampleFormat::float32,
+                       size_t num_channels = 1,
+                       size_t buffer_size_ = 16384,
+                       bool use_dither = true):
+        file(path, sample_rate, format, num_channels, use_dither),
+        buffer_size(buffer_size_) {
+        if (buffer_size == 0) {
+            throw std::invalid_argument("buffer_size must be positive");
+        }
+        front.reserve(buffer_size);
+        back.reserve(buffer_size);
+        worker = std::thread(&StreamingWavWriter::run, this);
+    }
+
+    StreamingWavWriter(const StreamingWavWriter&) = delete;
+    StreamingWavWriter& operator=(const StreamingWavWriter&) = delete;
+
+    size_t get_num_channels() {
+        return file.get_num_channels();
+    }
+
+    // Queue count samples for writing. Blocks only if both buffers are full.
+    void write(const float *samples, size_t count) {
+        if (stopping) {
+            throw std::runtime_error("wav writer is closed");
+        }
+        while (count > 0) {
+            size_t space = buffer_size - front.size();
+            size_t chunk = count < space ? count : space;
+            front.insert(front.end(), samples, samples + chunk);
+            samples += chunk;
+            count -= chunk;
+            if (front.size() == buffer_size) {
+                flush_front();
+            }
+        }
+    }
+
+    // Write the pending samples, stop the writer thread and finalize the file
+    void close() {
+        if (!worker.joinable()) {
+            return;
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this] { return !back_ready; });
+            if (!front.empty() && !error) {
+                // Hand over the last partial buffer and wait for it
+                std::swap(front, back);
+                back_ready = true;
+                cond.notify_all();
+                cond.wait(lock, [this] { return !back_ready; });
+            }
+            stopping = true;
+        }
+        cond.notify_all();
+        worker.join();
+        file.close();
+        rethrow_error();
+    }
+
+    ~StreamingWavWriter() {
+        try {
+            close();
+        } catch (...) {
+            // Nothing useful can be done in a destructor
+        }
+    }
+};
+
+
+inline void check_channels(Sequencer &seq, StreamingWavWriter &writer) {
+    if (seq.get_num_channels() != writer.get_num_channels()) {
+        throw std::invalid_argument("channel count of the sequencer "
+                                    "and the writer differ");
+    }
+}
+
+// Render num_frames frames from the sequencer into the writer
+inline void render_frames(
+    Sequencer &seq, StreamingWavWriter &writer, size_t num_frames
+) {
+    check_channels(seq, writer);
+    std::vector<float> frame;
+    for (size_t ii = 0; ii < num_frames; ii++) {
+        seq.next_frame(frame);
+        writer.write(frame.data(), frame.size());
+    }
+}
+
+
+// Render frames until the sequencer has no active generators and the tails
+// of its effects have died out (see Sequencer::is_done).
+// Returns the number of frames rendered.
+inline size_t render_until_done(Sequencer &seq, StreamingWavWriter &writer) {
+    check_channels(seq, writer);
+    std::vector<float> frame;
+    size_t count = 0;
+    // Samples left over from an earlier partial render come first
+    size_t buffered = seq.get_buffered_size();
+    if (buffered > 0) {
+        frame.resize(buffered * seq.get_num_channels());
+        seq.render(frame.data(), buffered);
+        writer.write(frame.data(), frame.size());
+    }
+    while (!seq.is_done()) {
+        seq.next_frame(frame);
+        writer.write(frame.data(), frame.size());
+        count++;
+    }
+    return count;
+}
+
+#endif
@@ -0,0 +1,249 @@
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include "simple_tester.h"
+#include "signal_generators.h"
+#include "sequencer.h"
+#include "wav_writer.h"
+
+using tester::TestError;
+using namespace signal;
+
+std::vector<char> read_file(const std::string &path) {
+    std::ifstream input(path, std::ios::binary);
+    return std::vector<char>(
+        std::istreambuf_iterator<char>(input),
+        std::istreambuf_iterator<char>()
+    );
+}
+
+uint16_t read_u16(const std::vector<char> &data, size_t pos) {
+    return static_cast<uint16_t>(static_cast<uint8_t>(data[pos])
+                                 | (static_cast<uint8_t>(data[pos + 1]) << 8));
+}
+
+uint32_t read_u32(const std::vector<char> &data, size_t pos) {
+    uint32_t value = 0;
+    for (size_t ii = 0; ii < 4; ii++) {
+        value |= static_cast<uint32_t>(
+            static_cast<uint8_t>(data[pos + ii])) << (8 * ii);
+    }
+    return value;
+}
+
+int16_t read_int16(const uint8_t *data) {
+    return static_cast<int16_t>(data[0] | (data[1] << 8));
+}
+
+int32_t read_int24(const uint8_t *data) {
+    int32_t value = data[0] | (data[1] << 8) | (data[2] << 16);
+    // Sign extend
+    return (value ^ 0x800000) - 0x800000;
+}
+
+void test_int16_header() {
+    std::string path = "wav_writer_test_int16.wav";
+    size_t count = 1001;
+    {
+        // A small buffer forces many hand-overs to the writer thread
+        StreamingWavWriter writer(path, 16000, SampleFormat::int16, 1, 64);
+        std::vector<float> samples(count, 0.5f);
+        writer.write(samples.data(), samples.size());
+    }
+    std::vector<char> data = read_file(path);
+    std::remove(path.c_str());
+
+    THROW_IF(data.size() != 44 + 2 * count, "File size mismatch");
+    THROW_IF(std::memcmp(data.data(), "RIFF", 4) != 0, "Missing RIFF tag");
+    THROW_IF(read_u32(data, 4) != data.size() - 8, "RIFF size not patched");
+    THROW_IF(read_u32(data, 40) != 2 * count, "Data size not patched");
+    int16_t first = read_int16(reinterpret_cast<uint8_t*>(&data[44]));
+    // 0.5 * 32767 with up to 1 LSB of dither
+    THROW_IF(std::abs(first - 16383.5f) > 1.5f, "Unexpected int16 sample");
+}
+
+void test_int16_no_dither() {
+    std::string path = "wav_writer_test_no_dither.wav";
+    size_t count = 500;
+    {
+        StreamingWavWriter writer(path, 16000, SampleFormat::int16, 1, 64,
+                                  false);
+        std::vector<float> samples(count, 0.5f);
+        writer.write(samples.data(), samples.size());
+    }
+    std::vector<char> data = read_file(path);
+    std::remove(path.c_str());
+
+    THROW_IF(data.size() != 44 + 2 * count, "File size mismatch");
+    const uint8_t *samples = reinterpret_cast<uint8_t*>(&data[44]);
+    int16_t first = read_int16(samples);
+    THROW_IF(std::abs(first - 16383.5f) > 1.0f, "Unexpected int16 sample");
+    for (size_t ii = 1; ii < count; ii++) {
+        THROW_IF(read_int16(samples + 2 * ii) != first,
+                 "Samples dithered with dither off");
+    }
+}
+
+void test_extensible_header() {
+    // 24-bit, and float32 with more than 2 channels
+    struct Case {
+        SampleFormat format;
+        size_t channels;
+        uint16_t subformat;
+        uint32_t mask;
+    };
+    for (Case c: {Case{SampleFormat::int24, 1, 1, 0x4},
+                  Case{SampleFormat::int24, 2, 1, 0x3},
+                  Case{SampleFormat::float32, 3, 3, 0},
+                  Case{SampleFormat::int16, 4, 1, 0}}) {
+        std::string path = "wav_writer_test_extensible.wav";
+        size_t frames = 11;
+        size_t sample_bytes = bytes_per_sample(c.format);
+        {
+            WavFile file(path, 48000, c.format, c.channels);
+            std::vector<float> samples(frames * c.channels, 0.25f);
+            file.write(samples.data(), samples.size());
+        }
+        std::vector<char> data = read_file(path);
+        std::remove(path.c_str());
+
+        bool is_float = c.format == SampleFormat::float32;
+        size_t data_bytes = frames * c.channels * sample_bytes;
+        // 40 byte fmt chunk, and a fact chunk for float32
+        size_t header_size = 12 + 8 + 40 + (is_float ? 12 : 0) + 8;
+        THROW_IF(data.size() != header_size + data_bytes + data_bytes % 2,
+                 "Extensible file size mismatch");
+        THROW_IF(read_u32(data, 16) != 40, "fmt size mismatch");
+        THROW_IF(read_u16(data, 20) != 0xfffe, "Format is not extensible");
+        THROW_IF(read_u16(data, 22) != c.channels, "Channel count mismatch");
+        THROW_IF(read_u16(data, 32) != c.channels * sample_bytes,
+                 "Block align mismatch");
+        THROW_IF(read_u16(data, 36) != 22, "Extension size mismatch");
+        THROW_IF(read_u16(data, 38) != 8 * sample_bytes,
+                 "Valid bits mismatch");
+        THROW_IF(read_u32(data, 40) != c.mask, "Channel mask mismatch");
+        THROW_IF(read_u16(data, 44) != c.subformat, "Subformat mismatch");
+        THROW_IF(std::memcmp(&data[56], "\x00\x38\x9b\x71", 4) != 0,
+                 "Subformat GUID mismatch");
+        THROW_IF(std::memcmp(&data[header_size - 8], "data", 4) != 0,
+                 "Missing data chunk");
+        THROW_IF(read_u32(data, header_size - 4) != data_bytes,
+                 "Data size not patched");
+        if (is_float) {
+            THROW_IF(read_u32(data, 68) != frames,
+                     "Fact sample count not patched");
+        }
+    }
+}
+
+void test_float32_render() {
+    std::string path = "wav_writer_test_float32.wav";
+    size_t frame_size = 160;
+    AdsrParams env_params = {
+        .attack = 100,
+        .decay = 100,
+        .sustain = 1000,
+        .release = 100,
+    };
+    FmSynthModParams mod_params({2, 5}, {1, 1});
+
+    Sequencer seq(frame_size);
+    seq.add(new FmSynthGenerator(
+        mod_params, env_params, env_params,
+        compute_phase_per_sample(440.0f, 16000.0f), 1.0f
+    ));
+
+    size_t num_frames = 0;
+    {
+        StreamingWavWriter writer(path, 16000, SampleFormat::float32, 1, 100);
+        render_frames(seq, writer, 2);
+        num_frames = 2 + render_until_done(seq, writer);
+    }
+    std::vector<char> data = read_file(path);
+    std::remove(path.c_str());
+
+    size_t data_bytes = 4 * frame_size * num_frames;
+    // fmt chunk has 2 extra bytes and there is a 12 byte fact chunk
+    size_t header_size = 44 + 2 + 12;
+    THROW_IF(data.size() != header_size + data_bytes, "File size mismatch");
+    THROW_IF(read_u32(data, header_size - 4) != data_bytes,
+             "Data size not patched");
+    THROW_IF(read_u32(data, header_size - 12) != frame_size * num_frames,
+             "Fact sample count not patched");
+}
+
+void test_pcm_output() {
+    size_t frame_size = 64;
+    size_t channels = 2;
+    Sequencer seq(frame_size, 0.5f);
+    seq.add(new ConstantGenerator(-0.75f, frame_size));
+    seq.add(new ConstantGenerator(4.0f, 2 * frame_size));
+
+    // First frame: (4 - 0.75) * 0.5 clips to full scale
+    std::vector<uint8_t> out(frame_size * channels * 3);
+    seq.next_frame_pcm(out.data(), SampleFormat::int24, channels, true);
+    for (size_t ii = 0; ii < frame_size * channels; ii++) {
+        THROW_IF(read_int24(&out[3 * ii]) < 8388606,
+                 "Clipped int24 sample mismatch");
+    }
+
+    // Second frame: 4 * 0.5 clips, and no dither keeps it exact
+    std::vector<uint8_t> out16(frame_size * 2);
+    seq.next_frame_pcm(out16.data(), SampleFormat::int16, 1, false);
+    for (size_t ii = 0; ii < frame_size; ii++) {
+        int16_t value = read_int16(&out16[2 * ii]);
+        THROW_IF(value != 32767, "Clipped int16 sample mismatch");
+    }
+
+    // Nothing left: dithered silence stays within 1 LSB
+    seq.next_frame_pcm(out16.data(), SampleFormat::int16, 1, true);
+    for (size_t ii = 0; ii < frame_size; ii++) {
+        int16_t value = read_int16(&out16[2 * ii]);
+        THROW_IF(value < -1 || value > 1, "Dither exceeds 1 LSB");
+    }
+}
+
+void test_effect_tail() {
+    std::string path = "wav_writer_test_tail.wav";
+    size_t frame_size = 64;
+    size_t delay = 1000;
+    // A single frame of sound, echoed long after the generator has ended
+    Sequencer seq(frame_size);
+    seq.add(new ConstantGenerator(0.5f, frame_size));
+    seq.add_effect(new FeedbackDelay(delay, 0.5f, 0.5f));
+    {
+        StreamingWavWriter writer(path, 16000, SampleFormat::float32, 1, 100);
+        render_until_done(seq, writer);
+    }
+    std::vector<char> data = read_file(path);
+    std::remove(path.c_str());
+
+    size_t header_size = 44 + 2 + 12;
+    std::vector<float> samples((data.size() - header_size) / sizeof(float));
+    std::memcpy(samples.data(), data.data() + header_size,
+                samples.size() * sizeof(float));
+    THROW_IF(samples.size() < 4 * delay, "Echoes cut off");
+    for (size_t echo = 1; echo <= 3; echo++) {
+        float expected = 0.5f * 0.5f * powf(0.5f, echo - 1);
+        THROW_IF(std::abs(samples[echo * delay] - expected) > 1e-6f,
+                 "Missing echo " + std::to_string(echo));
+    }
+    THROW_IF(std::abs(samples.back()) > silence_level, "Tail not rendered");
+}
+
+int main() {
+    using namespace tester;
+
+    TestCollection tests;
+    ADD_TEST(tests, test_int16_header);
+    ADD_TEST(tests, test_int16_no_dither);
+    ADD_TEST(tests, test_extensible_header);
+    ADD_TEST(tests, test_float32_render);
+    ADD_TEST(tests, test_pcm_output);
+    ADD_TEST(tests, test_effect_tail);
+    return run_tests(tests) ? 1 : 0;
+}